@@ -2,6 +2,11 @@
 
 namespace arch_net {
 
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 int ApplicationClient::init(const std::string &host, int port, ClientOption& option) {
     return init({{host, port}}, option);
 }
@@ -9,12 +14,14 @@ int ApplicationClient::init(const std::string &host, int port, ClientOption& opt
 int ApplicationClient::init(const std::vector<std::pair<std::string, int>> &hosts, ClientOption &option) {
     resolver_ = std::make_unique<FixedListResolver>(hosts);
     resolver_->with_load_balance(new_load_balance(option.load_balance_type));
+    resolver_->with_outlier_detection(option.outlier_detection);
     return do_init(option);
 }
 
 int ApplicationClient::init(const std::string &service_name, ClientOption &option) {
-    resolver_ = std::make_unique<DNSResolver>(service_name);
-    resolver_->with_load_balance(new_load_balance(option.load_balance_type));
+    resolver_ = std::make_unique<DNSResolver>(service_name, option.dns_option,
+                                              new_load_balance(option.load_balance_type));
+    resolver_->with_outlier_detection(option.outlier_detection);
     return do_init(option);
 }
 
@@ -30,6 +37,7 @@ int ApplicationClient::do_init(ClientOption &option) {
         //log
         return -1;
     }
+    client->set_socket_options(option.socket_options);
     if (option.tls_ctx != nullptr) {
         client = ssl::new_tls_client(option.tls_ctx, client, true);
         if (!client) {
@@ -42,18 +50,61 @@ int ApplicationClient::do_init(ClientOption &option) {
             inner_client_.reset(client);
             break;
         case ConnectionType::Pooled:
-            inner_client_ = std::make_unique<TcpSocketPoolClient>(client, true);
+            inner_client_ = std::make_unique<TcpSocketPoolClient>(client, true, option.pool_option);
             break;
         case ConnectionType::Multiplexing:
-            inner_client_ = std::make_unique<mux::MultiplexingSocketClient>(client, true);
+            inner_client_ = std::make_unique<mux::MultiplexingSocketClient>(client, true, option.mux_option);
             break;
     }
     if (!inner_client_) {
         return -1;
     }
+    if (option.connection_type == ConnectionType::Pooled && option.pool_option.warmup_per_endpoint > 0) {
+        warmup();
+    }
     return 1;
 }
 
+void ApplicationClient::warmup() {
+    auto pool = dynamic_cast<TcpSocketPoolClient*>(inner_client_.get());
+    std::vector<ServerNode> servers;
+    resolver_->get_servers(servers);
+    if (!pool || servers.empty()) {
+        return;
+    }
+    // connect on an io worker like every other connection and wait for it
+    Promise<ClientErrorCode, int> promise;
+    ConsistentIOWorker worker;
+    int n = option_.pool_option.warmup_per_endpoint;
+    worker.addTask([pool, servers, n, promise]() {
+        int warmed = 0;
+        for (auto& server : servers) {
+            warmed += pool->warmup(server.endpoint, n);
+        }
+        promise.setValue(ClientErrorCode::kSuccess, warmed);
+    });
+    int warmed = 0;
+    promise.getFuture().get(warmed);
+    if (warmed < n * (int)servers.size()) {
+        LOG(ERROR) << "warmup " << warmed << " of " << n * servers.size() << " pooled connections";
+    }
+}
+
+ClientConnection::~ClientConnection() {
+    if (tracked_endpoint_) {
+        int64_t end = done_us_ > 0 ? done_us_ : now_us();
+        client_->on_request_finish(*tracked_endpoint_, end - start_us_, failed_);
+    }
+    if (owner_ship_) stream_->close();
+    delete stream_;
+}
+
+void ClientConnection::track_load(const EndPoint &endpoint) {
+    tracked_endpoint_ = std::make_unique<EndPoint>(endpoint);
+    start_us_ = now_us();
+    client_->on_request_start(endpoint);
+}
+
 size_t ClientConnection::send_message(Buffer *buffer, int n) {
     auto f = future_send_message(buffer, n);
     size_t val;
@@ -70,6 +121,14 @@ size_t ClientConnection::send_message(const void *buf, size_t count) {
     return val;
 }
 
+size_t ClientConnection::send_message(IOBuffer *buffer) {
+    auto f = future_send_message(buffer);
+    size_t val;
+    auto ret = f.get(val);
+    (void )ret;
+    return val;
+}
+
 size_t ClientConnection::recv_message(Buffer *buffer, int n) {
     auto f = future_recv_message(buffer, n);
     size_t val;
@@ -101,20 +160,31 @@ Future<ClientErrorCode, size_t> ClientConnection::future_send_message(const void
     Promise<ClientErrorCode, size_t> promise;
     attached_worker_->addTask([buf = buf, promise, count, this]() {
         auto ret = stream_->send(buf, count);
+        failed_ |= ret <= 0;
         promise.setValue(ClientErrorCode::kSuccess, ret);
     });
     return promise.getFuture();
 }
 
+Future<ClientErrorCode, size_t> ClientConnection::future_send_message(IOBuffer *buffer) {
+    Promise<ClientErrorCode, size_t> promise;
+    attached_worker_->addTask([buffer = buffer, promise, this]() {
+        auto ret = buffer->WriteToSocketStream(stream_);
+        failed_ |= ret <= 0;
+        promise.setValue(ret > 0 ? ClientErrorCode::kSuccess : ClientErrorCode::kError, ret);
+    });
+    return promise.getFuture();
+}
+
 Future<ClientErrorCode, size_t> ClientConnection::future_recv_message(Buffer *buffer, int n) {
     Promise<ClientErrorCode, size_t> promise;
     attached_worker_->addTask([buffer = buffer, promise, n, this]() {
-        if (n < 0) {
-            auto ret = buffer->ReadFromSocketStream(stream_);
-            promise.setValue(ClientErrorCode::kSuccess, ret);
-            return ;
+        auto ret = n < 0 ? buffer->ReadFromSocketStream(stream_) : buffer->ReadNFromSocketStream(stream_, n);
+        if (ret > 0) {
+            done_us_ = now_us();
+        } else {
+            failed_ = true;
         }
-        auto ret = buffer->ReadNFromSocketStream(stream_, n);
         promise.setValue(ClientErrorCode::kSuccess, ret);
     });
     return promise.getFuture();
@@ -127,11 +197,13 @@ Future<ClientErrorCode, size_t> ClientConnection::future_recv_message(void *buf,
         while (sent < len) {
             uint32_t b = stream_->recv(buffer + sent, len - sent);
             if (b <= 0) {
+                failed_ = true;
                 promise.setValue(ClientErrorCode::kError, b);
                 return;
             }
             sent += b;
         }
+        done_us_ = now_us();
         promise.setValue(ClientErrorCode::kSuccess, sent);
     });
     return promise.getFuture();
@@ -154,8 +226,10 @@ Future<ClientErrorCode, ClientConnection*> ApplicationClient::future_get_connect
     auto attached_worker = new ConsistentIOWorker();
     attached_worker->addTask([callopt, promise, attached_worker, this]() {
         SocketStreamPtr stream;
+        EndPoint endpoint;
         if (callopt && callopt->end_point) {
-            stream = inner_client_->connect(*(callopt->end_point));
+            endpoint = *(callopt->end_point);
+            stream = inner_client_->connect(endpoint);
             if (!stream) {
                 promise.setValue(ClientErrorCode::kError, nullptr);
                 return;
@@ -168,16 +242,30 @@ Future<ClientErrorCode, ClientConnection*> ApplicationClient::future_get_connect
             mutex_.lock();
             auto node = resolver_->get_next(seed);
             mutex_.unlock();
-            stream = inner_client_->connect(node.endpoint);
+            endpoint = node.endpoint;
+            stream = inner_client_->connect(endpoint);
             if (!stream) {
+                // a failed connect is a failed request for the balancer
+                on_request_start(endpoint);
+                on_request_finish(endpoint, 0, true);
                 promise.setValue(ClientErrorCode::kError, nullptr);
                 return;
             }
         }
-        promise.setValue(ClientErrorCode::kSuccess, new ClientConnection(stream, true, this, attached_worker));
+        auto conn = new ClientConnection(stream, true, this, attached_worker);
+        conn->track_load(endpoint);
+        promise.setValue(ClientErrorCode::kSuccess, conn);
     });
 
     return promise.getFuture();
 }
 
-}
\ No newline at end of file
+void ApplicationClient::on_request_start(const EndPoint &endpoint) {
+    resolver_->on_start(endpoint);
+}
+
+void ApplicationClient::on_request_finish(const EndPoint &endpoint, int64_t latency_us, bool failed) {
+    resolver_->on_finish(endpoint, latency_us, failed);
+}
+
+}
@@ -9,6 +9,7 @@
 #include "socket_pool.h"
 #include "utils/future/future.h"
 #include "buffer.h"
+#include "io_buffer.h"
 #include "mux_session.h"
 
 namespace arch_net {
@@ -40,8 +41,18 @@ struct ClientOption {
     ssl::TLSContext* tls_ctx{nullptr};
     // resolver
     ResolveType resolve_type;
+    // nameservers and refresh of init(service_name)
+    DNSResolverOption dns_option;
     // load balance
     LoadBalanceType load_balance_type{LoadBalanceType::Random};
+    // ejection of failing endpoints, off by default
+    OutlierDetectionOption outlier_detection;
+    // tcp tuning applied to every connection
+    SocketOptions socket_options;
+    // limits and warmup of ConnectionType::Pooled
+    SocketPoolOption pool_option;
+    // sessions per endpoint of ConnectionType::Multiplexing
+    mux::MuxClientOption mux_option;
 };
 
 struct CallOption {
@@ -59,13 +70,21 @@ public:
     ClientConnection(SocketStreamPtr stream, bool owner_ship, ApplicationClient* client,
         ConsistentIOWorker* worker) : stream_(stream),
         owner_ship_(owner_ship), client_(client), attached_worker_(worker) {}
-    ~ClientConnection() { if (owner_ship_) stream_->close(); delete stream_; }
+    ~ClientConnection();
+
+    // track_load reports this connection as one request to endpoint: the load balancer
+    // sees it in flight until the connection is destroyed, with the time up to the
+    // last completed recv as its latency
+    void track_load(const EndPoint& endpoint);
 
     // send
     size_t send_message(Buffer* buffer, int n = -1);
     size_t send_message(const void *buf, size_t count);
+    // flushes the whole chain with writev, buffer is empty after a successful send
+    size_t send_message(IOBuffer* buffer);
     Future<ClientErrorCode, size_t> future_send_message(Buffer* buffer, int n = -1);
     Future<ClientErrorCode, size_t> future_send_message(const void *buf, size_t count);
+    Future<ClientErrorCode, size_t> future_send_message(IOBuffer* buffer);
 
     // recv
     size_t recv_message(Buffer* buffer, int n = -1);
@@ -84,6 +103,12 @@ private:
     bool owner_ship_;
     ApplicationClient* client_;
     std::unique_ptr<ConsistentIOWorker> attached_worker_{};
+
+    // load feedback, written by the attached worker
+    std::unique_ptr<EndPoint> tracked_endpoint_{};
+    int64_t start_us_{0};
+    int64_t done_us_{0};
+    bool failed_{false};
 };
 
 class ApplicationClient : public TNonCopyable {
@@ -103,6 +128,13 @@ public:
 private:
     int do_init(ClientOption& option);
 
+    // warmup opens pool_option.warmup_per_endpoint pooled connections to every known server
+    void warmup();
+
+    friend class ClientConnection;
+    void on_request_start(const EndPoint& endpoint);
+    void on_request_finish(const EndPoint& endpoint, int64_t latency_us, bool failed);
+
 private:
     std::unique_ptr<ISocketClient> inner_client_;
     std::unique_ptr<ResolverWithLB> resolver_;
@@ -32,6 +32,12 @@ struct ServerConfig {
     std::string tls_cert_path{};
     std::string tls_key_path{};
     int io_thread_num{1};
+    // IOUring needs ARCH_NET_IO_URING and acl built with io_uring support, both off by
+    // default, otherwise the io threads stay on epoll
+    IOEngine io_engine{IOEngine::Epoll};
+    // ReusePort gives every io thread its own listener instead of all of them waking up on one
+    AcceptMode accept_mode{AcceptMode::SharedListener};
+    SocketOptions socket_options;
 };
 
 
@@ -80,6 +86,15 @@ public:
         return start(config);
     }
 
+    // shutdown may be called from any thread while listen_and_serve blocks,
+    // returns how many connections had to be force closed after the drain timeout
+    int shutdown(int drain_timeout_ms = ISocketServer::kDefaultDrainTimeout) {
+        if (!inner_server_) {
+            return 0;
+        }
+        return inner_server_->shutdown(drain_timeout_ms);
+    }
+
 protected:
     virtual int handle_connection(ISocketStream* stream) = 0;
 
@@ -97,6 +112,9 @@ private:
             return this->handle_connection(stream);
         });
 
+        inner_server_->set_io_engine(config->io_engine);
+        inner_server_->set_accept_mode(config->accept_mode);
+        inner_server_->set_socket_options(config->socket_options);
         inner_server_->start(config->io_thread_num);
         return OK;
     }
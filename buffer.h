@@ -526,42 +526,4 @@ private:
     static const char kCRLF[];
 };
 
-
-const int DefaultSize = 10;
-const int MaxSize = 100;
-
-class GlobalBufferPool : public ThreadLocalSingleton<GlobalBufferPool>{
-public:
-    GlobalBufferPool(int size = DefaultSize, int max_size = MaxSize) : size_(size), max_size_(max_size) {
-        pool_.reserve(max_size);
-        for (int i = 0; i < size; i++) {
-            pool_.emplace_back(new Buffer);
-        }
-    }
-
-    Buffer* Get() {
-        if (pool_.empty()) {
-            return new Buffer;
-        }
-        auto buff = pool_.back();
-        pool_.pop_back();
-        return buff;
-    }
-
-    void Release(Buffer* t) {
-        if (!t) {
-            return;
-        }
-        if (pool_.size() > max_size_) {
-            delete t;
-            return;
-        }
-        pool_.push_back(t);
-    }
-private:
-    int size_;
-    int max_size_;
-    std::vector<Buffer*> pool_;
-};
-
 }
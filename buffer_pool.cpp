@@ -0,0 +1,188 @@
+#include "buffer_pool.h"
+
+namespace arch_net {
+
+const size_t GlobalBufferPool::kSizeClasses[kSizeClassNum] = {
+        1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+// bytes one thread may park per size class, and the depot per size class
+static const size_t kThreadCacheBytes = 256 * 1024;
+static const size_t kDepotBytes = 4 * 1024 * 1024;
+
+struct GlobalBufferPool::ThreadCache {
+    std::vector<Buffer*> lists[kSizeClassNum];
+
+    ~ThreadCache() {
+        auto& pool = GlobalBufferPool::getInstance();
+        for (int i = 0; i < kSizeClassNum; i++) {
+            for (auto buff : lists[i]) {
+                pool.unretain(buff->capacity());
+            }
+            pool.put_to_depot(i, lists[i]);
+        }
+    }
+};
+
+GlobalBufferPool::~GlobalBufferPool() {
+    Trim();
+}
+
+GlobalBufferPool::ThreadCache &GlobalBufferPool::thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+size_t GlobalBufferPool::thread_cache_limit(int cls) {
+    return std::min((size_t)64, std::max((size_t)1, kThreadCacheBytes / kSizeClasses[cls]));
+}
+
+size_t GlobalBufferPool::depot_limit(int cls) {
+    return std::min((size_t)256, std::max((size_t)4, kDepotBytes / kSizeClasses[cls]));
+}
+
+int GlobalBufferPool::size_class_of_request(size_t size) {
+    for (int i = 0; i < kSizeClassNum; i++) {
+        if (size <= kSizeClasses[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int GlobalBufferPool::size_class_of_capacity(size_t capacity) {
+    if (capacity < Buffer::kCheapPrependSize + kSizeClasses[0]) {
+        return -1;
+    }
+    size_t writable = capacity - Buffer::kCheapPrependSize;
+    // a buffer grown far beyond the largest class is not worth keeping around
+    if (writable >= kSizeClasses[kSizeClassNum - 1] * 2) {
+        return -1;
+    }
+    int cls = 0;
+    while (cls + 1 < kSizeClassNum && kSizeClasses[cls + 1] <= writable) {
+        cls++;
+    }
+    return cls;
+}
+
+Buffer *GlobalBufferPool::Get(size_t size_hint) {
+    int cls = size_class_of_request(size_hint);
+    if (cls < 0) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return new Buffer(size_hint);
+    }
+
+    auto& list = thread_cache().lists[cls];
+    if (list.empty()) {
+        std::vector<Buffer*> batch;
+        get_from_depot(cls, batch, std::max((size_t)1, thread_cache_limit(cls) / 2));
+        // a fiber may have refilled the cache while we waited for the depot
+        for (auto buff : batch) {
+            retain(buff->capacity());
+            list.push_back(buff);
+        }
+    }
+    if (list.empty()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return new Buffer(kSizeClasses[cls]);
+    }
+
+    auto buff = list.back();
+    list.pop_back();
+    unretain(buff->capacity());
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return buff;
+}
+
+void GlobalBufferPool::Release(Buffer *buff) {
+    if (!buff) {
+        return;
+    }
+    int cls = size_class_of_capacity(buff->capacity());
+    if (cls < 0) {
+        drops_.fetch_add(1, std::memory_order_relaxed);
+        delete buff;
+        return;
+    }
+    buff->Reset();
+
+    auto& list = thread_cache().lists[cls];
+    list.push_back(buff);
+    retain(buff->capacity());
+    if (list.size() <= thread_cache_limit(cls)) {
+        return;
+    }
+    // hand the older half over to the depot so other threads can reuse it
+    size_t n = list.size() / 2;
+    std::vector<Buffer*> batch(list.begin(), list.begin() + n);
+    list.erase(list.begin(), list.begin() + n);
+    for (auto b : batch) {
+        unretain(b->capacity());
+    }
+    put_to_depot(cls, batch);
+}
+
+void GlobalBufferPool::put_to_depot(int cls, std::vector<Buffer*> &buffs) {
+    if (buffs.empty()) {
+        return;
+    }
+    std::vector<Buffer*> overflow;
+    depot_mutex_.lock();
+    auto& depot = depot_[cls];
+    for (auto buff : buffs) {
+        if (depot.size() < depot_limit(cls)) {
+            depot.push_back(buff);
+            retain(buff->capacity());
+        } else {
+            overflow.push_back(buff);
+        }
+    }
+    depot_mutex_.unlock();
+    buffs.clear();
+
+    drops_.fetch_add(overflow.size(), std::memory_order_relaxed);
+    for (auto buff : overflow) {
+        delete buff;
+    }
+}
+
+void GlobalBufferPool::get_from_depot(int cls, std::vector<Buffer*> &buffs, size_t n) {
+    depot_mutex_.lock();
+    auto& depot = depot_[cls];
+    while (n-- > 0 && !depot.empty()) {
+        auto buff = depot.back();
+        depot.pop_back();
+        unretain(buff->capacity());
+        buffs.push_back(buff);
+    }
+    depot_mutex_.unlock();
+}
+
+void GlobalBufferPool::Trim() {
+    std::vector<Buffer*> all;
+    depot_mutex_.lock();
+    for (auto& depot : depot_) {
+        for (auto buff : depot) {
+            unretain(buff->capacity());
+            all.push_back(buff);
+        }
+        depot.clear();
+    }
+    depot_mutex_.unlock();
+
+    drops_.fetch_add(all.size(), std::memory_order_relaxed);
+    for (auto buff : all) {
+        delete buff;
+    }
+}
+
+GlobalBufferPool::Stats GlobalBufferPool::stats() const {
+    return Stats{
+        hits_.load(std::memory_order_relaxed),
+        misses_.load(std::memory_order_relaxed),
+        drops_.load(std::memory_order_relaxed),
+        bytes_retained_.load(std::memory_order_relaxed)
+    };
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "common.h"
+#include "buffer.h"
+#include <atomic>
+#include <vector>
+
+namespace arch_net {
+
+// GlobalBufferPool hands out Buffers by size class.
+// Every thread keeps a small cache per class so Get/Release usually don't lock,
+// overflowing caches and buffers released on another thread go to a shared depot,
+// and anything above the high water marks (or grown past the largest class) is freed.
+class GlobalBufferPool : public Singleton<GlobalBufferPool> {
+public:
+    // 1K 4K 16K 64K 256K 1M
+    static const int kSizeClassNum = 6;
+    static const size_t kSizeClasses[kSizeClassNum];
+
+    struct Stats {
+        uint64_t hits;           // served from a thread cache or the depot
+        uint64_t misses;         // newly allocated
+        uint64_t drops;          // freed on release because of size or high water
+        int64_t bytes_retained;  // capacity parked in thread caches and the depot
+    };
+
+    GlobalBufferPool() = default;
+    ~GlobalBufferPool();
+
+    // Get returns an empty buffer with at least size_hint writable bytes
+    Buffer* Get(size_t size_hint = 0);
+
+    // Release may be called from any thread
+    void Release(Buffer* buff);
+
+    // Trim frees every buffer parked in the depot
+    void Trim();
+
+    Stats stats() const;
+
+    // size class of a buffer asking for size bytes, -1 if it is not pooled
+    static int size_class_of_request(size_t size);
+    // size class a buffer with capacity belongs to, -1 if it is not pooled
+    static int size_class_of_capacity(size_t capacity);
+
+private:
+    struct ThreadCache;
+    friend struct ThreadCache;
+
+    static ThreadCache& thread_cache();
+    static size_t thread_cache_limit(int cls);
+    static size_t depot_limit(int cls);
+
+    // move buffers between a thread cache and the depot, the caller has already
+    // taken them out of the thread cache so it's fine if the lock yields the fiber
+    void put_to_depot(int cls, std::vector<Buffer*>& buffs);
+    void get_from_depot(int cls, std::vector<Buffer*>& buffs, size_t n);
+
+    void retain(size_t bytes) { bytes_retained_.fetch_add(bytes, std::memory_order_relaxed); }
+    void unretain(size_t bytes) { bytes_retained_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+private:
+    acl::fiber_mutex depot_mutex_;
+    std::vector<Buffer*> depot_[kSizeClassNum];
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> drops_{0};
+    std::atomic<int64_t> bytes_retained_{0};
+};
+
+}
@@ -10,6 +10,7 @@
 #include <fiber/fiber.hpp>
 #include <fiber/go_fiber.hpp>
 #include <fiber/fiber_lock.hpp>
+#include <fiber/fiber_cond.hpp>
 #include <fiber/wait_group.hpp>
 #include <acl_cpp/stdlib/box.hpp>
 #include <fiber/fiber_tbox.hpp>
@@ -0,0 +1,238 @@
+#include "dns.h"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+namespace arch_net {
+
+static const uint16_t kTypeA = 1;
+static const uint16_t kTypeAAAA = 28;
+static const uint16_t kClassIN = 1;
+static const size_t kHeaderSize = 12;
+static const size_t kMaxUDPSize = 1232;
+
+void system_nameservers(std::vector<EndPoint>& nameservers) {
+    std::ifstream in("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key, addr;
+        fields >> key >> addr;
+        EndPoint ep;
+        if (key == "nameserver" && ep.from(addr, 53)) {
+            nameservers.push_back(ep);
+        }
+    }
+}
+
+void system_search_domains(std::vector<std::string>& search, int& ndots) {
+    ndots = 1;
+    std::ifstream in("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key, value;
+        fields >> key;
+        // the last search or domain line wins
+        if (key == "search" || key == "domain") {
+            search.clear();
+            while (fields >> value) {
+                search.push_back(value);
+            }
+        } else if (key == "options") {
+            while (fields >> value) {
+                if (value.compare(0, 6, "ndots:") == 0) {
+                    ndots = std::max(0, atoi(value.c_str() + 6));
+                }
+            }
+        }
+    }
+}
+
+void search_names(const std::string& host, const std::vector<std::string>& search, int ndots,
+                  std::vector<std::string>& names) {
+    names.clear();
+    if (!host.empty() && host.back() == '.') {
+        names.push_back(host.substr(0, host.size() - 1));
+        return;
+    }
+    int dots = std::count(host.begin(), host.end(), '.');
+    if (dots >= ndots) {
+        names.push_back(host);
+    }
+    for (auto& domain : search) {
+        std::string suffix = domain;
+        if (!suffix.empty() && suffix.back() == '.') {
+            suffix.pop_back();
+        }
+        if (!suffix.empty()) {
+            names.push_back(host + "." + suffix);
+        }
+    }
+    if (dots < ndots) {
+        names.push_back(host);
+    }
+}
+
+static void put_u16(std::string& out, uint16_t v) {
+    out.push_back((char)(v >> 8));
+    out.push_back((char)(v & 0xff));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool build_query(uint16_t id, const std::string& host, uint16_t qtype, std::string& out) {
+    out.clear();
+    put_u16(out, id);
+    // recursion desired
+    put_u16(out, 0x0100);
+    put_u16(out, 1);
+    put_u16(out, 0);
+    put_u16(out, 0);
+    put_u16(out, 0);
+    size_t start = 0;
+    while (start < host.size()) {
+        auto end = host.find('.', start);
+        if (end == std::string::npos) {
+            end = host.size();
+        }
+        size_t len = end - start;
+        if (len == 0 || len > 63) {
+            return false;
+        }
+        out.push_back((char)len);
+        out.append(host, start, len);
+        start = end + 1;
+    }
+    out.push_back(0);
+    put_u16(out, qtype);
+    put_u16(out, kClassIN);
+    return true;
+}
+
+// skip_name moves pos past a possibly compressed name
+static bool skip_name(const uint8_t* msg, size_t size, size_t& pos) {
+    while (pos < size) {
+        uint8_t len = msg[pos];
+        if ((len & 0xc0) == 0xc0) {
+            pos += 2;
+            return pos <= size;
+        }
+        pos += len + 1;
+        if (len == 0) {
+            return pos <= size;
+        }
+    }
+    return false;
+}
+
+static int parse_response(const uint8_t* msg, size_t size, uint16_t id, uint16_t qtype,
+                          std::vector<DNSRecord>& records) {
+    if (size < kHeaderSize || get_u16(msg) != id) {
+        return ERR;
+    }
+    uint16_t flags = get_u16(msg + 2);
+    // must be a response, truncation means the answer needs tcp which we don't do
+    if (!(flags & 0x8000) || (flags & 0x0200)) {
+        LOG(ERROR) << "dns response is not usable, flags " << flags;
+        return ERR;
+    }
+    uint16_t rcode = flags & 0x000f;
+    // NXDOMAIN is an answer: the name has no address
+    if (rcode == 3) {
+        return kNXDomain;
+    }
+    if (rcode != 0) {
+        LOG(ERROR) << "dns response error, rcode " << rcode;
+        return ERR;
+    }
+    uint16_t qdcount = get_u16(msg + 4);
+    uint16_t ancount = get_u16(msg + 6);
+    size_t pos = kHeaderSize;
+    for (int i = 0; i < qdcount; i++) {
+        if (!skip_name(msg, size, pos) || pos + 4 > size) {
+            return ERR;
+        }
+        pos += 4;
+    }
+    for (int i = 0; i < ancount; i++) {
+        if (!skip_name(msg, size, pos) || pos + 10 > size) {
+            return ERR;
+        }
+        uint16_t type = get_u16(msg + pos);
+        uint16_t cls = get_u16(msg + pos + 2);
+        uint32_t ttl = get_u32(msg + pos + 4);
+        uint16_t rdlength = get_u16(msg + pos + 8);
+        pos += 10;
+        if (pos + rdlength > size) {
+            return ERR;
+        }
+        // CNAME records of the chain are skipped, the recursive server appends their targets
+        if (cls == kClassIN && type == qtype) {
+            char buf[INET6_ADDRSTRLEN];
+            int family = type == kTypeA ? AF_INET : AF_INET6;
+            if ((type == kTypeA && rdlength == 4) || (type == kTypeAAAA && rdlength == 16)) {
+                if (inet_ntop(family, msg + pos, buf, sizeof(buf))) {
+                    records.push_back(DNSRecord{buf, ttl});
+                }
+            }
+        }
+        pos += rdlength;
+    }
+    return OK;
+}
+
+int dns_query(const EndPoint& nameserver, const std::string& host, int family,
+              std::vector<DNSRecord>& records, int timeout_ms) {
+    static thread_local std::mt19937 gen(std::random_device{}());
+    uint16_t id = (uint16_t)gen();
+    uint16_t qtype = family == AF_INET6 ? kTypeAAAA : kTypeA;
+    std::string query;
+    if (!build_query(id, host, qtype, query)) {
+        LOG(ERROR) << "invalid dns name " << host;
+        return ERR;
+    }
+
+    int fd = nameserver.sock_addr.ss_family == AF_INET6 ? udp6_socket() : udp_socket();
+    if (fd < 0) {
+        return ERR;
+    }
+    defer(arch_net::close(fd));
+    socklen_t addrlen = nameserver.sock_addr.ss_family == AF_INET6 ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    auto to = (const struct sockaddr*)&nameserver.sock_addr;
+    if (arch_net::sendto(fd, query.data(), query.size(), 0, to, addrlen) < 0) {
+        LOG(ERROR) << "send dns query error " << strerror(errno);
+        return ERR;
+    }
+
+    uint8_t buf[kMaxUDPSize];
+    while (true) {
+        if (wait_fd_read_timeout(fd, timeout_ms) <= 0) {
+            LOG(ERROR) << "dns query " << host << " timeout";
+            return ERR;
+        }
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        auto n = arch_net::recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+        if (n < 0) {
+            return ERR;
+        }
+        // stray or spoofed datagrams don't end the query
+        EndPoint peer;
+        peer.sock_addr = from;
+        if (peer != nameserver || (size_t)n < kHeaderSize || get_u16(buf) != id) {
+            continue;
+        }
+        return parse_response(buf, n, id, qtype, records);
+    }
+}
+
+}
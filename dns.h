@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+#include "socket_stream.h"
+
+namespace arch_net {
+
+struct DNSRecord {
+    std::string addr;
+    uint32_t ttl{0};
+};
+
+// system_nameservers reads the nameserver lines of /etc/resolv.conf
+void system_nameservers(std::vector<EndPoint>& nameservers);
+
+// system_search_domains reads the search (or domain) list and the ndots option of
+// /etc/resolv.conf, ndots is 1 when it isn't set
+void system_search_domains(std::vector<std::string>& search, int& ndots);
+
+// search_names lists the names to query for host in order, like the libc resolver:
+// host itself first when it has at least ndots dots, after the search list otherwise.
+// A trailing dot makes host absolute
+void search_names(const std::string& host, const std::vector<std::string>& search, int ndots,
+                  std::vector<std::string>& names);
+
+// dns_query returns kNXDomain when the server answered that the name doesn't exist
+const int kNXDomain = 1;
+
+// dns_query asks nameserver for the A (AF_INET) or AAAA (AF_INET6) records of host over udp,
+// following the answers of a recursive server. Only the calling fiber blocks.
+// Returns OK with the records (none when the name has no such address), kNXDomain for NXDOMAIN,
+// ERR when the server didn't answer within timeout_ms or answered with an error.
+int dns_query(const EndPoint& nameserver, const std::string& host, int family,
+              std::vector<DNSRecord>& records, int timeout_ms = 2000);
+
+}
@@ -23,6 +23,29 @@ void HttpResponse::html(int status_code, const std::string &data) {
     make_response(data);
 }
 
+int HttpResponse::file(int status_code, const std::string &path, const std::string &content_type) {
+    close_file();
+    buffer_.Reset();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "open file " << path << " error " << strerror(errno);
+        text(404, "file not found");
+        return ERR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        text(404, "file not found");
+        return ERR;
+    }
+    file_fd_ = fd;
+    file_size_ = st.st_size;
+    http_status_code_ = status_code;
+    set_header("Content-Type", content_type);
+    make_header(file_size_);
+    return OK;
+}
+
 void HttpResponse::add_content_len(const int64_t size) {
     char len[42];
     snprintf(len, sizeof(len), "Content-Length:%ld\r\n", size) ;
@@ -43,6 +66,15 @@ void HttpResponse::add_date() {
 }
 
 void HttpResponse::make_response(const std::string& body) {
+    make_header(body.size());
+    if (http_status_code_ == 400) {
+        return;
+    }
+    // append body
+    buffer_.Append(body);
+}
+
+void HttpResponse::make_header(int64_t content_length) {
     //HTTP/%d.%d code reason\r\n
     auto response_code_iter = http_status_code.find(http_status_code_);
     if (response_code_iter == http_status_code.end()) {
@@ -59,7 +91,7 @@ void HttpResponse::make_response(const std::string& body) {
         return;
     }
     add_date();
-    add_content_len(body.size());
+    add_content_len(content_length);
     for (auto & it : headers_) {
         buffer_.Append(it.first);
         buffer_.Append(":");
@@ -67,14 +99,21 @@ void HttpResponse::make_response(const std::string& body) {
         buffer_.Append("\r\n");
     }
     buffer_.Append("\r\n");
-    // append body
-    buffer_.Append(body);
 }
 
 int HttpResponse::send(ISocketStream* stream) {
     auto rc = stream->send(buffer_.data(), buffer_.length());
     buffer_.Reset();
-    return rc;
+    if (rc <= 0 || file_fd_ < 0) {
+        close_file();
+        return rc;
+    }
+    auto n = stream->sendfile(file_fd_, 0, file_size_);
+    close_file();
+    if (n < 0) {
+        return n;
+    }
+    return rc + n;
 }
 
 }}
\ No newline at end of file
@@ -54,7 +54,7 @@ public:
 
     HttpResponse() {};
 
-    virtual ~HttpResponse() = default;
+    virtual ~HttpResponse() { close_file(); }
 
     int send(ISocketStream* stream);
 
@@ -68,6 +68,11 @@ public:
 
     void json(int status_code, const std::string &data);
 
+    // file responds with the content of path, the body is not read into the response
+    // buffer but handed to ISocketStream::sendfile when the response is sent.
+    int file(int status_code, const std::string &path,
+             const std::string &content_type = "application/octet-stream");
+
     friend std::ostream& operator<<(std::ostream& os, const HttpResponse& res) {
         os << res.buffer_.ToString();
         return os;
@@ -86,6 +91,7 @@ public:
     }
 
     void reset() {
+        close_file();
         buffer_.Reset();
         headers_.clear();
         http_status_code_ = -1;
@@ -94,6 +100,14 @@ public:
 
 private:
     void make_response(const std::string& body);
+    void make_header(int64_t content_length);
+    void close_file() {
+        if (file_fd_ >= 0) {
+            ::close(file_fd_);
+            file_fd_ = -1;
+        }
+        file_size_ = 0;
+    }
     void add_date();
     void add_content_len(const int64_t size);
 
@@ -102,6 +116,8 @@ private:
     std::unordered_map<std::string, std::string> headers_;
     Buffer buffer_;
     bool keep_alive_;
+    int file_fd_{-1};
+    size_t file_size_{0};
 };
 
 
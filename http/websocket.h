@@ -3,6 +3,7 @@
 
 #include "../common.h"
 #include "request.h"
+#include "../buffer_pool.h"
 
 const int WEBSOCKET_HEARTBEAT_INTERVAL = 3000;
 
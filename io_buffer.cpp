@@ -0,0 +1,360 @@
+#include "io_buffer.h"
+#include "buffer.h"
+#include <arpa/inet.h>
+
+namespace arch_net {
+
+const size_t IOBlock::kDefaultSize = 8192 - sizeof(IOBlock);
+const size_t IOBuffer::kCheapPrependSize = 16;
+
+// iovecs handed to a single writev, bounded by IOV_MAX
+static const int kMaxIOVPerWrite = 256;
+
+IOBlock *IOBlock::create(size_t capacity) {
+    auto mem = static_cast<char*>(::malloc(sizeof(IOBlock) + capacity));
+    if (!mem) {
+        throw std::bad_alloc();
+    }
+    auto block = new (mem) IOBlock;
+    block->ref.store(1, std::memory_order_relaxed);
+    block->data = mem + sizeof(IOBlock);
+    block->capacity = capacity;
+    block->used = 0;
+    block->deleter = nullptr;
+    block->deleter_arg = nullptr;
+    return block;
+}
+
+IOBlock *IOBlock::wrap(void *data, size_t size, Deleter deleter, void *arg) {
+    auto block = new (::malloc(sizeof(IOBlock))) IOBlock;
+    block->ref.store(1, std::memory_order_relaxed);
+    block->data = static_cast<char*>(data);
+    block->capacity = size;
+    block->used = size;
+    block->deleter = deleter;
+    block->deleter_arg = arg;
+    return block;
+}
+
+void IOBlock::dec_ref() {
+    if (ref.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (deleter) {
+        deleter(data, deleter_arg);
+    }
+    this->~IOBlock();
+    ::free(this);
+}
+
+IOBuffer::IOBuffer(const IOBuffer &rhs) {
+    Append(rhs);
+}
+
+IOBuffer::IOBuffer(IOBuffer &&rhs) noexcept {
+    Swap(rhs);
+}
+
+IOBuffer &IOBuffer::operator=(const IOBuffer &rhs) {
+    if (this != &rhs) {
+        Clear();
+        Append(rhs);
+    }
+    return *this;
+}
+
+IOBuffer &IOBuffer::operator=(IOBuffer &&rhs) noexcept {
+    if (this != &rhs) {
+        Clear();
+        Swap(rhs);
+    }
+    return *this;
+}
+
+void IOBuffer::Swap(IOBuffer &rhs) {
+    refs_.swap(rhs.refs_);
+    std::swap(head_, rhs.head_);
+    std::swap(length_, rhs.length_);
+}
+
+void IOBuffer::push_back_ref(const BlockRef &r) {
+    if (r.length == 0) {
+        r.block->dec_ref();
+        return;
+    }
+    // merge with the previous slice when it is the adjacent part of the same block
+    if (block_count() > 0) {
+        auto& back = refs_.back();
+        if (back.block == r.block && back.offset + back.length == r.offset) {
+            back.length += r.length;
+            length_ += r.length;
+            r.block->dec_ref();
+            return;
+        }
+    }
+    refs_.push_back(r);
+    length_ += r.length;
+}
+
+void IOBuffer::pop_front_ref() {
+    auto& r = refs_[head_];
+    length_ -= r.length;
+    r.block->dec_ref();
+    if (++head_ == refs_.size()) {
+        refs_.clear();
+        head_ = 0;
+    } else if (head_ >= 32 && head_ * 2 >= refs_.size()) {
+        refs_.erase(refs_.begin(), refs_.begin() + head_);
+        head_ = 0;
+    }
+}
+
+IOBlock *IOBuffer::writable_tail() {
+    if (block_count() == 0) {
+        return nullptr;
+    }
+    auto& back = refs_.back();
+    auto block = back.block;
+    if (block->is_user_data()
+        || block->ref.load(std::memory_order_acquire) != 1
+        || back.offset + back.length != block->used
+        || block->left_space() == 0) {
+        return nullptr;
+    }
+    return block;
+}
+
+void IOBuffer::Append(const void *d, size_t len) {
+    auto p = static_cast<const char*>(d);
+    while (len > 0) {
+        auto block = writable_tail();
+        if (!block) {
+            size_t reserve = empty() ? kCheapPrependSize : 0;
+            block = IOBlock::create(std::max(IOBlock::kDefaultSize, std::min(len + reserve, IOBlock::kDefaultSize * 8)));
+            block->used = reserve;
+            refs_.push_back(BlockRef{block, reserve, 0});
+        }
+        auto n = std::min(len, block->left_space());
+        memcpy(block->data + block->used, p, n);
+        block->used += n;
+        refs_.back().length += n;
+        length_ += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void IOBuffer::Append(const Buffer &buff) {
+    Append(buff.data(), buff.size());
+}
+
+void IOBuffer::Append(const IOBuffer &other) {
+    // other may be *this, so iterate over a fixed count
+    size_t n = other.block_count();
+    refs_.reserve(block_count() + n);
+    for (size_t i = 0; i < n; i++) {
+        auto r = other.block_ref(i);
+        r.block->inc_ref();
+        push_back_ref(r);
+    }
+}
+
+void IOBuffer::Append(IOBuffer &&other) {
+    if (empty()) {
+        Swap(other);
+        other.Clear();
+        return;
+    }
+    for (size_t i = other.head_; i < other.refs_.size(); i++) {
+        push_back_ref(other.refs_[i]);
+    }
+    other.refs_.clear();
+    other.head_ = 0;
+    other.length_ = 0;
+}
+
+void IOBuffer::AppendUserData(void *data, size_t len, IOBlock::Deleter deleter, void *arg) {
+    assert(deleter);
+    push_back_ref(BlockRef{IOBlock::wrap(data, len, deleter, arg), 0, len});
+}
+
+void IOBuffer::AppendBlock(IOBlock *block, size_t offset, size_t len) {
+    block->inc_ref();
+    push_back_ref(BlockRef{block, offset, len});
+}
+
+void IOBuffer::Prepend(const void *d, size_t len) {
+    if (block_count() > 0) {
+        auto& front = refs_[head_];
+        auto block = front.block;
+        if (!block->is_user_data() && front.offset >= len
+            && block->ref.load(std::memory_order_acquire) == 1) {
+            front.offset -= len;
+            front.length += len;
+            length_ += len;
+            memcpy(block->data + front.offset, d, len);
+            return;
+        }
+    }
+    auto block = IOBlock::create(std::max(len, (size_t)64));
+    memcpy(block->data, d, len);
+    block->used = len;
+    if (head_ > 0) {
+        refs_[--head_] = BlockRef{block, 0, len};
+    } else {
+        refs_.insert(refs_.begin(), BlockRef{block, 0, len});
+    }
+    length_ += len;
+}
+
+void IOBuffer::AppendUInt32(uint32_t x) {
+    uint32_t be32 = htonl(x);
+    Append(&be32, sizeof be32);
+}
+
+void IOBuffer::PrependUInt32(uint32_t x) {
+    uint32_t be32 = htonl(x);
+    Prepend(&be32, sizeof be32);
+}
+
+size_t IOBuffer::Cut(IOBuffer *out, size_t n) {
+    n = std::min(n, length_);
+    size_t left = n;
+    while (left > 0) {
+        auto& front = refs_[head_];
+        if (front.length <= left) {
+            left -= front.length;
+            front.block->inc_ref();
+            out->push_back_ref(front);
+            pop_front_ref();
+            continue;
+        }
+        front.block->inc_ref();
+        out->push_back_ref(BlockRef{front.block, front.offset, left});
+        front.offset += left;
+        front.length -= left;
+        length_ -= left;
+        left = 0;
+    }
+    return n;
+}
+
+size_t IOBuffer::Skip(size_t n) {
+    n = std::min(n, length_);
+    size_t left = n;
+    while (left > 0) {
+        auto& front = refs_[head_];
+        if (front.length <= left) {
+            left -= front.length;
+            pop_front_ref();
+            continue;
+        }
+        front.offset += left;
+        front.length -= left;
+        length_ -= left;
+        left = 0;
+    }
+    return n;
+}
+
+void IOBuffer::Clear() {
+    for (size_t i = head_; i < refs_.size(); i++) {
+        refs_[i].block->dec_ref();
+    }
+    refs_.clear();
+    head_ = 0;
+    length_ = 0;
+}
+
+size_t IOBuffer::CopyTo(void *d, size_t n, size_t pos) const {
+    auto p = static_cast<char*>(d);
+    size_t copied = 0;
+    for (size_t i = head_; i < refs_.size() && copied < n; i++) {
+        auto& r = refs_[i];
+        if (pos >= r.length) {
+            pos -= r.length;
+            continue;
+        }
+        auto m = std::min(n - copied, (size_t)r.length - pos);
+        memcpy(p + copied, r.block->data + r.offset + pos, m);
+        copied += m;
+        pos = 0;
+    }
+    return copied;
+}
+
+std::string IOBuffer::ToString() const {
+    std::string s;
+    s.resize(length_);
+    CopyTo(&s[0], length_);
+    return s;
+}
+
+int IOBuffer::FillIOVec(struct iovec *iov, int max_iov) const {
+    int cnt = 0;
+    for (size_t i = head_; i < refs_.size() && cnt < max_iov; i++, cnt++) {
+        iov[cnt].iov_base = refs_[i].block->data + refs_[i].offset;
+        iov[cnt].iov_len = refs_[i].length;
+    }
+    return cnt;
+}
+
+ssize_t IOBuffer::WriteToSocketStream(ISocketStream *stream) {
+    struct iovec iov[kMaxIOVPerWrite];
+    ssize_t total = 0;
+    while (!empty()) {
+        int cnt = FillIOVec(iov, kMaxIOVPerWrite);
+        auto n = cnt == 1 ? stream->send(iov[0].iov_base, iov[0].iov_len) : stream->send(iov, cnt);
+        if (n <= 0) {
+            return n;
+        }
+        Skip(n);
+        total += n;
+    }
+    return total;
+}
+
+ssize_t IOBuffer::ReadFromSocketStream(ISocketStream *stream, size_t size_hint) {
+    auto block = writable_tail();
+    if (!block || block->left_space() < std::min(size_hint, IOBlock::kDefaultSize) / 4) {
+        block = IOBlock::create(std::max(size_hint, IOBlock::kDefaultSize));
+        refs_.push_back(BlockRef{block, 0, 0});
+    }
+    auto n = stream->recv(block->data + block->used, block->left_space());
+    if (n > 0) {
+        block->used += n;
+        refs_.back().length += n;
+        length_ += n;
+    } else if (refs_.back().length == 0) {
+        refs_.pop_back();
+        block->dec_ref();
+    }
+    return n;
+}
+
+ssize_t IOBuffer::ReadNFromSocketStream(ISocketStream *stream, size_t n) {
+    size_t left = n;
+    while (left > 0) {
+        auto block = writable_tail();
+        if (!block) {
+            block = IOBlock::create(std::max(left, IOBlock::kDefaultSize));
+            refs_.push_back(BlockRef{block, 0, 0});
+        }
+        auto want = std::min(left, block->left_space());
+        auto r = stream->recv(block->data + block->used, want);
+        if (r <= 0) {
+            if (refs_.back().length == 0) {
+                refs_.pop_back();
+                block->dec_ref();
+            }
+            return r;
+        }
+        block->used += r;
+        refs_.back().length += r;
+        length_ += r;
+        left -= r;
+    }
+    return n;
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include "common.h"
+#include "socket_stream.h"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+namespace arch_net {
+
+class Buffer;
+
+// IOBlock is a refcounted chunk of memory. Owned blocks carry their payload right
+// behind the header, user blocks point to memory handed over by the caller and
+// run the deleter once the last reference is gone.
+struct IOBlock {
+    using Deleter = void (*)(void* data, void* arg);
+
+    static const size_t kDefaultSize;
+
+    std::atomic<int> ref;
+    char* data;
+    size_t capacity;
+    size_t used;          // bytes written by the owner, only grows
+    Deleter deleter;      // nullptr for owned blocks
+    void* deleter_arg;
+
+    static IOBlock* create(size_t capacity = kDefaultSize);
+    static IOBlock* wrap(void* data, size_t size, Deleter deleter, void* arg);
+
+    void inc_ref() { ref.fetch_add(1, std::memory_order_relaxed); }
+    void dec_ref();
+
+    // for user data whose lifetime is managed by the caller
+    static void NoopDeleter(void*, void*) {}
+
+    bool is_user_data() const { return deleter != nullptr; }
+    size_t left_space() const { return capacity - used; }
+};
+
+// IOBuffer is a chain of slices over IOBlocks. Appending never moves data already
+// in the chain, Cut/Share hand out slices by bumping the block refcount, and the whole
+// chain can be flushed with writev through ISocketStream::send(iovec).
+// IOBuffer is not thread safe, the blocks behind it are.
+class IOBuffer {
+public:
+    // offset and length are size_t, user data and cuts may span 4GB and more
+    struct BlockRef {
+        IOBlock* block;
+        size_t offset;
+        size_t length;
+    };
+
+    // reserved in front of the first owned block so small headers can be prepended in place
+    static const size_t kCheapPrependSize;
+
+    IOBuffer() = default;
+    IOBuffer(const IOBuffer& rhs);
+    IOBuffer(IOBuffer&& rhs) noexcept;
+    IOBuffer& operator=(const IOBuffer& rhs);
+    IOBuffer& operator=(IOBuffer&& rhs) noexcept;
+    ~IOBuffer() { Clear(); }
+
+    void Swap(IOBuffer& rhs);
+
+    // Append copies len bytes into the tail block, allocating new blocks as needed
+    void Append(const void* d, size_t len);
+    void Append(const std::string& s) { Append(s.data(), s.size()); }
+    void Append(const Slice& s) { Append(s.data(), s.size()); }
+    void Append(const Buffer& buff);
+    // Append shares every block of other, no bytes are copied
+    void Append(const IOBuffer& other);
+    void Append(IOBuffer&& other);
+
+    // AppendUserData references data without copying it, deleter(data, arg) is called
+    // once no IOBuffer refers to it anymore. deleter must not be nullptr.
+    void AppendUserData(void* data, size_t len, IOBlock::Deleter deleter, void* arg = nullptr);
+
+    // AppendBlock shares len bytes of block from offset, the caller keeps its own reference
+    void AppendBlock(IOBlock* block, size_t offset, size_t len);
+
+    // Prepend inserts len bytes in front of the readable data
+    void Prepend(const void* d, size_t len);
+
+    void AppendUInt32(uint32_t x);
+    void PrependUInt32(uint32_t x);
+
+    // Cut moves the first n bytes into out, the boundary block is shared
+    size_t Cut(IOBuffer* out, size_t n);
+    // Share returns a buffer referring to the same bytes
+    IOBuffer Share() const { return IOBuffer(*this); }
+
+    // Skip drops the first n bytes
+    size_t Skip(size_t n);
+    void Clear();
+
+    size_t CopyTo(void* d, size_t n, size_t pos = 0) const;
+    std::string ToString() const;
+
+    // FillIOVec points at most max_iov entries of iov at the readable blocks
+    int FillIOVec(struct iovec* iov, int max_iov) const;
+
+    // WriteToSocketStream flushes the chain with writev until it is empty,
+    // returns the bytes written or the error code of the stream
+    ssize_t WriteToSocketStream(ISocketStream* stream);
+
+    // ReadFromSocketStream reads into the free space of the tail block
+    ssize_t ReadFromSocketStream(ISocketStream* stream, size_t size_hint = IOBlock::kDefaultSize);
+    ssize_t ReadNFromSocketStream(ISocketStream* stream, size_t n);
+
+    size_t length() const { return length_; }
+    size_t size() const { return length_; }
+    bool empty() const { return length_ == 0; }
+    size_t block_count() const { return refs_.size() - head_; }
+    const BlockRef& block_ref(size_t i) const { return refs_[head_ + i]; }
+
+private:
+    void push_back_ref(const BlockRef& r);
+    // tail returns the last block if bytes can be appended to it in place
+    IOBlock* writable_tail();
+    void pop_front_ref();
+
+private:
+    std::vector<BlockRef> refs_;
+    size_t head_{0};
+    size_t length_{0};
+};
+
+}
@@ -2,6 +2,10 @@
 #include "common.h"
 #include "map"
 #include "random"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include "socket_stream.h"
 
 namespace arch_net {
@@ -9,7 +13,13 @@ namespace arch_net {
 enum class LoadBalanceType {
     ConsistentHash,
     Random,
-    WeightedRandom
+    WeightedRandom,
+    Maglev,
+    JumpHash,
+    // power of two choices over requests in flight
+    LeastOutstanding,
+    // power of two choices over peak EWMA latency * requests in flight
+    P2CEWMA,
 };
 
 
@@ -17,7 +27,8 @@ struct ServerNode {
     EndPoint endpoint{};
     std::string tag{};
     int32_t weight{-1};
-    bool valid{false};
+    // cleared while the resolver ejects the endpoint as an outlier
+    bool valid{true};
 
     friend inline bool operator<(const ServerNode& s1, const ServerNode& s2) {
         return s1.endpoint == s2.endpoint ? s1.weight < s2.weight : s1.endpoint < s2.endpoint;
@@ -29,62 +40,244 @@ public:
     virtual ServerNode get_next(uint32_t seed, const std::vector<ServerNode>& servers = {}) = 0;
     virtual ~LoadBalance() {}
     virtual void on_changed(const std::vector<ServerNode>& new_servers) = 0;
+
+    // on_start and on_finish report a request routed to endpoint,
+    // balancers that don't weigh load ignore them
+    virtual void on_start(const EndPoint& endpoint) {}
+    virtual void on_finish(const EndPoint& endpoint, int64_t latency_us, bool failed) {}
 };
 
-class ConsistentHashBalance : public LoadBalance {
-public:
-    using ServerRing = std::map<uint32_t, ServerNode>;
+// random_u64 draws from a per thread generator, or derives a value from seed
+// so the same seed keeps picking the same server
+inline uint64_t random_u64(uint32_t seed) {
+    if (seed != 0) {
+        // splitmix64
+        uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    static thread_local std::mt19937_64 gen(std::random_device{}());
+    return gen();
+}
 
-    ConsistentHashBalance(int factor) : factor_(factor){}
+// routable_servers drops the invalid servers, unless all of them are:
+// a cluster failing as a whole still gets traffic to notice its recovery
+inline std::vector<ServerNode> routable_servers(const std::vector<ServerNode>& servers) {
+    std::vector<ServerNode> routable;
+    routable.reserve(servers.size());
+    for (auto& server : servers) {
+        if (server.valid) {
+            routable.push_back(server);
+        }
+    }
+    return routable.empty() ? servers : routable;
+}
 
-    ~ConsistentHashBalance() = default;
+// server_hash_key is the identity hash based balancers place a server by
+inline std::string server_hash_key(const ServerNode& server) {
+    return arch_net::string_printf("%s:%d", server.endpoint.host.c_str(), server.endpoint.port);
+}
 
-    ServerNode get_next(uint32_t seed, const std::vector<ServerNode>& servers = {}) override{
-        if (!servers.empty() && ring_.empty()) {
-            ServerRing ring;
-            initialize_circle(servers, ring);
-            mutex_.lock();
-            ring_ = std::move(ring);
-            mutex_.unlock();
+// RCUBalance keeps an immutable snapshot built from the server list.
+// get_next loads it with an atomic shared_ptr read and never locks, on_changed builds
+// a new one and swaps it in, readers still holding the old snapshot finish on it.
+template<class Snapshot>
+class RCUBalance : public LoadBalance {
+public:
+    ServerNode get_next(uint32_t seed, const std::vector<ServerNode>& servers = {}) override {
+        auto snapshot = std::atomic_load_explicit(&snapshot_, std::memory_order_acquire);
+        if (!snapshot && !servers.empty()) {
+            auto built = build(servers);
+            // another fiber may have published first, both snapshots are equal
+            std::shared_ptr<const Snapshot> expected;
+            if (!std::atomic_compare_exchange_strong(&snapshot_, &expected, built)) {
+                built = expected;
+            }
+            snapshot = built;
         }
-        mutex_.lock();
-        defer(mutex_.unlock());
-        //auto a = --ring_.end();
-        //seed = seed % a->first;
-        auto node = ring_.lower_bound(seed);
-        if (node == ring_.end()) {
-            return ring_.begin()->second;
+        if (!snapshot || snapshot->empty()) {
+            return ServerNode{};
         }
-        return node->second;
+        return snapshot->get(seed);
     }
 
     void on_changed(const std::vector<ServerNode> &new_servers) override {
-        ServerRing ring;
-        initialize_circle(new_servers, ring);
-        ring_ = std::move(ring);
+        std::atomic_store_explicit(&snapshot_, build(new_servers), std::memory_order_release);
+    }
+
+protected:
+    virtual std::shared_ptr<const Snapshot> build(const std::vector<ServerNode>& servers) const = 0;
+
+    std::shared_ptr<const Snapshot> current() const {
+        return std::atomic_load_explicit(&snapshot_, std::memory_order_acquire);
     }
 
 private:
-    void initialize_circle(const std::vector<ServerNode>& servers, ServerRing& ring) const {
-        for (auto& server : servers) {
-            for (size_t i = 0; i < factor_; i++) {
-                std::string key = arch_net::string_printf(
-                        "%s:%d-%zu", server.endpoint.host.c_str(), server.endpoint.port, i);
+    std::shared_ptr<const Snapshot> snapshot_;
+};
+
+// HashRing places factor * 4 virtual nodes per server on a sorted flat array,
+// a seed goes to the first virtual node at or after it.
+class HashRing {
+public:
+    HashRing(const std::vector<ServerNode>& servers, size_t factor) : servers_(servers) {
+        std::vector<std::pair<uint32_t, uint32_t>> points;
+        points.reserve(servers.size() * factor * 4);
+        for (size_t s = 0; s < servers.size(); s++) {
+            auto& endpoint = servers[s].endpoint;
+            for (size_t i = 0; i < factor; i++) {
+                std::string key = arch_net::string_printf("%s:%d-%zu", endpoint.host.c_str(), endpoint.port, i);
                 uint32_t val[4];
                 MurmurHash3_x64_128(key.c_str(), key.size(), 0, val);
                 // hash产生4个值，实际上是[factor_*4]个虚节点
                 for (size_t j = 0; j < 4; j++) {
-                    ring[val[j]] = server;
+                    points.emplace_back(val[j], s);
                 }
             }
         }
+        std::sort(points.begin(), points.end());
+        // on a collision the later server wins, like the map assignment it replaces
+        for (size_t i = 0; i < points.size(); i++) {
+            if (!hashes_.empty() && hashes_.back() == points[i].first) {
+                owners_.back() = points[i].second;
+                continue;
+            }
+            hashes_.push_back(points[i].first);
+            owners_.push_back(points[i].second);
+        }
+    }
+
+    bool empty() const { return hashes_.empty(); }
+
+    const ServerNode& get(uint32_t seed) const {
+        auto it = std::lower_bound(hashes_.begin(), hashes_.end(), seed);
+        size_t idx = it == hashes_.end() ? 0 : it - hashes_.begin();
+        return servers_[owners_[idx]];
+    }
+
+private:
+    std::vector<ServerNode> servers_;
+    std::vector<uint32_t> hashes_;
+    std::vector<uint32_t> owners_;
+};
+
+class ConsistentHashBalance : public RCUBalance<HashRing> {
+public:
+    ConsistentHashBalance(int factor) : factor_(factor) {}
+
+protected:
+    std::shared_ptr<const HashRing> build(const std::vector<ServerNode>& servers) const override {
+        return std::make_shared<HashRing>(routable_servers(servers), factor_);
     }
 
 private:
-    size_t size_;
     size_t factor_;
-    ServerRing ring_;
-    acl::fiber_mutex mutex_;
+};
+
+// MaglevTable fills a prime sized lookup table from per server permutations
+// (Maglev, NSDI'16), lookups are one modulo and spread is near perfect,
+// a membership change moves slightly more keys than a ring.
+class MaglevTable {
+public:
+    static const uint32_t kTableSize = 65537;
+
+    explicit MaglevTable(const std::vector<ServerNode>& servers) : servers_(servers) {
+        size_t n = servers.size();
+        if (n == 0) {
+            return;
+        }
+        std::vector<uint32_t> offset(n), skip(n), next(n, 0);
+        for (size_t s = 0; s < n; s++) {
+            auto key = server_hash_key(servers[s]);
+            uint32_t h1, h2;
+            MurmurHash3_x86_32(key.c_str(), key.size(), 0, &h1);
+            MurmurHash3_x86_32(key.c_str(), key.size(), 0x9e3779b9, &h2);
+            offset[s] = h1 % kTableSize;
+            skip[s] = h2 % (kTableSize - 1) + 1;
+        }
+        table_.assign(kTableSize, UINT32_MAX);
+        uint32_t filled = 0;
+        while (true) {
+            for (size_t s = 0; s < n; s++) {
+                uint32_t slot = (offset[s] + (uint64_t)skip[s] * next[s]) % kTableSize;
+                while (table_[slot] != UINT32_MAX) {
+                    next[s]++;
+                    slot = (offset[s] + (uint64_t)skip[s] * next[s]) % kTableSize;
+                }
+                table_[slot] = s;
+                next[s]++;
+                if (++filled == kTableSize) {
+                    return;
+                }
+            }
+        }
+    }
+
+    bool empty() const { return table_.empty(); }
+
+    const ServerNode& get(uint32_t seed) const { return servers_[table_[seed % kTableSize]]; }
+
+private:
+    std::vector<ServerNode> servers_;
+    std::vector<uint32_t> table_;
+};
+
+class MaglevBalance : public RCUBalance<MaglevTable> {
+protected:
+    std::shared_ptr<const MaglevTable> build(const std::vector<ServerNode>& servers) const override {
+        return std::make_shared<MaglevTable>(routable_servers(servers));
+    }
+};
+
+// JumpBuckets maps a seed onto the server list with jump consistent hash
+// (Lamping & Veach), no memory beyond the list. Servers are ordered by their key so
+// the same set maps the same way whatever order it arrives in. Only adding a server
+// at the end of that order or removing the last one moves the minimum of keys:
+// removing any other server shifts every bucket after it, and the keys of all those
+// servers move too. Use ConsistentHash or Maglev when servers leave in any order.
+class JumpBuckets {
+public:
+    explicit JumpBuckets(const std::vector<ServerNode>& servers) : servers_(servers) {
+        std::vector<std::pair<std::string, size_t>> keys;
+        for (size_t s = 0; s < servers_.size(); s++) {
+            keys.emplace_back(server_hash_key(servers_[s]), s);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<ServerNode> sorted;
+        for (auto& key : keys) {
+            sorted.push_back(servers_[key.second]);
+        }
+        servers_.swap(sorted);
+    }
+
+    bool empty() const { return servers_.empty(); }
+
+    const ServerNode& get(uint32_t seed) const {
+        return servers_[jump_consistent_hash(seed, servers_.size())];
+    }
+
+    static int32_t jump_consistent_hash(uint64_t key, int32_t num_buckets) {
+        int64_t b = -1, j = 0;
+        // spread 32 bit seeds over the whole 64 bit key space first
+        key = key * 0x9e3779b97f4a7c15ULL;
+        while (j < num_buckets) {
+            b = j;
+            key = key * 2862933555777941757ULL + 1;
+            j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+        }
+        return b;
+    }
+
+private:
+    std::vector<ServerNode> servers_;
+};
+
+class JumpHashBalance : public RCUBalance<JumpBuckets> {
+protected:
+    std::shared_ptr<const JumpBuckets> build(const std::vector<ServerNode>& servers) const override {
+        return std::make_shared<JumpBuckets>(routable_servers(servers));
+    }
 };
 
 class RandomBalance : public LoadBalance {
@@ -99,6 +292,13 @@ public:
         }
         std::uniform_int_distribution<int> dis(0, servers.size()-1);
         int x = dis(gen_);
+        // step over invalid servers, all of them invalid means none is
+        for (size_t i = 0; i < servers.size(); i++) {
+            auto& server = servers[(x + i) % servers.size()];
+            if (server.valid) {
+                return server;
+            }
+        }
         return servers[x];
     }
 
@@ -108,46 +308,184 @@ private:
     std::mt19937 gen_;
 };
 
-class WeightedRandomBalance : public LoadBalance {
+// AliasTable samples servers proportionally to their weight in O(1) (Vose's alias method),
+// servers without a positive weight are never picked unless all of them are.
+class AliasTable {
 public:
-    WeightedRandomBalance() : gen_(std::random_device{}()) {}
-
-    ServerNode get_next(uint32_t seed, const std::vector<ServerNode>& servers = {}) override {
-        if (seed != 0) {
-            gen_.seed(seed);
+    explicit AliasTable(const std::vector<ServerNode>& servers) : servers_(servers) {
+        size_t n = servers.size();
+        if (n == 0) {
+            return;
+        }
+        double total = 0;
+        for (auto& server : servers) {
+            total += std::max(server.weight, 0);
         }
-        std::vector<int> presum(servers.size());
-        int total = 0;
-        for (int i = 0; i < servers.size(); i++) {
-            total += servers[i].weight;
-            if (i > 0) {
-                presum[i] = presum[i - 1] + servers[i].weight;
-            } else {
-                presum[i] = servers[i].weight;
+        prob_.assign(n, 1.0);
+        alias_.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            alias_[i] = i;
+            scaled[i] = total > 0 ? std::max(servers[i].weight, 0) * n / total : 1.0;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            auto s = small.back();
+            small.pop_back();
+            auto l = large.back();
+            prob_[s] = scaled[s];
+            alias_[s] = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
             }
         }
-        std::uniform_int_distribution<int> dis(1, total);
-        int x = dis(gen_);
-        int idx = binarySearch(presum, x);
-        return servers[idx];
+        // leftovers are 1.0 up to rounding
     }
 
-    void on_changed(const std::vector<ServerNode> &new_servers) override {}
+    bool empty() const { return servers_.empty(); }
 
-    static int binarySearch(const std::vector<int>& presum, int x) {
-        int low = 0, high = presum.size() - 1;
-        while (low < high) {
-            int mid = (high - low) / 2 + low;
-            if (presum[mid] < x) {
-                low = mid + 1;
-            } else {
-                high = mid;
-            }
+    const ServerNode& get(uint32_t seed) const {
+        uint64_t r = random_u64(seed);
+        size_t column = (r >> 32) % servers_.size();
+        double coin = (uint32_t)r / 4294967296.0;
+        return servers_[coin < prob_[column] ? column : alias_[column]];
+    }
+
+private:
+    std::vector<ServerNode> servers_;
+    std::vector<double> prob_;
+    std::vector<uint32_t> alias_;
+};
+
+class WeightedRandomBalance : public RCUBalance<AliasTable> {
+protected:
+    std::shared_ptr<const AliasTable> build(const std::vector<ServerNode>& servers) const override {
+        return std::make_shared<AliasTable>(routable_servers(servers));
+    }
+};
+
+// EndPointLoad is the load an endpoint carries: requests in flight and a peak
+// sensitive moving average of their latency. It is shared by every snapshot the
+// endpoint is part of, so membership changes keep the history.
+struct EndPointLoad {
+    // a latency sample weighs half after kDecayUs * ln2
+    static const int64_t kDecayUs = 10 * 1000 * 1000;
+    // failures count as a slow response so the endpoint is avoided for a while
+    static const int64_t kFailureLatencyUs = 1000 * 1000;
+
+    std::atomic<int32_t> outstanding{0};
+    std::atomic<int64_t> ewma_us{0};
+    std::atomic<int64_t> stamp_us{0};
+
+    // update races are benign, a lost sample only delays the average
+    void update(int64_t latency_us, int64_t now_us) {
+        int64_t last = stamp_us.exchange(now_us, std::memory_order_relaxed);
+        int64_t prev = ewma_us.load(std::memory_order_relaxed);
+        if (prev == 0 || latency_us > prev) {
+            // jump to a peak at once, decay back slowly
+            ewma_us.store(latency_us, std::memory_order_relaxed);
+            return;
+        }
+        double w = std::exp(-(double)std::max<int64_t>(now_us - last, 0) / kDecayUs);
+        ewma_us.store((int64_t)(prev * w + latency_us * (1 - w)), std::memory_order_relaxed);
+    }
+
+    // cost grows with the queue, an endpoint without samples takes one probe at a time
+    double cost(bool use_latency) const {
+        int32_t n = outstanding.load(std::memory_order_relaxed);
+        if (!use_latency) {
+            return n;
+        }
+        int64_t ewma = ewma_us.load(std::memory_order_relaxed);
+        if (ewma == 0) {
+            return n == 0 ? 0 : 1e12 + n;
         }
-        return low;
+        return (double)ewma * (n + 1);
     }
+};
+
+// LoadTable picks among the routable servers but tracks the load of all of them,
+// requests in flight to an ejected endpoint still count when it comes back.
+class LoadTable {
+public:
+    LoadTable(const std::vector<ServerNode>& servers, const LoadTable* prev, bool use_latency)
+        : servers_(routable_servers(servers)), use_latency_(use_latency) {
+        for (auto& server : servers) {
+            auto old = prev ? prev->find(server.endpoint) : nullptr;
+            all_loads_.emplace(server.endpoint.key(), old ? old : std::make_shared<EndPointLoad>());
+        }
+        for (auto& server : servers_) {
+            loads_.push_back(all_loads_[server.endpoint.key()]);
+        }
+    }
+
+    bool empty() const { return servers_.empty(); }
+
+    // pick two servers at random and keep the one with the lower cost
+    const ServerNode& get(uint32_t seed) const {
+        size_t n = servers_.size();
+        if (n == 1) {
+            return servers_[0];
+        }
+        uint64_t r = random_u64(seed);
+        size_t a = (r >> 32) % n;
+        size_t b = (uint32_t)r % (n - 1);
+        if (b >= a) {
+            b++;
+        }
+        return loads_[a]->cost(use_latency_) <= loads_[b]->cost(use_latency_) ? servers_[a] : servers_[b];
+    }
+
+    std::shared_ptr<EndPointLoad> find(const EndPoint& endpoint) const {
+        auto it = all_loads_.find(endpoint.key());
+        return it == all_loads_.end() ? nullptr : it->second;
+    }
+
 private:
-    std::mt19937 gen_;
+    std::vector<ServerNode> servers_;
+    std::vector<std::shared_ptr<EndPointLoad>> loads_;
+    std::unordered_map<EndPointKey, std::shared_ptr<EndPointLoad>> all_loads_;
+    bool use_latency_;
+};
+
+// P2CBalance routes by the load callers report through on_start / on_finish,
+// with use_latency it prefers endpoints that answer fast, otherwise the least busy ones.
+class P2CBalance : public RCUBalance<LoadTable> {
+public:
+    explicit P2CBalance(bool use_latency) : use_latency_(use_latency) {}
+
+    void on_start(const EndPoint& endpoint) override {
+        auto snapshot = current();
+        auto load = snapshot ? snapshot->find(endpoint) : nullptr;
+        if (load) {
+            load->outstanding.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void on_finish(const EndPoint& endpoint, int64_t latency_us, bool failed) override {
+        auto snapshot = current();
+        auto load = snapshot ? snapshot->find(endpoint) : nullptr;
+        if (!load) {
+            return;
+        }
+        load->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        if (use_latency_) {
+            int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            load->update(failed ? std::max(latency_us, EndPointLoad::kFailureLatencyUs) : latency_us, now_us);
+        }
+    }
+
+protected:
+    std::shared_ptr<const LoadTable> build(const std::vector<ServerNode>& servers) const override {
+        return std::make_shared<LoadTable>(servers, current().get(), use_latency_);
+    }
+
+private:
+    bool use_latency_;
 };
 
 
@@ -159,6 +497,14 @@ static LoadBalance* new_load_balance(LoadBalanceType type) {
         return new RandomBalance();
     case LoadBalanceType::WeightedRandom:
         return new WeightedRandomBalance();
+    case LoadBalanceType::Maglev:
+        return new MaglevBalance();
+    case LoadBalanceType::JumpHash:
+        return new JumpHashBalance();
+    case LoadBalanceType::LeastOutstanding:
+        return new P2CBalance(false);
+    case LoadBalanceType::P2CEWMA:
+        return new P2CBalance(true);
     }
     return new RandomBalance();
 }
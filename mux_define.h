@@ -15,6 +15,62 @@ static int32_t FLAGS_KeepAliveInterval = 30 * 1000;
 static int32_t FLAGS_ConnectionWriteTimeout = 30 * 1000;
 static int32_t FLAGS_StreamCloseTimeout = 30 * 1000;
 static int32_t FLAGS_StreamOpenTimeout = 30 * 1000;
+// the send loop writes the frames of one wakeup with a single writev,
+// flushing early past these budgets (two iovecs a frame, IOV_MAX is 1024)
+static int32_t FLAGS_MaxSendBatchFrames = 512;
+static int32_t FLAGS_MaxSendBatchBytes = 256 * 1024;
+// bytes a stream of weight 1 may send per scheduling round, frames are cut to fit
+static int32_t FLAGS_SchedQuantum = 1024;
+
+// FlowControlOption sizes the receive windows a session advertises. Every stream starts
+// at the protocol window FLAGS_MaxStreamWindowSize, which is also the floor.
+struct FlowControlOption {
+    // window a new stream advertises, raised to FLAGS_MaxStreamWindowSize when smaller
+    uint32_t initial_stream_window = FLAGS_MaxStreamWindowSize;
+    // auto_tune doubles the window of a stream that used it up within two ping rtts,
+    // the window then covers the bandwidth delay product, up to max_stream_window
+    bool auto_tune = true;
+    uint32_t max_stream_window = 16 * 1024 * 1024;
+    // bytes the peer may have in flight over all streams of the session, sent as window
+    // updates of stream 0. 0 disables it, peers that don't send them are not held to it
+    uint32_t connection_window = 64 * 1024 * 1024;
+    // once the windows advertised by all sessions of the process add up to more than
+    // this, streams stop growing and shrink back towards initial_stream_window
+    int64_t window_memory_budget = 1024LL * 1024 * 1024;
+};
+
+// StreamPriority orders the data frames of the streams of a session. Control frames
+// (window updates, pings, GoAway) always go first.
+struct StreamPriority {
+    static const int kLevels = 8;
+    // lower levels are served first, a level only gets the link when those above are idle
+    uint8_t level = 4;
+    // streams of one level share the link by weight with deficit round robin, 1 to 256
+    uint16_t weight = 16;
+};
+
+enum class SessionPlacement {
+    // the session with the fewest open streams
+    LeastLoaded,
+    // sessions in turn
+    RoundRobin,
+};
+
+// MuxClientOption spreads the streams to an endpoint over several sessions, each one
+// its own connection with its own send and recv fibers and congestion window
+struct MuxClientOption {
+    // sessions kept per endpoint, 1 puts every stream on one connection
+    int max_sessions_per_endpoint = 1;
+    // open streams a session takes before another one is dialed, sessions only go past
+    // it once the endpoint has max_sessions_per_endpoint of them
+    int streams_per_session = 100;
+    SessionPlacement placement = SessionPlacement::LeastLoaded;
+    // sessions without streams for this long are closed, 0 to keep them until they fail
+    int idle_timeout_ms = 60 * 1000;
+    // idle retirement never closes the last min_sessions_per_endpoint sessions of an endpoint
+    int min_sessions_per_endpoint = 0;
+    FlowControlOption flow;
+};
 
 typedef std::function<int(Buffer*)> OnReceivedCallback;
 
@@ -100,6 +156,18 @@ public:
     std::string to_string() { return string_printf("type: %d, flags: %d, st_id: %d, length: %d",
                                                    msg_type_, flags_, stream_id_, length_);}
 
+    // encode writes the HeaderSize bytes of a frame header to out
+    static void encode(char* out, uint8_t msg_type, uint16_t flags, uint32_t stream_id, uint32_t length) {
+        uint16_t be16 = htons(flags);
+        uint32_t be_id = htonl(stream_id);
+        uint32_t be_len = htonl(length);
+        out[0] = ProtoMagicValue;
+        out[1] = (char)msg_type;
+        memcpy(out + 2, &be16, sizeof be16);
+        memcpy(out + 4, &be_id, sizeof be_id);
+        memcpy(out + 8, &be_len, sizeof be_len);
+    }
+
     void encode(Buffer* buff, uint8_t msg_type, uint16_t flags, uint32_t stream_id, uint32_t length) {
         buff->Reset();
         buff->AppendUInt8(ProtoMagicValue);
@@ -3,13 +3,47 @@
 
 namespace arch_net  { namespace mux {
 
+static std::atomic<int64_t> g_advertised_window{0};
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t MultiplexingSession::advertised_window_bytes() {
+    return g_advertised_window.load(std::memory_order_relaxed);
+}
+
+void MultiplexingSession::add_advertised_window(int64_t delta) {
+    g_advertised_window.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void MultiplexingSession::stream_created() {
+    live_streams_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MultiplexingSession::stream_deleted() {
+    if (live_streams_.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        idle_since_ms_.store(now_us() / 1000, std::memory_order_relaxed);
+    }
+}
+
 MultiplexingSession::MultiplexingSession(ISocketStream *underlying, bool ownership,
-                                         MuxStreamType type)
+                                         MuxStreamType type, const FlowControlOption& flow)
     : remote_goaway_(0), local_goaway_(0), next_stream_id_(0), mux_streams_(),
-    ping_(), send_chan_(), recv_done_chan_(), send_done_chan_(), keep_alive_chan_(),
+    ping_(), flow_(flow), send_chan_(), recv_done_chan_(), send_done_chan_(), keep_alive_chan_(),
     keep_alive_done_chan_(), accept_chn_(false), socket_stream_(underlying),
     ownership_(ownership), wg_(), ctx_pool_(), type_(type) {
 
+    idle_since_ms_ = now_us() / 1000;
+    flow_.initial_stream_window = std::max<uint32_t>(flow_.initial_stream_window, FLAGS_MaxStreamWindowSize);
+    flow_.max_stream_window = std::max(flow_.max_stream_window, flow_.initial_stream_window);
+    if (flow_.connection_window > 0) {
+        // the first frame of the session tells the peer we keep a connection window
+        conn_recv_credit_ = flow_.connection_window;
+        queue_window_update(0, flow_.connection_window);
+    }
+
     if (type == MuxStreamType::Client) {
         next_stream_id_ = 1;
     } else {
@@ -20,10 +54,11 @@ MultiplexingSession::MultiplexingSession(ISocketStream *underlying, bool ownersh
 
 MultiplexingSession::~MultiplexingSession() {
     close();
+    if (rx_block_) rx_block_->dec_ref();
     if (ownership_) delete socket_stream_;
 }
 
-ISocketStream *MultiplexingSession::open_stream() {
+ISocketStream *MultiplexingSession::open_stream(const StreamPriority& priority) {
 
     if (is_closed()) {
         return nullptr;
@@ -32,7 +67,7 @@ ISocketStream *MultiplexingSession::open_stream() {
     auto res_chan = std::make_shared<acl::fiber_tbox<ISocketStream>>();
     std::weak_ptr<acl::fiber_tbox<ISocketStream>> weak_chan(res_chan);
 
-    add_send_task([this, weak_chan = std::move(weak_chan)]() -> int {
+    add_send_task([this, priority, weak_chan = std::move(weak_chan)]() -> int {
         auto res_chan = weak_chan.lock();
         if (!res_chan) return -1;
 
@@ -49,6 +84,7 @@ ISocketStream *MultiplexingSession::open_stream() {
         uint32_t next_stream_id = next_stream_id_ += 2 ;  //TODO over flow check
         auto mux_stream = std::make_unique<MultiplexingStream>(next_stream_id,
                                                                this, StreamState::StreamInit);
+        set_priority(mux_stream.get(), priority);
 
         int ret = mux_stream->send_window_update();
         if (ret <= 0) {
@@ -78,15 +114,59 @@ ISocketStream *MultiplexingSession::accept_stream() {
     return stream;
 }
 
+void MultiplexingSession::send_go_away() {
+    // refuse incoming streams right away, the frame goes out with the send fiber
+    if (is_closed() || local_goaway_.exchange(1)) {
+        return;
+    }
+    goaway_queued_.store(true, std::memory_order_release);
+    add_send_task([this]() {
+        Buffer hdr_buff(HeaderSize,0);
+        Header hdr;
+        go_away(hdr, hdr_buff, goAwayNormal);
+        int ret = send_message(&hdr_buff, nullptr);
+        on_flushed([this](bool) { goaway_flushed_.push(nullptr); });
+        return ret;
+    });
+    accept_chn_.push(nullptr);
+}
+
+bool MultiplexingSession::wait_go_away_flushed(int timeout_ms) {
+    if (!goaway_queued_.load(std::memory_order_acquire)) {
+        return true;
+    }
+    bool found = false;
+    goaway_flushed_.pop(timeout_ms, &found);
+    return found;
+}
+
 void MultiplexingSession::session_setup() {
     wg_.add(3);
     (void)create_fiber([&]() {
         auto send_loop = [&](){
             while (true) {
                 auto ctx = send_chan_.pop();
-                if (!ctx) return 1;
-                defer(ctx_pool_.Release(ctx));
-                if (ctx->fn_() <= 0) return -1;
+                bool closing = ctx == nullptr;
+                // run every task already queued, their frames go out with one writev
+                while (ctx) {
+                    // a task without fn only wakes the loop for scheduled data
+                    int ret = ctx->fn_ ? ctx->fn_() : 1;
+                    ctx_pool_.Release(ctx);
+                    if (ret <= 0) {
+                        flush();
+                        return -1;
+                    }
+                    bool found = false;
+                    ctx = send_chan_.pop(0, &found);
+                    closing = found && ctx == nullptr;
+                }
+                // control frames are in the batch already, data takes the rest of it
+                data_wakeup_.store(false, std::memory_order_relaxed);
+                bool more = !closing && fill_data();
+                if (flush() <= 0) return -1;
+                if (closing) return 1;
+                // come back without waiting, control frames queued meanwhile still go first
+                if (more) wake_send_loop();
             }
         };
 
@@ -112,6 +192,8 @@ void MultiplexingSession::session_setup() {
 
     (void) create_fiber([&] (){
         auto keep_alive_loop = [&]() {
+            // window auto tuning needs an rtt early on
+            if (flow_.auto_tune && ping() <= 0) return -1;
             while (true) {
                 bool found = false;
                 keep_alive_chan_.pop(FLAGS_KeepAliveInterval, &found);
@@ -139,13 +221,14 @@ void MultiplexingSession::add_send_task(std::function<int()> func) {
 
 int MultiplexingSession::recv_loop() {
     Header hdr;
-    Buffer recv_buf;
+    auto recv_buf = GlobalBufferPool::getInstance().Get(HeaderSize);
+    defer(GlobalBufferPool::getInstance().Release(recv_buf));
     while (!is_closed()) {
         if (type_ == 0) {
             int a;
             a++;
         }
-        int ret = hdr.recv_and_decode(&recv_buf, socket_stream_);
+        int ret = hdr.recv_and_decode(recv_buf, socket_stream_);
         if (ret <= 0) {
             return -1;
         }
@@ -178,25 +261,44 @@ int MultiplexingSession::handle_stream_message(Header &hdr) {
     uint32_t id = hdr.stream_id();
     auto flags = hdr.flags();
 
+    if (id == 0) {
+        return hdr.msg_type() == typeWindowUpdate ? handle_connection_window(hdr.length()) : -1;
+    }
+    if (hdr.msg_type() == typeData && hdr.length() > 0 && peer_conn_window_ && flow_.connection_window > 0) {
+        if (conn_recv_credit_.fetch_sub(hdr.length(), std::memory_order_relaxed) < hdr.length()) {
+            LOG(ERROR) << "peer overran the connection window";
+            return -1;
+        }
+    }
+
     if ((flags & flagSYN) == flagSYN) {
         int ret = incoming_stream(id);
         if (ret <= 0) {
             return -1;
         }
     }
+    // the body is read without mux_streams_.mutex, the flush callbacks of the send loop
+    // take it. Entered like a recv call, the stream isn't deleted before we are done
     mux_streams_.mutex.lock();
-    defer(mux_streams_.mutex.unlock());
-
     auto it = mux_streams_.streams.find(id);
-    if (it == mux_streams_.streams.end()) {
+    MultiplexingStream* stream = it == mux_streams_.streams.end() ? nullptr : it->second;
+    if (stream) {
+        stream->enter();
+    }
+    mux_streams_.mutex.unlock();
+
+    if (!stream) {
         if (hdr.msg_type() == typeData && hdr.length() > 0) {
-            Buffer discard(hdr.length());
-            discard.ReadNFromSocketStream(socket_stream_, hdr.length());
+            auto discard = GlobalBufferPool::getInstance().Get(hdr.length());
+            defer(GlobalBufferPool::getInstance().Release(discard));
+            discard->ReadNFromSocketStream(socket_stream_, hdr.length());
+            on_consumed(hdr.length());
         }
         return 1;
     }
+    defer(stream->leave());
+
     // window update
-    auto stream = it->second;
     if (hdr.msg_type() == typeWindowUpdate) {
         int ret = stream->increase_send_window(hdr, flags);
         if (ret <= 0) {
@@ -229,7 +331,7 @@ int MultiplexingSession::handle_stream_message(Header &hdr) {
 
 int MultiplexingSession::incoming_stream(uint32_t id) {
     if (local_goaway_) {
-        add_send_task([&]() {
+        add_send_task([this, id]() {
             Buffer hdr_buff(HeaderSize,0);
             Header hdr;
             hdr.encode(&hdr_buff, typeWindowUpdate, flagRST, id, 0);
@@ -254,10 +356,11 @@ int MultiplexingSession::incoming_stream(uint32_t id) {
     }
 
     auto mux_stream = new MultiplexingStream(id, this, StreamState::StreamSYNReceived);
-    int ret = mux_stream->send_window_update();
-    if (ret <= 0) {
-        return -1;
-    }
+    // frames are only sent from the send loop, the ack goes out before anything the
+    // accepting side sends on the stream
+    add_send_task([mux_stream]() {
+        return mux_stream->send_window_update();
+    });
     mux_streams_.mutex.lock();
     mux_streams_.streams.emplace(id, mux_stream);
     mux_streams_.mutex.unlock();
@@ -274,13 +377,35 @@ void MultiplexingSession::close_stream(uint32_t id) {
 
 }
 
+int MultiplexingSession::read_body(IOBuffer *buff, uint32_t length) {
+    if (length >= IOBlock::kDefaultSize / 4) {
+        return buff->ReadNFromSocketStream(socket_stream_, length);
+    }
+    if (!rx_block_ || rx_block_->left_space() < length) {
+        if (rx_block_) rx_block_->dec_ref();
+        rx_block_ = IOBlock::create();
+    }
+    size_t offset = rx_block_->used;
+    size_t got = 0;
+    while (got < length) {
+        auto n = socket_stream_->recv(rx_block_->data + offset + got, length - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    rx_block_->used += length;
+    buff->AppendBlock(rx_block_, offset, length);
+    return length;
+}
+
 int MultiplexingSession::handle_ping(Header &hdr) {
     if ((hdr.flags() & flagSYN) == flagSYN) {
-        // send
-        add_send_task([&]() {
+        // by value: the recv loop decodes the next header into hdr before the send loop runs
+        add_send_task([this, ping_id = hdr.length()]() {
             Buffer hdr_buf(HeaderSize, 0);
             Header new_hdr;
-            new_hdr.encode(&hdr_buf, typePing, flagACK, 0, hdr.length());
+            new_hdr.encode(&hdr_buf, typePing, flagACK, 0, ping_id);
             return send_message(&hdr_buf, nullptr);
         });
         return 1;
@@ -310,6 +435,7 @@ int MultiplexingSession::handle_go_away(Header &hdr) {
 }
 
 int MultiplexingSession::ping() {
+    int64_t start = now_us();
     uint32_t id = ping_.ping_id;
     ping_.ping_id++;
     ping_.pings.emplace(id, std::make_unique<acl::fiber_tbox<bool>>());
@@ -326,54 +452,279 @@ int MultiplexingSession::ping() {
     ping_.pings[id].get()->pop(FLAGS_ConnectionWriteTimeout, &found);
     if (found) {
         ping_.pings.erase(id);
+        int64_t rtt = std::max<int64_t>(now_us() - start, 1);
+        int64_t srtt = srtt_us_.load(std::memory_order_relaxed);
+        srtt_us_.store(srtt == 0 ? rtt : (srtt * 7 + rtt) / 8, std::memory_order_relaxed);
         return 1;
     }
     return -1;
 }
 
-int MultiplexingSession::send_message(Buffer *hdr_buf, const void *body_buf, size_t size) {
+uint32_t MultiplexingSession::acquire_send_window(MultiplexingStream *stream, size_t want) {
+    auto deadline = now_us() + (int64_t)FLAGS_ConnectionWriteTimeout * 1000;
+    flow_mutex_.lock();
+    while (true) {
+        if (shut_down_) {
+            break;
+        }
+        int64_t n = std::min<int64_t>(want, stream->send_window_);
+        if (peer_conn_window_) {
+            n = std::min(n, conn_send_window_);
+        }
+        if (n > 0) {
+            stream->send_window_ -= n;
+            if (peer_conn_window_) {
+                conn_send_window_ -= n;
+            }
+            flow_mutex_.unlock();
+            return n;
+        }
+        if (stream->send_window_ > 0) {
+            conn_waiters_.insert(stream);
+        }
+        flow_mutex_.unlock();
+
+        int64_t wait_ms = (deadline - now_us()) / 1000;
+        bool updated = wait_ms > 0 && stream->wait_event(MultiplexingStream::kWindow, wait_ms);
+
+        flow_mutex_.lock();
+        conn_waiters_.erase(stream);
+        if (!updated) {
+            break;
+        }
+    }
+    flow_mutex_.unlock();
+    return 0;
+}
+
+int MultiplexingSession::handle_connection_window(uint32_t delta) {
+    flow_mutex_.lock();
+    peer_conn_window_ = true;
+    conn_send_window_ += delta;
+    for (auto stream : conn_waiters_) {
+        stream->signal(MultiplexingStream::kWindow);
+    }
+    conn_waiters_.clear();
+    flow_mutex_.unlock();
+    return 1;
+}
+
+void MultiplexingSession::on_consumed(size_t n) {
+    if (flow_.connection_window == 0) {
+        return;
+    }
+    int64_t consumed = conn_consumed_.fetch_add(n, std::memory_order_relaxed) + n;
+    // give the window back in halves, like the streams do
+    if (consumed < flow_.connection_window / 2 ||
+        !conn_consumed_.compare_exchange_strong(consumed, 0, std::memory_order_relaxed)) {
+        return;
+    }
+    conn_recv_credit_.fetch_add(consumed, std::memory_order_relaxed);
+    queue_window_update(0, consumed);
+}
+
+void MultiplexingSession::queue_window_update(uint32_t id, uint32_t delta) {
+    add_send_task([this, id, delta]() {
+        return send_frame(typeWindowUpdate, 0, id, delta);
+    });
+}
+
+void MultiplexingSession::append_frame(const char *header, const void *body, size_t size) {
+    batch_.frames.emplace_back();
+    auto& frame = batch_.frames.back();
+    memcpy(frame.header, header, HeaderSize);
+    frame.body = body;
+    frame.size = body ? size : 0;
+    batch_.bytes += HeaderSize + frame.size;
+}
+
+int MultiplexingSession::queue_frame(const char *header, const void *body, size_t size) {
     if (shut_down_) {
         return -1;
     }
+    append_frame(header, body, size);
+    if (batch_.frames.size() >= (size_t)FLAGS_MaxSendBatchFrames ||
+        batch_.bytes >= (size_t)FLAGS_MaxSendBatchBytes) {
+        return flush();
+    }
+    return 1;
+}
 
-    if (hdr_buf != nullptr) {
-        auto n = socket_stream_->send(hdr_buf->data(), hdr_buf->size());
-        if (n <= 0) {
-            return -1;
+void MultiplexingSession::wake_send_loop() {
+    if (!data_wakeup_.exchange(true, std::memory_order_relaxed)) {
+        auto ctx = ctx_pool_.Get();
+        ctx->fn_ = nullptr;
+        send_chan_.push(ctx);
+    }
+}
+
+void MultiplexingSession::set_priority(MultiplexingStream *stream, const StreamPriority &priority) {
+    std::lock_guard<acl::fiber_mutex> guard(sched_mutex_);
+    // a stream waiting in a level moves with its next round
+    stream->level_ = std::min<int>(priority.level, StreamPriority::kLevels - 1);
+    stream->weight_ = std::max<int>(1, std::min<int>(priority.weight, 256));
+}
+
+void MultiplexingSession::schedule_data(MultiplexingStream *stream, const void *buf, uint32_t count) {
+    sched_mutex_.lock();
+    // bits a previous send left behind must not end the wait for this one
+    stream->lock_.lock();
+    stream->events_ &= ~(MultiplexingStream::kSendDone | MultiplexingStream::kSendFailed);
+    if (shut_down_) {
+        // close() failed the scheduled streams already, the send loop is gone
+        stream->events_ |= MultiplexingStream::kSendFailed;
+    }
+    stream->lock_.unlock();
+    if (shut_down_) {
+        sched_mutex_.unlock();
+        return;
+    }
+    stream->tx_data_ = static_cast<const char*>(buf);
+    stream->tx_left_ = count;
+    stream->deficit_ = 0;
+    active_[stream->level_].push_back(stream);
+    sched_mutex_.unlock();
+    wake_send_loop();
+}
+
+void MultiplexingSession::unschedule(MultiplexingStream *stream) {
+    std::lock_guard<acl::fiber_mutex> guard(sched_mutex_);
+    if (stream->tx_left_ == 0) {
+        return;
+    }
+    stream->tx_left_ = 0;
+    for (auto& ring : active_) {
+        auto it = std::find(ring.begin(), ring.end(), stream);
+        if (it != ring.end()) {
+            ring.erase(it);
         }
-        hdr_buf->Retrieve(n);
     }
+}
 
-    if (body_buf != nullptr) {
-        auto n = socket_stream_->send(body_buf, size);
-        if (n <= 0) {
-            return -1;
+bool MultiplexingSession::fill_data() {
+    std::lock_guard<acl::fiber_mutex> guard(sched_mutex_);
+    int level = 0;
+    while (true) {
+        while (level < StreamPriority::kLevels && active_[level].empty()) {
+            level++;
+        }
+        if (level == StreamPriority::kLevels) {
+            return false;
+        }
+        size_t room = FLAGS_MaxSendBatchBytes > (int64_t)batch_.bytes + HeaderSize ?
+                FLAGS_MaxSendBatchBytes - batch_.bytes - HeaderSize : 0;
+        if (room == 0 || batch_.frames.size() >= (size_t)FLAGS_MaxSendBatchFrames) {
+            return true;
+        }
+        auto& ring = active_[level];
+        auto stream = ring.front();
+        stream->lock_.lock();
+        bool closed = stream->closed();
+        // the sender gets its buffer back once no frame of it is in a batch
+        stream->tx_frames_++;
+        stream->lock_.unlock();
+        if (closed) {
+            // nothing goes after the FIN, the sender learns once the frames
+            // already taken from its buffer are written
+            ring.pop_front();
+            stream->tx_left_ = 0;
+            notify_flushed(stream, true, false);
+            continue;
+        }
+        if (stream->deficit_ <= 0) {
+            stream->deficit_ += (int64_t)FLAGS_SchedQuantum * stream->weight_;
+        }
+        // a stream alone at its level has nobody to share with, its payload isn't cut
+        bool alone = ring.size() == 1;
+        uint32_t n = std::min<int64_t>({(int64_t)stream->tx_left_,
+                                        alone ? (int64_t)stream->tx_left_ : stream->deficit_,
+                                        (int64_t)room});
+        char header[HeaderSize];
+        Header::encode(header, typeData, stream->send_flags(), stream->id_, n);
+        append_frame(header, stream->tx_data_, n);
+        stream->tx_data_ += n;
+        stream->tx_left_ -= n;
+        if (!alone) {
+            stream->deficit_ -= n;
+        }
+        ring.pop_front();
+        // buf belongs to the caller until the batch holding its last part is written
+        notify_flushed(stream, stream->tx_left_ == 0, true);
+        if (stream->tx_left_ == 0) {
+            stream->deficit_ = 0;
+        } else if (stream->deficit_ > 0) {
+            // cut short by the batch, keeps its turn
+            ring.push_front(stream);
+        } else {
+            ring.push_back(stream);
         }
     }
-    return 1;
+}
+
+void MultiplexingSession::notify_flushed(MultiplexingStream *stream, bool last, bool sent) {
+    // the sender waits for every frame counted in tx_frames_, even after a timeout,
+    // so the stream outlives the callback
+    on_flushed([stream, last, sent](bool ok) {
+        stream->frame_flushed(last, sent && ok);
+    });
+}
+
+int MultiplexingSession::send_message(Buffer *hdr_buf, const void *body_buf, size_t size) {
+    int ret = queue_frame(hdr_buf->data(), body_buf, size);
+    hdr_buf->Retrieve(HeaderSize);
+    return ret;
 }
 
 int MultiplexingSession::send_message(Buffer *hdr_buf, Buffer *body_buf) {
-    if (shut_down_) {
-        return -1;
+    if (body_buf == nullptr) {
+        return send_message(hdr_buf, nullptr, 0);
     }
+    return send_message(hdr_buf, body_buf->data(), body_buf->size());
+}
 
-    if (hdr_buf != nullptr) {
-        auto n = socket_stream_->send(hdr_buf->data(), hdr_buf->size());
-        if (n <= 0) {
-            return -1;
+int MultiplexingSession::send_frame(uint8_t msg_type, uint16_t flags, uint32_t stream_id,
+                                    uint32_t length, const void *body) {
+    char header[HeaderSize];
+    Header::encode(header, msg_type, flags, stream_id, length);
+    return queue_frame(header, body, length);
+}
+
+int MultiplexingSession::flush() {
+    bool ok = !shut_down_;
+    auto& iov = batch_.iov;
+    iov.clear();
+    for (auto& frame : batch_.frames) {
+        iov.push_back({frame.header, HeaderSize});
+        if (frame.size > 0) {
+            iov.push_back({const_cast<void*>(frame.body), frame.size});
         }
-        hdr_buf->Retrieve(n);
     }
-
-    if (body_buf != nullptr) {
-        auto n = socket_stream_->send(body_buf->data(), body_buf->size());
+    size_t idx = 0;
+    while (ok && idx < iov.size()) {
+        auto n = socket_stream_->send(&iov[idx], (int)std::min<size_t>(iov.size() - idx, IOV_MAX));
         if (n <= 0) {
-            return -1;
+            ok = false;
+            break;
+        }
+        // skip what went out, a partial write leaves the rest of an iovec
+        while (idx < iov.size() && (size_t)n >= iov[idx].iov_len) {
+            n -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iov.size()) {
+            iov[idx].iov_base = (char*)iov[idx].iov_base + n;
+            iov[idx].iov_len -= n;
         }
-        body_buf->Retrieve(n);
     }
-    return 1;
+    batch_.frames.clear();
+    batch_.bytes = 0;
+    // callbacks may queue frames again, they go with the next flush
+    std::vector<std::function<void(bool)>> flushed;
+    flushed.swap(batch_.flushed);
+    for (auto& fn : flushed) {
+        fn(ok);
+    }
+    return ok ? 1 : -1;
 }
 
 void MultiplexingSession::close() {
@@ -395,6 +746,192 @@ void MultiplexingSession::close() {
 
     wg_.wait();
     accept_chn_.push(nullptr);
+    // the send loop is gone, a GoAway it didn't write never will be
+    goaway_flushed_.push(nullptr);
+
+    // the send loop is gone, payload it didn't get to won't be written
+    sched_mutex_.lock();
+    for (auto& ring : active_) {
+        for (auto stream : ring) {
+            stream->tx_left_ = 0;
+            stream->signal(MultiplexingStream::kSendFailed);
+        }
+        ring.clear();
+    }
+    sched_mutex_.unlock();
 
 }
-}}
\ No newline at end of file
+
+MultiplexingSocketClient::MultiplexingSocketClient(ISocketClient *underlying, bool ownership,
+                                                   const MuxClientOption &option)
+    : inner_client_(underlying), ownership_(ownership), option_(option), exit_chn_() {
+    option_.max_sessions_per_endpoint = std::max(option_.max_sessions_per_endpoint, 1);
+    option_.streams_per_session = std::max(option_.streams_per_session, 1);
+
+    // a quarter of the timeout keeps sessions at most 25% past their deadline
+    int tick = option_.idle_timeout_ms > 0 ? std::max(option_.idle_timeout_ms / 4, 100) : 10000;
+    (void)create_fiber([this, tick]()->int {
+        while (true) {
+            bool found = false;
+            exit_chn_.pop(tick, &found);
+            if (found) break;
+            retire(now_ms());
+        }
+        wait_chn_.push(nullptr);
+        return -1;
+    });
+}
+
+MultiplexingSocketClient::~MultiplexingSocketClient() {
+    exit_chn_.push(nullptr);
+    wait_chn_.pop();
+    for (auto& group : groups_) {
+        for (auto& entry : group.second.sessions) {
+            // streams still out there fail from now on, their shared ownership
+            // deletes the session once the last one is deleted
+            entry->session->close();
+        }
+    }
+    groups_.clear();
+    if (ownership_) delete inner_client_;
+}
+
+int64_t MultiplexingSocketClient::now_ms() {
+    return now_us() / 1000;
+}
+
+MultiplexingSocketClient::sessionEntry *MultiplexingSocketClient::pick(sessionGroup &group, bool full_ok) {
+    auto& sessions = group.sessions;
+    auto load = [](const sessionEntry* entry) {
+        return entry->session->stream_count() + entry->opening;
+    };
+    sessionEntry* best = nullptr;
+    switch (option_.placement) {
+        case SessionPlacement::LeastLoaded:
+            for (auto& entry : sessions) {
+                if (entry->session->available() && (!best || load(entry.get()) < load(best))) {
+                    best = entry.get();
+                }
+            }
+            break;
+        case SessionPlacement::RoundRobin:
+            for (size_t i = 0; i < sessions.size(); i++) {
+                auto entry = sessions[(group.next + i) % sessions.size()].get();
+                if (entry->session->available() &&
+                    (full_ok || load(entry) < option_.streams_per_session)) {
+                    group.next = (group.next + i + 1) % sessions.size();
+                    best = entry;
+                    break;
+                }
+            }
+            break;
+    }
+    if (best && !full_ok && load(best) >= option_.streams_per_session) {
+        return nullptr;
+    }
+    return best;
+}
+
+ISocketStream *MultiplexingSocketClient::connect(EndPoint remote) {
+    mutex_.lock();
+    auto& group = groups_[remote.key()];
+    auto entry = pick(group, false);
+    if (!entry) {
+        int sessions = 0;
+        for (auto& e : group.sessions) {
+            sessions += e->session->available() ? 1 : 0;
+        }
+        // every session is full, past the fan-out the streams pile up on the existing ones
+        if (sessions + group.dialing >= option_.max_sessions_per_endpoint) {
+            entry = pick(group, true);
+        }
+    }
+    if (!entry) {
+        group.dialing++;
+        mutex_.unlock();
+        auto conn = inner_client_->connect(remote);
+        std::shared_ptr<MultiplexingSession> session;
+        if (conn) {
+            session.reset(new MultiplexingSession(conn, true, MuxStreamType::Client, option_.flow));
+        }
+        mutex_.lock();
+        auto& dialed = groups_[remote.key()];
+        dialed.dialing--;
+        if (!session) {
+            mutex_.unlock();
+            return nullptr;
+        }
+        dialed.sessions.emplace_back(new sessionEntry{std::move(session), 0});
+        entry = dialed.sessions.back().get();
+    }
+    // the collector leaves entries alone while a stream is being opened on them
+    entry->opening++;
+    mutex_.unlock();
+
+    auto mux_stream = entry->session->open_stream();
+    // the entry stays put while opening, the collector may drop it right after
+    auto session = entry->session;
+    if (mux_stream) {
+        static_cast<MultiplexingStream*>(mux_stream)->owner_ = session;
+    }
+
+    mutex_.lock();
+    entry->opening--;
+    mutex_.unlock();
+    if (mux_stream == nullptr && session->available()) {
+        // no answer in time, the collector deletes it once its streams are gone.
+        // After a GoAway the streams already open carry on. Closing waits for the
+        // session fibers, not under mutex_
+        session->close();
+    }
+    return mux_stream;
+}
+
+size_t MultiplexingSocketClient::session_count(const EndPoint &ep) {
+    std::lock_guard<acl::fiber_mutex> guard(mutex_);
+    auto it = groups_.find(ep.key());
+    if (it == groups_.end()) {
+        return 0;
+    }
+    size_t count = 0;
+    for (auto& entry : it->second.sessions) {
+        count += entry->session->available() ? 1 : 0;
+    }
+    return count;
+}
+
+void MultiplexingSocketClient::retire(int64_t now_ms) {
+    std::vector<std::shared_ptr<MultiplexingSession>> retired;
+    mutex_.lock();
+    for (auto it = groups_.begin(); it != groups_.end();) {
+        auto& group = it->second;
+        auto& sessions = group.sessions;
+        int alive = 0;
+        for (auto& entry : sessions) {
+            alive += entry->session->available() ? 1 : 0;
+        }
+        for (auto e = sessions.begin(); e != sessions.end();) {
+            auto& session = (*e)->session;
+            bool idle = (*e)->opening == 0 && session->stream_count() == 0;
+            bool expired = option_.idle_timeout_ms > 0 && alive > option_.min_sessions_per_endpoint &&
+                           session->idle_since_ms() + option_.idle_timeout_ms <= now_ms;
+            if (idle && (!session->available() || expired)) {
+                alive -= session->available() ? 1 : 0;
+                retired.push_back(std::move(session));
+                e = sessions.erase(e);
+            } else {
+                e++;
+            }
+        }
+        if (sessions.empty() && group.dialing == 0) {
+            it = groups_.erase(it);
+        } else {
+            it++;
+        }
+    }
+    mutex_.unlock();
+    // closing waits for the session fibers, not under mutex_
+    retired.clear();
+}
+
+}}
@@ -4,22 +4,50 @@
 #include "ssl_socket_stream.h"
 #include "mux_stream.h"
 #include "buffer.h"
+#include "buffer_pool.h"
+#include "io_buffer.h"
 #include "mux_define.h"
+#include <deque>
 
 namespace arch_net  { namespace mux {
 
 class MultiplexingSession {
 public:
-    MultiplexingSession(ISocketStream* underlying, bool ownership, MuxStreamType type);
+    MultiplexingSession(ISocketStream* underlying, bool ownership, MuxStreamType type,
+                        const FlowControlOption& flow = FlowControlOption());
 
     ~MultiplexingSession();
     // outer interface
-    ISocketStream* open_stream();
+    ISocketStream* open_stream(const StreamPriority& priority = StreamPriority());
 
     ISocketStream* accept_stream();
 
+    // send_go_away tells the peer to stop opening streams on this session,
+    // new incoming streams are refused and accept_stream returns nullptr.
+    // Safe to call from any thread, the frame is written by the send loop
+    void send_go_away();
+
+    // wait_go_away_flushed waits up to timeout_ms until the GoAway of send_go_away
+    // is written or the session closed, true at once if none was sent
+    bool wait_go_away_flushed(int timeout_ms);
+
     void close();
 
+    // smoothed rtt of the keepalive pings, 0 until the first one came back
+    int64_t rtt_us() const { return srtt_us_.load(std::memory_order_relaxed); }
+
+    // bytes of receive window advertised by all sessions of the process
+    static int64_t advertised_window_bytes();
+
+    // streams of the session not deleted yet, the session has to outlive them
+    int stream_count() const { return live_streams_.load(std::memory_order_relaxed); }
+
+    // steady clock ms since stream_count() last dropped to 0
+    int64_t idle_since_ms() const { return idle_since_ms_.load(std::memory_order_relaxed); }
+
+    // available tells whether open_stream can still succeed: not closed and no GoAway received
+    bool available() const { return !shut_down_ && remote_goaway_ == 0; }
+
 private:
     void session_setup();
 
@@ -48,13 +76,66 @@ private:
 
     int handle_ping(Header& hdr);
 
+    // acquire_send_window takes up to want bytes of the stream and connection send windows,
+    // waiting for window updates. 0 when the stream closed or nothing came in time
+    uint32_t acquire_send_window(MultiplexingStream* stream, size_t want);
+
+    int handle_connection_window(uint32_t delta);
+
+    // on_consumed returns the connection window of n bytes the application has read
+    void on_consumed(size_t n);
+
+    void queue_window_update(uint32_t id, uint32_t delta);
+
+    static void add_advertised_window(int64_t delta);
+
+    void stream_created();
+
+    void stream_deleted();
+
+    bool memory_pressure() const { return advertised_window_bytes() > flow_.window_memory_budget; }
+
+    // send_message and send_frame queue a frame on the batch of the send loop, so they
+    // must run on it. The body is referenced, not copied, and has to live until on_flushed.
     int send_message(Buffer* hdr_buf, Buffer* body_buf);
 
     int send_message(Buffer* hdr_buf, const void* body_buf, size_t size);
 
-    int read_body(Buffer* buff, uint32_t length) {
-        return buff->ReadNFromSocketStream(socket_stream_, length);
-    }
+    int send_frame(uint8_t msg_type, uint16_t flags, uint32_t stream_id, uint32_t length,
+                   const void* body = nullptr);
+
+    // on_flushed runs fn once the frames queued so far are written, false if that failed
+    void on_flushed(std::function<void(bool)> fn) { batch_.flushed.push_back(std::move(fn)); }
+
+    // flush writes the batch with writev and runs its on_flushed callbacks
+    int flush();
+
+    int queue_frame(const char* header, const void* body, size_t size);
+
+    void append_frame(const char* header, const void* body, size_t size);
+
+    // schedule_data hands the payload count at buf to the scheduler, it is sent in frames
+    // as the priority of stream allows and kSendDone is signaled once all is written
+    void schedule_data(MultiplexingStream* stream, const void* buf, uint32_t count);
+
+    // unschedule drops what the scheduler still holds of stream
+    void unschedule(MultiplexingStream* stream);
+
+    // fill_data moves scheduled payload into the batch by level, then deficit round robin,
+    // returns whether payload is left over
+    bool fill_data();
+
+    void wake_send_loop();
+
+    // notify_flushed tells the sender of stream once the batch holding its frame is written,
+    // the send failed unless sent
+    void notify_flushed(MultiplexingStream* stream, bool last, bool sent);
+
+    void set_priority(MultiplexingStream* stream, const StreamPriority& priority);
+
+    // read_body reads a frame body off the socket into buff, the only copy it takes.
+    // small bodies are packed into rx_block_, large ones get blocks of their own
+    int read_body(IOBuffer* buff, uint32_t length);
 
 private:
     struct streamInfo {
@@ -63,6 +144,18 @@ private:
         std::unordered_set<uint32_t> in_flights;
     };
 
+    struct sendBatch {
+        struct Frame {
+            char header[HeaderSize];
+            const void* body;
+            size_t size;
+        };
+        std::vector<Frame> frames;
+        std::vector<struct iovec> iov;
+        std::vector<std::function<void(bool)>> flushed;
+        size_t bytes{0};
+    };
+
     struct pingInfo {
         std::unordered_map<uint32_t, std::unique_ptr<acl::fiber_tbox<bool>>> pings;
         uint32_t ping_id;
@@ -72,11 +165,36 @@ private:
 
 private:
     uint32_t remote_goaway_{0};
-    uint32_t local_goaway_{0};
+    // set by send_go_away on other threads too
+    std::atomic<uint32_t> local_goaway_{0};
+    std::atomic<bool> goaway_queued_{false};
+    acl::fiber_tbox<bool> goaway_flushed_{};
     uint32_t next_stream_id_{0};
 
     streamInfo mux_streams_{};
     pingInfo   ping_{};
+    sendBatch  batch_{};
+
+    FlowControlOption flow_;
+    std::atomic<int64_t> srtt_us_{0};
+    std::atomic<int> live_streams_{0};
+    std::atomic<int64_t> idle_since_ms_{0};
+    // send windows of the session and its streams, streams blocked on the connection
+    // window are woken with kWindow
+    acl::fiber_mutex flow_mutex_;
+    int64_t conn_send_window_{0};
+    bool peer_conn_window_{false};
+    std::unordered_set<MultiplexingStream*> conn_waiters_;
+    // connection window the peer still has, and what the application read since the last update
+    std::atomic<int64_t> conn_recv_credit_{0};
+    std::atomic<int64_t> conn_consumed_{0};
+
+    // streams with scheduled payload, round robin order per level
+    acl::fiber_mutex sched_mutex_;
+    std::deque<MultiplexingStream*> active_[StreamPriority::kLevels];
+    std::atomic<bool> data_wakeup_{false};
+    // written by the recv loop only, readers see the parts handed to them
+    IOBlock* rx_block_{nullptr};
 
     acl::fiber_tbox<FiberIntCtx> send_chan_{};
     acl::fiber_tbox<bool> recv_done_chan_{};
@@ -98,8 +216,9 @@ private:
 
 class MultiplexingSocketServer : public ISocketServer {
 public:
-    MultiplexingSocketServer(ISocketServer* underlying, bool ownership)
-    : inner_server_(underlying), ownership_(ownership) {}
+    MultiplexingSocketServer(ISocketServer* underlying, bool ownership,
+                             const FlowControlOption& flow = FlowControlOption())
+    : inner_server_(underlying), ownership_(ownership), flow_(flow) {}
     ~MultiplexingSocketServer(){ if(ownership_) delete inner_server_; }
 
     ISocketServer *set_handler(Handler&& handler) override {
@@ -127,20 +246,64 @@ public:
     }
 
     void stop() override {
-        inner_server_->stop();
+        shutdown(kDefaultDrainTimeout);
+    }
+
+    int shutdown(int drain_timeout_ms) override {
+        // clients move new streams elsewhere, the underlying server drains the sessions
+        sessions_mutex_.lock();
+        for (auto session : sessions_) {
+            session->send_go_away();
+        }
+        stopping_ = true;
+        sessions_mutex_.unlock();
+        return inner_server_->shutdown(drain_timeout_ms);
+    }
+
+    ISocketServer* set_io_engine(IOEngine engine) override {
+        inner_server_->set_io_engine(engine);
+        return this;
+    }
+
+    ISocketServer* set_accept_mode(AcceptMode mode) override {
+        inner_server_->set_accept_mode(mode);
+        return this;
+    }
+
+    ISocketServer* set_socket_options(const SocketOptions& opts) override {
+        inner_server_->set_socket_options(opts);
+        return this;
     }
 
 private:
     virtual int handle_connection(ISocketStream* stream) {
-        auto mux_session = new MultiplexingSession(stream, false, MuxStreamType::Server);
+        auto mux_session = new MultiplexingSession(stream, false, MuxStreamType::Server, flow_);
+        sessions_mutex_.lock();
+        sessions_.insert(mux_session);
+        if (stopping_) {
+            mux_session->send_go_away();
+        }
+        sessions_mutex_.unlock();
+
+        acl::wait_group handlers;
         while (true) {
             auto mux_stream = mux_session->accept_stream();
             if (!mux_stream) break;
             LOG(INFO) << "server recv " <<  mux_stream;
-            go[&](){
+            handlers.add(1);
+            go[this, mux_stream, &handlers](){
                 MultiplexingSocketServer::handler(this->handler_, mux_stream);
+                handlers.done();
             };
         }
+        // in flight streams finish before the session goes away
+        handlers.wait();
+        // and a GoAway sent by shutdown reaches the peer before the socket closes
+        mux_session->wait_go_away_flushed(kGoAwayFlushTimeout);
+
+        sessions_mutex_.lock();
+        sessions_.erase(mux_session);
+        sessions_mutex_.unlock();
         delete mux_session;
         LOG(INFO) << "server session close";
         return 0;
@@ -152,22 +315,28 @@ private:
         LOG(INFO) << "server delete stream " <<  stream;
     }
 private:
+    static const int kGoAwayFlushTimeout = 1000;
+
     ISocketServer* inner_server_{nullptr};
     Handler handler_{nullptr};
     bool ownership_{false};
+    FlowControlOption flow_;
+
+    acl::fiber_mutex sessions_mutex_;
+    std::unordered_set<MultiplexingSession*> sessions_;
+    bool stopping_{false};
 };
 
+// MultiplexingSocketClient opens streams on up to max_sessions_per_endpoint sessions
+// per endpoint. A stream goes to a session below streams_per_session picked by the
+// placement, a new session is dialed when there is none, and a collector fiber closes
+// sessions that stayed without streams for idle_timeout_ms.
 class MultiplexingSocketClient : public ISocketClient {
 public:
-    MultiplexingSocketClient(ISocketClient* underlying, bool ownership)
-    : sessions_(), inner_client_(underlying), ownership_(ownership), mutex_() {}
+    MultiplexingSocketClient(ISocketClient* underlying, bool ownership,
+                             const MuxClientOption& option = MuxClientOption());
 
-    ~MultiplexingSocketClient() {
-        for (const auto& ses : sessions_ ) {
-            ses.second->close();
-        }
-        if (ownership_) delete inner_client_;
-    }
+    ~MultiplexingSocketClient();
 public:
     ISocketStream *connect(const std::string &remote, int port) override {
         EndPoint ep;
@@ -181,39 +350,50 @@ public:
         return nullptr;
     }
 
-    ISocketStream * connect(EndPoint remote) override {
-        mutex_.lock();
-        auto it = sessions_.find(remote);
-        if (it == sessions_.end()) {
-            mutex_.unlock();
-            auto conn = inner_client_->connect(remote);
-            if (!conn) {
-                return nullptr;
-            }
-
-            auto mux_session = new MultiplexingSession(conn, true, MuxStreamType::Client);
-            auto mux_stream = mux_session->open_stream();
-            if (mux_stream == nullptr) {
-                return mux_stream;
-            }
-            mutex_.lock();
-            sessions_.emplace(remote, mux_session);
-            mutex_.unlock();
-            return mux_stream;
-        }
-        auto mux_stream = it->second->open_stream();
-        if (mux_stream == nullptr) {
-            sessions_.erase(it);
-            return nullptr;
-        }
-        mutex_.unlock();
-        return mux_stream;
+    ISocketClient* set_socket_options(const SocketOptions& opts) override {
+        inner_client_->set_socket_options(opts);
+        return this;
     }
+
+    ISocketStream * connect(EndPoint remote) override;
+
+    // session_count is the number of sessions kept to ep
+    size_t session_count(const EndPoint& ep);
+
+    // retire closes sessions idle since before now_ms - idle_timeout_ms,
+    // and failed ones once their streams are gone
+    void retire(int64_t now_ms);
+
 private:
-    std::unordered_map<EndPoint, MultiplexingSession*> sessions_{};
+    struct sessionEntry {
+        // streams opened on it share it, it outlives the client while they are around
+        std::shared_ptr<MultiplexingSession> session;
+        // connects opening a stream on the session without mutex_ held
+        int opening{0};
+    };
+
+    struct sessionGroup {
+        std::vector<std::unique_ptr<sessionEntry>> sessions;
+        // connects dialing a new session to the endpoint
+        int dialing{0};
+        size_t next{0};
+    };
+
+    // pick returns a session of group with room for one more stream, nullptr when
+    // the group should grow. Called with mutex_ held
+    sessionEntry* pick(sessionGroup& group, bool full_ok);
+
+    static int64_t now_ms();
+
+private:
+    std::unordered_map<EndPointKey, sessionGroup> groups_{};
     ISocketClient* inner_client_{nullptr};
     bool ownership_{false};
     acl::fiber_mutex mutex_{};
+    MuxClientOption option_;
+
+    acl::fiber_tbox<bool> exit_chn_;
+    acl::fiber_tbox<bool> wait_chn_;
 };
 
 }}
\ No newline at end of file
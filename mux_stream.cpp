@@ -3,6 +3,55 @@
 
 namespace arch_net { namespace mux {
 
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// raw storage of deleted streams, reused by the next ones
+struct StreamSlot {
+    alignas(MultiplexingStream) char bytes[sizeof(MultiplexingStream)];
+};
+
+static ObjectPool<StreamSlot>& stream_slots() {
+    static ObjectPool<StreamSlot> slots(0, 4096);
+    return slots;
+}
+
+void* MultiplexingStream::operator new(size_t size) {
+    return stream_slots().Get();
+}
+
+void MultiplexingStream::operator delete(void* p) {
+    stream_slots().Release(static_cast<StreamSlot*>(p));
+}
+
+MultiplexingStream::MultiplexingStream(uint32_t id, MultiplexingSession* session, StreamState state)
+    : id_(id), session_(session), recv_window_(FLAGS_MaxStreamWindowSize),
+      window_size_(session->flow_.initial_stream_window), send_window_(FLAGS_MaxStreamWindowSize),
+      lock_(), event_(), state_(state), recv_buff_() {
+    MultiplexingSession::add_advertised_window(window_size_);
+    session_->stream_created();
+}
+
+MultiplexingStream::~MultiplexingStream() {
+    close();
+    // a reset or session closed stream skipped close_stream, and the recv loop may
+    // still be handling a frame of it: out of the map first, then wait for it to leave
+    session_->close_stream(id_);
+    lock_.lock();
+    while (users_ > 0) {
+        wait();
+    }
+    lock_.unlock();
+    session_->unschedule(this);
+    // payload nobody read still holds connection window
+    session_->on_consumed(recv_buff_.size());
+    MultiplexingSession::add_advertised_window(-(int64_t)window_size_);
+    // the session may be retired as soon as its last stream is gone
+    session_->stream_deleted();
+}
+
 ssize_t MultiplexingStream::recv(Buffer *buff) {
     auto n = recv(buff->WriteBegin(), buff->WritableBytes(), 0);
     if (n > 0) {
@@ -11,54 +60,146 @@ ssize_t MultiplexingStream::recv(Buffer *buff) {
     return n;
 }
 
-ssize_t MultiplexingStream::recv(void *buf, size_t count, int flags) {
-
-    close_wg_.add(1);
-    defer(close_wg_.done());
+ssize_t MultiplexingStream::wait_data() {
+    lock_.lock();
+    while (true) {
+        if (!recv_buff_.empty()) {
+            return recv_buff_.size();
+        }
+        // data that came in before the close is still handed out
+        if (closed()) {
+            bool reset = state_ == StreamReset;
+            lock_.unlock();
+            return reset ? -1 : 0;
+        }
+        wait();
+    }
+}
 
+bool MultiplexingStream::closed() const {
     switch (state_) {
         case StreamLocalClose:
         case StreamRemoteClose:
         case StreamClosed:
         case StreamReset:
-            recv_lock_.lock();
-            if (recv_buff_.size() == 0) {
-                recv_lock_.unlock();
-                return 0;
-            }
-            recv_lock_.unlock();
+            return true;
         default:
-            break;
+            return false;
     }
+}
 
-    while (true) {
-        recv_lock_.lock();
-        if (recv_buff_.size() == 0) {
-            recv_lock_.unlock();
+bool MultiplexingStream::wait(int timeout_ms) {
+    waiters_++;
+    bool ok = event_.wait(lock_, timeout_ms);
+    waiters_--;
+    return ok;
+}
 
-            auto res = recv_done_notify_.pop();
-            if (!res) {
-                return -1;
-            }
+void MultiplexingStream::wake_all() {
+    // a fiber woken for another event checks its own and waits again
+    for (uint16_t i = 0; i < waiters_; i++) {
+        event_.notify();
+    }
+}
 
-            recv_lock_.lock();
-            if (recv_buff_.size() == 0) {
-                recv_lock_.unlock();
-                continue;
-            }
+void MultiplexingStream::signal(uint8_t events) {
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    events_ |= events;
+    wake_all();
+}
 
-            auto slice = recv_buff_.Next(count);
-            std::memcpy(buf, slice.data(), slice.size());
-            recv_lock_.unlock();
-            return slice.size();
-        } else {
-            auto slice = recv_buff_.Next(count);
-            std::memcpy(buf, slice.data(), slice.size());
-            recv_lock_.unlock();
-            return slice.size();
+uint8_t MultiplexingStream::wait_event(uint8_t events, int timeout_ms, bool stop_on_close) {
+    int64_t deadline = now_us() + (int64_t)timeout_ms * 1000;
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    while (!(events_ & events) && !(stop_on_close && closed())) {
+        int64_t left_ms = (deadline - now_us()) / 1000;
+        if (left_ms <= 0) {
+            break;
         }
+        wait(left_ms);
+    }
+    uint8_t got = events_ & events;
+    events_ &= ~got;
+    return got;
+}
+
+void MultiplexingStream::enter() {
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    users_++;
+}
+
+void MultiplexingStream::leave() {
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    if (--users_ == 0) {
+        wake_all();
+    }
+}
+
+ssize_t MultiplexingStream::recv(void *buf, size_t count, int flags) {
+    enter();
+    defer(leave());
+
+    auto n = wait_data();
+    if (n <= 0) {
+        return n;
+    }
+    auto copied = recv_buff_.CopyTo(buf, std::min<size_t>(count, n));
+    recv_buff_.Skip(copied);
+    auto delta = consumed(copied);
+    lock_.unlock();
+    if (delta > 0) {
+        session_->queue_window_update(id_, delta);
     }
+    session_->on_consumed(copied);
+    return copied;
+}
+
+ssize_t MultiplexingStream::recv(IOBuffer *buf, size_t count) {
+    enter();
+    defer(leave());
 
+    auto n = wait_data();
+    if (n <= 0) {
+        return n;
+    }
+    auto cut = recv_buff_.Cut(buf, std::min<size_t>(count, n));
+    auto delta = consumed(cut);
+    lock_.unlock();
+    if (delta > 0) {
+        session_->queue_window_update(id_, delta);
+    }
+    session_->on_consumed(cut);
+    return cut;
+}
+
+uint32_t MultiplexingStream::consumed(size_t n) {
+    auto& flow = session_->flow_;
+    uint64_t outstanding = recv_buff_.size() + recv_window_;
+    if (outstanding + window_size_ / 2 > window_size_) {
+        return 0;
+    }
+    int64_t now = now_us();
+    if (session_->memory_pressure()) {
+        // hand back less than was read until the window is down to the floor
+        uint32_t shrink = std::min(window_size_ - flow.initial_stream_window, window_size_ / 2);
+        window_size_ -= shrink;
+        MultiplexingSession::add_advertised_window(-(int64_t)shrink);
+        if (outstanding + window_size_ / 2 > window_size_) {
+            return 0;
+        }
+    } else if (flow.auto_tune && window_size_ < flow.max_stream_window) {
+        // half the window went by within two rtts: the window limits the stream, double it
+        int64_t rtt = session_->rtt_us();
+        if (rtt > 0 && last_window_update_us_ > 0 && now - last_window_update_us_ < 2 * rtt) {
+            uint32_t grow = std::min(window_size_, flow.max_stream_window - window_size_);
+            window_size_ += grow;
+            MultiplexingSession::add_advertised_window(grow);
+        }
+    }
+    last_window_update_us_ = now;
+    uint32_t delta = window_size_ - outstanding;
+    recv_window_ += delta;
+    return delta;
 }
 
 ssize_t MultiplexingStream::recv(const struct iovec *iov, int iovcnt, int flags) {
@@ -75,68 +216,77 @@ ssize_t MultiplexingStream::send(Buffer* buff) {
 }
 
 ssize_t MultiplexingStream::send(const void *buf, size_t count, int flags) {
-    close_wg_.add(1);
-    defer(close_wg_.done());
-
-    switch (state_) {
-        case StreamLocalClose:
-        case StreamRemoteClose:
-        case StreamClosed:
-        case StreamReset:
-            close_chn_.push(nullptr);
-            return -1;
-        default:
-            break;
-    }
+    enter();
+    defer(leave());
 
-    if (send_window_ == 0) {
-        return 0;
+    lock_.lock();
+    bool is_closed = closed();
+    lock_.unlock();
+    if (is_closed) {
+        return -1;
     }
 
-    session_->add_send_task([this, buf=buf, count=count]() -> int {
-
-        switch (state_) {
-            case StreamLocalClose:
-            case StreamRemoteClose:
-            case StreamClosed:
-            case StreamReset:
-                send_done_notify_.push(nullptr);
-                return 1;
-            default:
-                break;
+    // frames never exceed what the peer has room for, larger sends go out in pieces
+    size_t sent = 0;
+    while (sent < count) {
+        auto n = session_->acquire_send_window(this, count - sent);
+        if (n == 0) {
+            return sent > 0 ? (ssize_t)sent : -1;
         }
+        if (send_frame((const char*)buf + sent, n) <= 0) {
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
 
-        auto s_flags = send_flags();
-
-        Buffer hdr_buff(HeaderSize,0);
-        Header hdr;
+int MultiplexingStream::send_frame(const void *buf, uint32_t count) {
+    // the send loop cuts the payload into frames as the stream priority allows
+    session_->schedule_data(this, buf, count);
 
-        hdr.encode(&hdr_buff, typeData, s_flags, id_, count);
-        int ret = session_->send_message(&hdr_buff, buf, count);
-        if (ret <= 0) {
-            send_done_notify_.push(nullptr);
-            return -1;
-        }
-        send_done_notify_.push(&SendSuccess);
+    // a close doesn't end the wait: frames of buf may sit in a batch not written yet,
+    // the send loop fails the send once nothing of buf is referenced anymore
+    if (wait_event(kSendDone | kSendFailed, FLAGS_ConnectionWriteTimeout, false) == kSendDone) {
         return 1;
-    });
+    }
+    // timeout or failed, whatever is left of buf must not go out anymore. Frames already
+    // cut from it may be in the writev of the send loop, buf is freed once they are written
+    session_->unschedule(this);
+    return wait_frames() ? 1 : -1;
+}
 
-    auto ret = send_done_notify_.pop(FLAGS_ConnectionWriteTimeout);
-    if (ret) {
-        return count;
+void MultiplexingStream::frame_flushed(bool last, bool ok) {
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    tx_frames_--;
+    if (last || !ok) {
+        events_ |= last && ok ? kSendDone : kSendFailed;
     }
-    // timeout, close stream
-    return -1;
+    wake_all();
+}
+
+bool MultiplexingStream::wait_frames() {
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    while (tx_frames_ > 0) {
+        wait();
+    }
+    // a last frame written while the sender timed out still completed the send
+    bool done = events_ & kSendDone;
+    events_ &= ~(kSendDone | kSendFailed);
+    return done;
+}
+
+void MultiplexingStream::set_priority(const StreamPriority &priority) {
+    session_->set_priority(this, priority);
 }
 
 ssize_t MultiplexingStream::send(const struct iovec *iov, int iovcnt, int flags) {
-    throw "unsupported method";
-    return -1;
+    return writev_by_send(this, iov, iovcnt);
 }
 
 ssize_t MultiplexingStream::sendfile(int in_fd, off_t offset, size_t count) {
-    throw "unsupported method";
-    return -1;
+    // frames share the session connection, the file has to be copied into data frames
+    return sendfile_by_copy(this, in_fd, offset, count);
 }
 
 int MultiplexingStream::get_fd() {
@@ -144,19 +294,14 @@ int MultiplexingStream::get_fd() {
 }
 
 int MultiplexingStream::send_window_update() {
-    uint32_t max = FLAGS_MaxStreamWindowSize;
-    uint32_t delta = max - recv_buff_.size() - recv_window_;
     uint16_t flags = send_flags();
-    if (delta < (max / 2) && flags == 0) {
-        return 1;
-    }
+    // the SYN or ACK raises the protocol window to the initial window of the session
+    lock_.lock();
+    uint32_t delta = window_size_ - recv_buff_.size() - recv_window_;
     recv_window_ += delta;
-    control_hdr_.encode(&hdr_buff_, MsgType::typeWindowUpdate, flags, id_, delta);
-    int n = session_->send_message(&hdr_buff_, nullptr);
-    if (n <= 0) {
-        return n;
-    }
-    return 1;
+    last_window_update_us_ = now_us();
+    lock_.unlock();
+    return session_->send_frame(MsgType::typeWindowUpdate, flags, id_, delta);
 }
 
 uint16_t MultiplexingStream::send_flags() {
@@ -179,20 +324,37 @@ uint16_t MultiplexingStream::send_flags() {
 void MultiplexingStream::send_close() {
     auto flags = send_flags();
     flags |= flagFIN;
-    acl::fiber_tbox<bool> chan;
-    session_->add_send_task([&]() {
-        Buffer hdr_buff(HeaderSize,0);
-        Header hdr;
-        hdr.encode(&hdr_buff, typeWindowUpdate, flags, id_, 0);
-        defer(chan.push(nullptr));
-        return session_->send_message(&hdr_buff, nullptr);
+    // by id: close gives up on the FIN after a timeout and the stream may be deleted
+    // by the time the task runs, close_stream takes it out of the map first
+    auto session = session_;
+    auto id = id_;
+    session_->add_send_task([session, id, flags]() {
+        session->on_flushed([session, id](bool) {
+            std::lock_guard<acl::fiber_mutex> guard(session->mux_streams_.mutex);
+            auto it = session->mux_streams_.streams.find(id);
+            if (it != session->mux_streams_.streams.end()) {
+                it->second->signal(kCloseSent);
+            }
+        });
+        return session->send_frame(typeWindowUpdate, flags, id, 0);
     });
-    chan.pop();
+    // a session that shut down runs no send task anymore, the FIN is as good as sent
+    int64_t deadline = now_us() + (int64_t)FLAGS_StreamCloseTimeout * 1000;
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
+    while (!(events_ & kCloseSent) && !session_->is_closed()) {
+        int64_t left_ms = (deadline - now_us()) / 1000;
+        if (left_ms <= 0) {
+            LOG(ERROR) << "stream " << id_ << " FIN not written in time";
+            break;
+        }
+        wait(left_ms);
+    }
+    events_ &= ~kCloseSent;
 }
 
 int MultiplexingStream::close() {
 
-    state_lock_.lock();
+    lock_.lock();
 
     switch (state_) {
         // Opened means we need to signal a close
@@ -200,53 +362,55 @@ int MultiplexingStream::close() {
         case StreamSYNReceived:
         case StreamEstablished:
             state_ = StreamLocalClose;
+            // readers and senders give up now, the FIN still goes out after their frames
+            wake_all();
+            lock_.unlock();
             send_close();
-            recv_done_notify_.push(nullptr);
-            send_done_notify_.push(nullptr);
-            state_ = StreamClosed;
-            state_lock_.unlock();
 
-            close_wg_.wait();
+            lock_.lock();
+            state_ = StreamClosed;
+            while (users_ > 0) {
+                wait();
+            }
+            lock_.unlock();
             session_->close_stream(id_);
             return 1;
 
         case StreamLocalClose:
             state_ = StreamClosed;
-            state_lock_.unlock();
+            lock_.unlock();
 
             session_->close_stream(id_);
             return 1;
 
         case StreamRemoteClose:
             state_ = StreamClosed;
-            recv_done_notify_.push(nullptr);
-            send_done_notify_.push(nullptr);
-            state_lock_.unlock();
+            wake_all();
+            while (users_ > 0) {
+                wait();
+            }
+            lock_.unlock();
 
-            close_wg_.wait();
             session_->close_stream(id_);
             return 1;
 
         case StreamClosed:
         case StreamReset:
-            state_lock_.unlock();
+            lock_.unlock();
 
             return 1;
         default:
             LOG(ERROR)<< "unhandled state";
-            state_lock_.unlock();
+            lock_.unlock();
 
             return -1;
     }
 }
 
 int MultiplexingStream::set_close() {
-    state_lock_.lock();
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
     state_ = StreamClosed;
-    state_lock_.unlock();
-
-    recv_done_notify_.push(nullptr);
-    send_done_notify_.push(nullptr);
+    wake_all();
     return 0;
 }
 
@@ -260,19 +424,16 @@ int MultiplexingStream::increase_send_window(Header &hdr, uint16_t flags) {
     if (process_flags(flags, close_stream) <= 0) {
         return -1;
     }
+    session_->flow_mutex_.lock();
     send_window_ += hdr.length();
-
-    if (close_stream) {
-        // peer send FIN
-        recv_done_notify_.push(nullptr);
-        send_done_notify_.push(nullptr);
-    }
+    session_->flow_mutex_.unlock();
+    // a FIN woke the waiters already
+    signal(kWindow);
     return 1;
 }
 
 int MultiplexingStream::process_flags(uint16_t flags, bool& close_stream) {
-    state_lock_.lock();
-    defer(state_lock_.unlock());
+    std::lock_guard<acl::fiber_mutex> guard(lock_);
 
     if ( (flags & flagACK) == flagACK) {
         if (state_ == StreamSYNSent) {
@@ -303,35 +464,40 @@ int MultiplexingStream::process_flags(uint16_t flags, bool& close_stream) {
             close_stream = true;
     }
 
+    if (close_stream) {
+        wake_all();
+    }
     return 1;
 }
 
 int MultiplexingStream::read_data(Header &hdr, uint16_t flags) {
-    bool close_stream = false;
-    if (process_flags(flags, close_stream) <= 0) {
-        return -1;
-    }
-
     uint32_t length = hdr.length();
+    // readers on other threads hand window back in consumed() meanwhile
+    lock_.lock();
     if (length > recv_window_) {
+        lock_.unlock();
         return -1;
     }
-    recv_lock_.lock();
-    uint32_t ret = session_->read_body(&recv_buff_, length);
-    if (ret <= 0) {
+    recv_window_ -= length;
+    lock_.unlock();
+
+    // read outside the lock straight into blocks the reader takes over as they are
+    IOBuffer body;
+    if (length > 0 && session_->read_body(&body, length) <= 0) {
         return -1;
     }
-    recv_lock_.unlock();
-    recv_window_ -= ret;
 
-    assert(ret == length);
-    if (ret > 0) {
-        recv_done_notify_.push(&RecvSuccess);
+    if (length > 0) {
+        lock_.lock();
+        recv_buff_.Append(std::move(body));
+        wake_all();
+        lock_.unlock();
     }
 
-    if (close_stream) {
-        recv_done_notify_.push(nullptr);
-        send_done_notify_.push(nullptr);
+    // a FIN goes after its payload, so a reader seeing the close has all of it
+    bool close_stream = false;
+    if (process_flags(flags, close_stream) <= 0) {
+        return -1;
     }
 
     return 1;
@@ -5,45 +5,355 @@ namespace arch_net {
 
 std::unique_ptr<IOWorkerPool> ResolverWithLB::worker_ = std::make_unique<IOWorkerPool>(1);
 
-DNSResolver::DNSResolver(const std::string& server_name)
-    : ResolverWithLB("DNS resolver"), service_name_(server_name) {
+bool tcp_connect_probe(const EndPoint& endpoint, int timeout_ms) {
+    EndPoint remote = endpoint;
+    int fd = arch_net::socket(remote.sock_addr.ss_family);
+    if (fd < 0) {
+        return false;
+    }
+    // connect closes fd itself when it fails
+    if (arch_net::connect(fd, remote.sock_addr, timeout_ms) != OK) {
+        return false;
+    }
+    defer(arch_net::close(fd));
+    // writable after a non blocking connect, the outcome is in SO_ERROR
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+ResolverWithLB::~ResolverWithLB() {
+    if (health_running_) {
+        health_stop_chn_.push(nullptr);
+        health_done_chn_.pop();
+    }
+}
+
+int64_t ResolverWithLB::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ResolverWithLB::get_servers(std::vector<ServerNode> &endpoints) {
+    auto current = server_set();
+    if (current) {
+        endpoints = current->servers;
+    }
+}
 
-    DNSResolver::resolve(resolve_cache_);
-    load_balance_->on_changed(resolve_cache_);
+ServerNode ResolverWithLB::get_next(uint32_t seed) {
+    auto current = server_set();
+    if (!current || current->servers.empty()) {
+        return ServerNode{};
+    }
+    return load_balance_->get_next(seed, current->servers);
+}
+
+bool ResolverWithLB::publish(std::vector<ServerNode> &&servers) {
+    std::lock_guard<acl::fiber_mutex> guard(update_mutex_);
+    auto current = server_set();
+    if (current && current->servers.size() == servers.size() &&
+        std::equal(current->servers.begin(), current->servers.end(), servers.begin(),
+                   [](const ServerNode& a, const ServerNode& b) { return a.endpoint == b.endpoint; })) {
+        return false;
+    }
+    auto next = std::make_shared<ServerSet>();
+    for (auto& server : servers) {
+        auto key = server.endpoint.key();
+        auto health = current ? current->find(server.endpoint) : nullptr;
+        if (!health) {
+            health = std::make_shared<EndPointHealth>();
+        }
+        server.valid = !health->ejected.load(std::memory_order_relaxed);
+        next->health.emplace(key, health);
+    }
+    next->servers = std::move(servers);
+    std::shared_ptr<const ServerSet> published = next;
+    std::atomic_store_explicit(&server_set_, published, std::memory_order_release);
+    load_balance_->on_changed(published->servers);
+    return true;
 }
 
-void DNSResolver::get_servers(std::vector<ServerNode> &server_nodes) {
-    if (!resolve_cache_.empty()) {
-        server_nodes = resolve_cache_;
+void ResolverWithLB::republish() {
+    auto current = server_set();
+    if (!current) {
         return;
     }
-    resolve(server_nodes);
+    auto next = std::make_shared<ServerSet>(*current);
+    for (auto& server : next->servers) {
+        server.valid = !next->find(server.endpoint)->ejected.load(std::memory_order_relaxed);
+    }
+    std::shared_ptr<const ServerSet> published = next;
+    std::atomic_store_explicit(&server_set_, published, std::memory_order_release);
+    load_balance_->on_changed(published->servers);
 }
 
-ServerNode DNSResolver::get_next(uint32_t seed) {
-    return load_balance_->get_next(seed, resolve_cache_);
+void ResolverWithLB::with_outlier_detection(const OutlierDetectionOption &option) {
+    outlier_ = option;
+    if (outlier_.consecutive_failures <= 0 || health_running_) {
+        return;
+    }
+    health_running_ = true;
+    ResolverWithLB::worker_->addTask([this](){
+        health_loop();
+    });
 }
 
-void DNSResolver::resolve(std::vector<ServerNode> &server_nodes)  {
-    std::vector<std::string> addrs;
-    std::string host_name;
-    int port;
-    SplitHostPort(service_name_, host_name, port);
-    dns_resolve(host_name, addrs);
+size_t ResolverWithLB::ejected_count() const {
+    auto current = server_set();
+    if (!current) {
+        return 0;
+    }
+    size_t n = 0;
+    for (auto& server : current->servers) {
+        n += !server.valid;
+    }
+    return n;
+}
+
+void ResolverWithLB::record(const EndPoint &endpoint, bool failed) {
+    auto current = server_set();
+    auto health = current ? current->find(endpoint) : nullptr;
+    if (!health) {
+        return;
+    }
+    if (!failed) {
+        // the common path only reads, a shared line stays shared
+        if (health->failures.load(std::memory_order_relaxed) != 0) {
+            health->failures.store(0, std::memory_order_relaxed);
+        }
+        return;
+    }
+    int32_t failures = health->failures.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (failures >= outlier_.consecutive_failures && !health->ejected.load(std::memory_order_relaxed)) {
+        eject(endpoint, now_ms());
+    }
+}
+
+bool ResolverWithLB::eject(const EndPoint &endpoint, int64_t now) {
+    std::lock_guard<acl::fiber_mutex> guard(update_mutex_);
+    auto current = server_set();
+    auto health = current ? current->find(endpoint) : nullptr;
+    if (!health) {
+        return false;
+    }
+    bool ejected = health->ejected.load(std::memory_order_relaxed);
+    if (!ejected) {
+        size_t n = 0;
+        for (auto& server : current->servers) {
+            n += !server.valid;
+        }
+        if ((n + 1) * 100 > current->servers.size() * outlier_.max_ejection_percent) {
+            return false;
+        }
+    }
+    // a readmitted endpoint healthy for a while starts over
+    if (health->ejections > 0 && !ejected && now - health->readmitted_ms >= outlier_.max_ejection_ms) {
+        health->ejections = 0;
+    }
+    int64_t duration = outlier_.base_ejection_ms;
+    for (int i = 0; i < health->ejections && duration < outlier_.max_ejection_ms; i++) {
+        duration *= 2;
+    }
+    health->ejections++;
+    health->ejected_until_ms = now + std::min<int64_t>(duration, outlier_.max_ejection_ms);
+    if (ejected) {
+        return false;
+    }
+    LOG(ERROR) << name_ << " ejects " << ToIPPort(&endpoint.sock_addr) << " after "
+               << health->failures.load(std::memory_order_relaxed) << " failures";
+    health->ejected.store(true, std::memory_order_relaxed);
+    republish();
+    return true;
+}
+
+bool ResolverWithLB::readmit(const EndPoint &endpoint, int64_t now) {
+    std::lock_guard<acl::fiber_mutex> guard(update_mutex_);
+    auto current = server_set();
+    auto health = current ? current->find(endpoint) : nullptr;
+    if (!health || !health->ejected.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    health->failures.store(0, std::memory_order_relaxed);
+    health->readmitted_ms = now;
+    health->ejected.store(false, std::memory_order_relaxed);
+    republish();
+    return true;
+}
+
+bool ResolverWithLB::probe(const EndPoint &endpoint) {
+    if (outlier_.probe) {
+        return outlier_.probe(endpoint);
+    }
+    return tcp_connect_probe(endpoint, outlier_.probe_timeout_ms);
+}
+
+void ResolverWithLB::check_health(int64_t now) {
+    auto current = server_set();
+    if (!current) {
+        return;
+    }
+    bool probing = outlier_.probe_interval_ms > 0;
+    bool probe_due = probing && now >= next_probe_ms_;
+    if (probe_due) {
+        next_probe_ms_ = now + outlier_.probe_interval_ms;
+    }
+    for (auto& server : current->servers) {
+        auto health = current->find(server.endpoint);
+        if (health->ejected.load(std::memory_order_relaxed)) {
+            if (now < health->ejected_until_ms) {
+                continue;
+            }
+            // with probes only a passing one readmits, a failing one extends the ejection
+            if (!probing || probe(server.endpoint)) {
+                readmit(server.endpoint, now_ms());
+            } else {
+                eject(server.endpoint, now_ms());
+            }
+        } else if (probe_due) {
+            record(server.endpoint, !probe(server.endpoint));
+        }
+    }
+}
+
+void ResolverWithLB::health_loop() {
+    int tick_ms = std::max(10, std::min(outlier_.base_ejection_ms / 4, 250));
+    if (outlier_.probe_interval_ms > 0) {
+        tick_ms = std::max(10, std::min(tick_ms, outlier_.probe_interval_ms));
+    }
+    while (true) {
+        bool found = false;
+        health_stop_chn_.pop(tick_ms, &found);
+        if (found) {
+            break;
+        }
+        check_health(now_ms());
+    }
+    health_done_chn_.push(nullptr);
+}
+
+DNSResolver::DNSResolver(const std::string& server_name, const DNSResolverOption& option, LoadBalance* lb)
+    : ResolverWithLB("DNS resolver", lb), option_(option) {
+
+    SplitHostPort(server_name, host_, port_);
+    if (option_.nameservers.empty()) {
+        system_nameservers(option_.nameservers);
+    }
+    if (option_.search.empty() && option_.ndots < 0) {
+        system_search_domains(option_.search, option_.ndots);
+    }
+    search_names(host_, option_.search, std::max(option_.ndots, 0), names_);
+
+    std::vector<ServerNode> server_nodes;
+    refresh_ms_ = query(server_nodes);
+    // nothing is published until the name resolves, run() keeps retrying
+    if (!server_nodes.empty()) {
+        publish(std::move(server_nodes));
+    }
+    start_background();
+}
+
+DNSResolver::~DNSResolver() {
+    exit_ = true;
+    stop_chn_.push(nullptr);
+    done_chn_.pop();
+}
+
+int DNSResolver::query(std::vector<ServerNode> &server_nodes) {
+    // literal addresses never change
+    struct sockaddr_storage ss;
+    bool is_v6;
+    if (ParseFromIPPort(host_, port_, ss, is_v6)) {
+        server_nodes.emplace_back();
+        server_nodes.back().endpoint.from(host_, port_);
+        return option_.max_refresh_ms;
+    }
+
+    for (auto& name : names_) {
+        std::vector<DNSRecord> records;
+        if (!query_nameservers(name, records)) {
+            continue;
+        }
 
-    for(auto& addr : addrs) {
+        uint32_t ttl = UINT32_MAX;
+        for (auto& record : records) {
+            server_nodes.emplace_back();
+            server_nodes.back().endpoint.from(record.addr, port_);
+            ttl = std::min(ttl, record.ttl);
+        }
+        std::sort(server_nodes.begin(), server_nodes.end());
+        int64_t refresh_ms = (int64_t)ttl * 1000;
+        return (int)std::max<int64_t>(option_.min_refresh_ms, std::min<int64_t>(refresh_ms, option_.max_refresh_ms));
+    }
+
+    // no nameserver knows the name, /etc/hosts and friends still may
+    std::vector<std::string> addrs;
+    dns_resolve(host_, addrs);
+    if (addrs.empty()) {
+        return -1;
+    }
+    for (auto& addr : addrs) {
         server_nodes.emplace_back();
-        server_nodes.back().endpoint.from(addr, port);
+        server_nodes.back().endpoint.from(addr, port_);
     }
     std::sort(server_nodes.begin(), server_nodes.end());
+    server_nodes.erase(std::unique(server_nodes.begin(), server_nodes.end(),
+                       [](const ServerNode& a, const ServerNode& b) { return a.endpoint == b.endpoint; }),
+                       server_nodes.end());
+    return option_.default_refresh_ms;
 }
 
-void DNSResolver::discard_cache()  {
-    resolve_cache_.clear();
+bool DNSResolver::query_nameservers(const std::string& name, std::vector<DNSRecord>& records) {
+    for (auto& nameserver : option_.nameservers) {
+        records.clear();
+        int ret = dns_query(nameserver, name, AF_INET, records, option_.query_timeout_ms);
+        // the name doesn't exist, the other nameservers won't know it either
+        if (ret == kNXDomain) {
+            return false;
+        }
+        if (ret != OK) {
+            continue;
+        }
+        // a server answering A but failing AAAA is still an answer
+        dns_query(nameserver, name, AF_INET6, records, option_.query_timeout_ms);
+        if (!records.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DNSResolver::run() {
+    int retry_ms = option_.min_refresh_ms;
+    int wait_ms = refresh_ms_ > 0 ? refresh_ms_ : retry_ms;
+    while (!exit_) {
+        bool found = false;
+        stop_chn_.pop(wait_ms, &found);
+        if (found || exit_) {
+            break;
+        }
+        std::vector<ServerNode> server_nodes;
+        int refresh_ms = query(server_nodes);
+        refresh_count_.fetch_add(1, std::memory_order_relaxed);
+        // keep serving the stale servers until a nameserver answers again
+        if (refresh_ms < 0 || server_nodes.empty()) {
+            wait_ms = retry_ms;
+            retry_ms = std::min(retry_ms * 2, option_.max_retry_ms);
+            continue;
+        }
+        retry_ms = option_.min_refresh_ms;
+        wait_ms = refresh_ms;
+        publish(std::move(server_nodes));
+    }
+    done_chn_.push(nullptr);
 }
 
-ServerNode FixedListResolver::get_next(uint32_t seed) {
-    return load_balance_->get_next(seed, resolve_cache_);
+void DNSResolver::resolve(std::vector<ServerNode> &server_nodes)  {
+    query(server_nodes);
+}
+
+void DNSResolver::discard_cache()  {
+    clear_servers();
 }
 
 }
\ No newline at end of file
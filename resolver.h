@@ -2,6 +2,8 @@
 #include "socket_stream.h"
 #include "common.h"
 #include "load_balance.h"
+#include "dns.h"
+#include <functional>
 namespace arch_net {
 
 enum ResolveType {
@@ -10,77 +12,217 @@ enum ResolveType {
 
 };
 
+struct OutlierDetectionOption {
+    // consecutive failed connects or requests that eject an endpoint, 0 disables detection
+    int consecutive_failures{0};
+    // the n-th ejection in a row lasts base_ejection_ms * 2^(n-1), capped at max_ejection_ms.
+    // an endpoint readmitted and healthy for max_ejection_ms starts over from base_ejection_ms
+    int base_ejection_ms{1000};
+    int max_ejection_ms{60 * 1000};
+    // never eject more than this share of the servers
+    int max_ejection_percent{50};
+    // active probes of every endpoint, 0 only watches the traffic.
+    // with probes an ejected endpoint is readmitted only once a probe passes
+    int probe_interval_ms{0};
+    int probe_timeout_ms{1000};
+    // probe tells whether endpoint is healthy, a tcp connect when empty
+    std::function<bool(const EndPoint&)> probe;
+};
+
+// EndPointHealth is the outlier state of an endpoint, shared by every server set it is part of
+struct EndPointHealth {
+    std::atomic<int32_t> failures{0};
+    std::atomic<bool> ejected{false};
+    // guarded by the resolver's update mutex
+    int ejections{0};
+    int64_t ejected_until_ms{0};
+    int64_t readmitted_ms{0};
+};
+
+// ServerSet is an immutable resolved server list, valid is cleared on ejected servers
+struct ServerSet {
+    std::vector<ServerNode> servers;
+    std::unordered_map<EndPointKey, std::shared_ptr<EndPointHealth>> health;
+
+    std::shared_ptr<EndPointHealth> find(const EndPoint& endpoint) const {
+        auto it = health.find(endpoint.key());
+        return it == health.end() ? nullptr : it->second;
+    }
+};
+
+// tcp_connect_probe connects to endpoint and hangs up
+bool tcp_connect_probe(const EndPoint& endpoint, int timeout_ms);
+
+// ResolverWithLB publishes the resolved servers as a ServerSet snapshot, get_next reads it
+// without locking. With outlier detection endpoints failing in a row are ejected: valid is
+// cleared and the load balance skips them until the ejection ends, see OutlierDetectionOption.
 class ResolverWithLB {
 public:
     ResolverWithLB(const std::string& name, LoadBalance* lb = new RandomBalance())
-        : name_(name), load_balance_(lb) {
-        ResolverWithLB::worker_->addTask([&](){
-            run();
-        });
+        : name_(name), load_balance_(lb) {}
+    virtual ~ResolverWithLB();
+
+    virtual void get_servers(std::vector<ServerNode>& endpoints);
+
+    virtual ServerNode get_next(uint32_t seed);
+
+    // with_load_balance must be called before the resolver is shared
+    void with_load_balance(LoadBalance* lb) {
+        load_balance_.reset(lb);
+        std::vector<ServerNode> servers;
+        get_servers(servers);
+        load_balance_->on_changed(servers);
     }
-    virtual ~ResolverWithLB() {}
 
-    virtual void get_servers(std::vector<ServerNode>& endpoints) = 0;
+    // with_outlier_detection must be called before the resolver is shared
+    void with_outlier_detection(const OutlierDetectionOption& option);
 
-    virtual ServerNode get_next(uint32_t seed) = 0;
+    // request feedback for load aware balancers and outlier detection
+    void on_start(const EndPoint& endpoint) { load_balance_->on_start(endpoint); }
+    void on_finish(const EndPoint& endpoint, int64_t latency_us, bool failed) {
+        load_balance_->on_finish(endpoint, latency_us, failed);
+        if (outlier_.consecutive_failures > 0) {
+            record(endpoint, failed);
+        }
+    }
 
-    void with_load_balance(LoadBalance* lb) { load_balance_.reset(lb);}
+    size_t ejected_count() const;
 
 protected:
     virtual void resolve(std::vector<ServerNode>& endpoints) = 0;
+    // run is the background refresh, start_background schedules it on worker_
     virtual void run() = 0;
     virtual void discard_cache() = 0;
 
+    void start_background() {
+        ResolverWithLB::worker_->addTask([this](){
+            run();
+        });
+    }
+
+    std::shared_ptr<const ServerSet> server_set() const {
+        return std::atomic_load_explicit(&server_set_, std::memory_order_acquire);
+    }
+
+    // publish swaps in sorted servers keeping the health of known endpoints and tells
+    // the load balance, returns false when the addresses didn't change
+    bool publish(std::vector<ServerNode>&& servers);
+
+    void clear_servers() {
+        std::atomic_store_explicit(&server_set_, std::shared_ptr<const ServerSet>(),
+                                   std::memory_order_release);
+    }
+
     static std::unique_ptr<IOWorkerPool> worker_;
 
+private:
+    static int64_t now_ms();
+
+    void record(const EndPoint& endpoint, bool failed);
+    // eject and readmit return false when the endpoint is gone or the state didn't change
+    bool eject(const EndPoint& endpoint, int64_t now);
+    bool readmit(const EndPoint& endpoint, int64_t now);
+    // republish clones the current set with valid following the health, under update_mutex_
+    void republish();
+    bool probe(const EndPoint& endpoint);
+    // check_health readmits expired ejections and runs the due probes
+    void check_health(int64_t now);
+    void health_loop();
+
 protected:
     std::string name_;
     std::unique_ptr<LoadBalance> load_balance_;
     bool exit_{false};
+
+private:
+    std::shared_ptr<const ServerSet> server_set_;
+    // serializes publish, ejections and readmissions, readers never take it
+    acl::fiber_mutex update_mutex_;
+    OutlierDetectionOption outlier_;
+    int64_t next_probe_ms_{0};
+    bool health_running_{false};
+    acl::fiber_tbox<bool> health_stop_chn_;
+    acl::fiber_tbox<bool> health_done_chn_;
+};
+
+struct DNSResolverOption {
+    // empty for the nameservers of /etc/resolv.conf
+    std::vector<EndPoint> nameservers;
+    // names with fewer than ndots dots are tried with the search domains appended first.
+    // Empty search with ndots < 0 takes both from /etc/resolv.conf
+    std::vector<std::string> search;
+    int ndots{-1};
+    int query_timeout_ms{2000};
+    // the cache is refreshed when its shortest ttl expires, clamped to [min, max]
+    int min_refresh_ms{1000};
+    int max_refresh_ms{300 * 1000};
+    // refresh interval when the system resolver answered, it doesn't tell ttls
+    int default_refresh_ms{30 * 1000};
+    // a failed refresh keeps the stale servers and retries after min_refresh_ms,
+    // doubling up to max_retry_ms
+    int max_retry_ms{30 * 1000};
 };
 
+// DNSResolver queries the nameservers for A and AAAA records and refreshes them in the
+// background on worker_ when their ttl runs out. get_next keeps serving the previous
+// servers while a refresh is in flight or failing, the load balance only hears about
+// the new list when the set of addresses changed.
 class DNSResolver : public ResolverWithLB {
 public:
-    DNSResolver(const std::string& server_name);
+    DNSResolver(const std::string& server_name,
+                const DNSResolverOption& option = DNSResolverOption(),
+                LoadBalance* lb = new RandomBalance());
 
-    ~DNSResolver() { exit_ = true;}
-
-    void get_servers(std::vector<ServerNode> &server_nodes) override;
-
-    ServerNode get_next(uint32_t seed = 0) override;
+    ~DNSResolver();
 
     void resolve(std::vector<ServerNode> &server_nodes) override ;
 
-    void run() override {}
+    void run() override;
 
     void discard_cache() override;
 
+    // finished refreshes, successful or not
+    uint64_t refresh_count() const { return refresh_count_.load(std::memory_order_relaxed); }
+
+private:
+    // query resolves service_name_ into sorted server_nodes, returns ms until the answer
+    // expires or -1 if neither a nameserver nor the system resolver knows the name
+    int query(std::vector<ServerNode>& server_nodes);
+
+    // query_nameservers asks the nameservers in order for the A and AAAA records of name,
+    // errors and empty answers move on to the next one, the first NXDOMAIN ends the lookup.
+    // Returns false if none had records
+    bool query_nameservers(const std::string& name, std::vector<DNSRecord>& records);
+
 private:
-    std::vector<ServerNode> resolve_cache_;
-    std::string service_name_;
+    DNSResolverOption option_;
+    std::string host_;
+    // host_ with the search domains applied, in query order
+    std::vector<std::string> names_;
+    int port_{0};
+    int refresh_ms_{0};
+    std::atomic<uint64_t> refresh_count_{0};
+    acl::fiber_tbox<bool> stop_chn_;
+    acl::fiber_tbox<bool> done_chn_;
 };
 
 class FixedListResolver : public ResolverWithLB {
 public:
     FixedListResolver(const std::vector<std::pair<std::string, int>>& servers) : ResolverWithLB("list resolver") {
+        std::vector<ServerNode> server_nodes;
         for (auto & server : servers) {
-            resolve_cache_.emplace_back();
-            resolve_cache_.back().endpoint.from(server.first, server.second);
+            server_nodes.emplace_back();
+            server_nodes.back().endpoint.from(server.first, server.second);
         }
-    }
-    void get_servers(std::vector<ServerNode> &endpoints) override {
-        endpoints = resolve_cache_;
+        std::sort(server_nodes.begin(), server_nodes.end());
+        publish(std::move(server_nodes));
     }
 
-    ServerNode get_next(uint32_t seed = 0) override;
-
-    void resolve(std::vector<ServerNode> &endpoints) override {}
+    void resolve(std::vector<ServerNode> &endpoints) override { get_servers(endpoints); }
 
     void run() override {}
 
-    void discard_cache() override { resolve_cache_.clear(); }
-private:
-    std::vector<ServerNode> resolve_cache_;
+    void discard_cache() override { clear_servers(); }
 };
 
-}
\ No newline at end of file
+}
@@ -31,18 +31,14 @@ int ClientSideConnection::process(const google::protobuf::MethodDescriptor *meth
         return RequestMetaEncodeErr;
     }
 
-    auto ret = connection_->send_message(&req_meta_buffer_);
+    // meta and body go out in a single writev, the buffers are referenced, not copied
+    IOBuffer req;
+    req.AppendUserData((void*)req_meta_buffer_.data(), req_meta_buffer_.size(), IOBlock::NoopDeleter);
+    auto body = controller->UseCompression() ? &req_compress_buffer_ : &req_data_buffer_;
+    req.AppendUserData((void*)body->data(), body->size(), IOBlock::NoopDeleter);
+    auto ret = (ssize_t)connection_->send_message(&req);
     if (ret <= 0) {
-        controller->SetFailed("request meta send error");
-        if (ret <= SendTimeout) {
-            return SendRequestTimeout;
-        }
-        return SendRequestRemoteClose;
-    }
-
-    ret = connection_->send_message(controller->UseCompression() ? &req_compress_buffer_ : &req_data_buffer_);
-    if (ret <= 0) {
-        controller->SetFailed("request message send error");
+        controller->SetFailed("request send error");
         if (ret <= SendTimeout) {
             return SendRequestTimeout;
         }
@@ -5,6 +5,8 @@
 #include <google/protobuf/message.h>
 #include "../common.h"
 #include "../buffer.h"
+#include "../buffer_pool.h"
+#include "../io_buffer.h"
 using google::protobuf::MethodDescriptor;
 using google::protobuf::Message;
 
@@ -226,11 +228,10 @@ public:
     }
 
     static bool StreamingEncode(google::protobuf::Message *resp_msg, Buffer* buffer) {
-        auto data_buffer = GlobalBufferPool::getInstance().Get();
+        auto response_size = resp_msg->ByteSizeLong();
+        auto data_buffer = GlobalBufferPool::getInstance().Get(response_size);
         defer(GlobalBufferPool::getInstance().Release(data_buffer));
 
-        auto response_size = resp_msg->ByteSizeLong();
-        data_buffer->Reset();
         data_buffer->EnsureWritableBytes(response_size);
         if (!resp_msg->SerializeToArray(data_buffer->WriteBegin(), data_buffer->WritableBytes())) {
             return false;
@@ -254,12 +255,11 @@ public:
     }
 
     static bool StreamingDecode(Buffer* buffer, ::google::protobuf::Message *recv_msg) {
-        auto compress_buffer = GlobalBufferPool::getInstance().Get();
-        defer(GlobalBufferPool::getInstance().Release(compress_buffer));
-
         auto uncompressed_size = buffer->ReadUInt32();
 
-        compress_buffer->Reset();
+        auto compress_buffer = GlobalBufferPool::getInstance().Get(uncompressed_size);
+        defer(GlobalBufferPool::getInstance().Release(compress_buffer));
+
         compress_buffer->EnsureWritableBytes(uncompressed_size);
         Compression compressor(CompressType::ZSTD);
         int64_t size;
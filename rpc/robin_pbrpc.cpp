@@ -103,20 +103,18 @@ void RobinPBrpcConnection::on_resp_msg_filled(RequestInfo* req_info, ResponseInf
         return;
     }
 
-    auto ret = stream_->send(&resp_info->meta_buff);
-    if (ret <= 0) {
-        resp_info->error_code = -1;
-        channel_.push(nullptr);
-    }
-
-    if (controller_guard->Failed()) {
-        resp_info->error_code = -1;
-        channel_.push(nullptr);
+    // meta and body go out in a single writev, the buffers are referenced, not copied
+    IOBuffer out;
+    out.AppendUserData((void*)resp_info->meta_buff.data(), resp_info->meta_buff.size(), IOBlock::NoopDeleter);
+    if (!controller_guard->Failed()) {
+        auto body = controller_guard->UseCompression() ? &resp_info->compress_buffer : &resp_info->data_buff;
+        out.AppendUserData((void*)body->data(), body->size(), IOBlock::NoopDeleter);
     }
-    ret = stream_->send(controller_guard->UseCompression() ? &resp_info->compress_buffer : &resp_info->data_buff);
-    if (ret <= 0) {
+    auto ret = out.WriteToSocketStream(stream_);
+    if (ret <= 0 || controller_guard->Failed()) {
         resp_info->error_code = -1;
         channel_.push(nullptr);
+        return;
     }
 
     resp_info->error_code = 0;
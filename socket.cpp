@@ -1,4 +1,10 @@
 #include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
 #include "socket.h"
 
 namespace arch_net {
@@ -253,6 +259,128 @@ ssize_t sendto(int sock, const void* buf, size_t len, int flags,
     return acl_fiber_sendto(sock, buf, len, flags, dest_addr, addrlen);
 }
 
+int recvmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+    while (true) {
+        int n = ::recvmmsg(sock, msgs, vlen, flags | MSG_DONTWAIT, nullptr);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (wait_fd_read_timeout(sock, -1) < 0) {
+            return -1;
+        }
+    }
+}
+
+int sendmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+    unsigned int sent = 0;
+    while (sent < vlen) {
+        int n = ::sendmmsg(sock, msgs + sent, vlen - sent, flags | MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd_write_timeout(sock, -1) > 0) {
+            continue;
+        }
+        break;
+    }
+    return sent > 0 ? (int)sent : -1;
+}
+
+static ssize_t sendfile_by_rw(int out_fd, int in_fd, off_t* offset, size_t count, int timeout) {
+    static const size_t kChunkSize = 64 * 1024;
+    std::unique_ptr<char[]> chunk(new char[std::min(count, kChunkSize)]);
+    size_t sent = 0;
+    while (sent < count) {
+        auto want = std::min(count - sent, kChunkSize);
+        ssize_t n = offset ? ::pread(in_fd, chunk.get(), want, *offset) : arch_net::read(in_fd, chunk.get(), want);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG(ERROR) << "sendfile read error " << strerror(errno);
+            return ERR;
+        }
+        if (n == 0) {
+            break;
+        }
+        size_t written = 0;
+        while (written < (size_t)n) {
+            auto w = arch_net::write(out_fd, chunk.get() + written, n - written, timeout);
+            if (w <= 0) {
+                return w == SendTimeout ? SendTimeout : ERR;
+            }
+            written += w;
+        }
+        if (offset) *offset += n;
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count, int timeout) {
+    struct stat st;
+    if (fstat(in_fd, &st) < 0) {
+        LOG(ERROR) << "sendfile fstat error " << strerror(errno);
+        return ERR;
+    }
+    bool is_pipe = S_ISFIFO(st.st_mode);
+    if (!S_ISREG(st.st_mode) && !is_pipe) {
+        // sockets, character devices: no zero-copy path
+        return sendfile_by_rw(out_fd, in_fd, S_ISSOCK(st.st_mode) ? nullptr : offset, count, timeout);
+    }
+    // non-blocking only for the copy, the caller's mode of out_fd is restored after
+    int out_flags = fcntl(out_fd, F_GETFL);
+    if (out_flags < 0 || set_non_blocking(out_fd) < 0) {
+        return ERR;
+    }
+    defer(if (!(out_flags & O_NONBLOCK)) fcntl(out_fd, F_SETFL, out_flags));
+
+    size_t sent = 0;
+    while (sent < count) {
+        ssize_t n;
+        if (is_pipe) {
+            // pipes are not seekable, offset is ignored
+            n = ::splice(in_fd, nullptr, out_fd, nullptr, count - sent, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            n = ::sendfile(out_fd, in_fd, offset, count - sent);
+        }
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n == 0) {
+            // in_fd reached EOF
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(ERROR) << "sendfile error " << strerror(errno);
+            return ERR;
+        }
+        // splice may also block on an empty pipe
+        if (is_pipe && wait_fd_read_timeout(in_fd, 0) == 0) {
+            if (wait_fd_read_timeout(in_fd, timeout > 0 ? timeout : -1) <= 0) {
+                return timeout > 0 ? SendTimeout : ERR;
+            }
+            continue;
+        }
+        if (wait_fd_write_timeout(out_fd, timeout > 0 ? timeout : -1) <= 0) {
+            return timeout > 0 ? SendTimeout : ERR;
+        }
+    }
+    return sent;
+}
+
 std::string transfer_ip_port(const struct sockaddr_in& addr) {
     std::string ip_port;
     ip_port.append(inet_ntoa(addr.sin_addr)).append(":").append(std::to_string(ntohs(addr.sin_port)));
@@ -640,4 +768,164 @@ void SetTimeout(int fd, uint32_t timeout_ms){
     }
 }
 
-}
\ No newline at end of file
+static bool probe_io_uring() {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)::syscall(__NR_io_uring_setup, 2, &params);
+    if (fd >= 0) {
+        ::close(fd);
+        return true;
+    }
+    LOG(ERROR) << "io_uring unavailable: " << strerror(errno);
+#endif
+    return false;
+}
+
+bool io_uring_available() {
+#ifdef ARCH_NET_IO_URING
+    static const bool available = probe_io_uring();
+    return available;
+#else
+    return false;
+#endif
+}
+
+void schedule_with_engine(IOEngine engine) {
+    if (engine == IOEngine::IOUring) {
+        if (io_uring_available()) {
+            acl::fiber::schedule_with(acl::FIBER_EVENT_T_IO_URING);
+            return;
+        }
+        LOG(ERROR) << "io_uring engine requested, fall back to epoll";
+    }
+    acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
+}
+
+static int set_int_option(int fd, int level, int name, int value, const char* desc) {
+    if (::setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        int serrno = errno;
+        LOG(ERROR) << "setsockopt(" << desc << ") failed, errno=" << serrno << " " << strerror(serrno);
+        return ERR;
+    }
+    return OK;
+}
+
+int apply_socket_options(int fd, const SocketOptions &opts) {
+    int ret = OK;
+    if (opts.tcp_nodelay && set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") < 0) {
+        ret = ERR;
+    }
+    if (opts.tcp_quickack && set_int_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK") < 0) {
+        ret = ERR;
+    }
+    if (opts.send_buffer_size >= 0 &&
+        set_int_option(fd, SOL_SOCKET, SO_SNDBUF, opts.send_buffer_size, "SO_SNDBUF") < 0) {
+        ret = ERR;
+    }
+    if (opts.recv_buffer_size >= 0 &&
+        set_int_option(fd, SOL_SOCKET, SO_RCVBUF, opts.recv_buffer_size, "SO_RCVBUF") < 0) {
+        ret = ERR;
+    }
+#ifdef SO_BUSY_POLL
+    if (opts.busy_poll_us >= 0 &&
+        set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, opts.busy_poll_us, "SO_BUSY_POLL") < 0) {
+        ret = ERR;
+    }
+#endif
+    if (opts.keepalive) {
+        if (set_int_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE") < 0) {
+            ret = ERR;
+        }
+        if (opts.keepalive_idle_s > 0 &&
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, opts.keepalive_idle_s, "TCP_KEEPIDLE") < 0) {
+            ret = ERR;
+        }
+        if (opts.keepalive_interval_s > 0 &&
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, opts.keepalive_interval_s, "TCP_KEEPINTVL") < 0) {
+            ret = ERR;
+        }
+        if (opts.keepalive_count > 0 &&
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPCNT, opts.keepalive_count, "TCP_KEEPCNT") < 0) {
+            ret = ERR;
+        }
+    }
+    return ret;
+}
+
+int apply_connect_socket_options(int fd, const SocketOptions &opts) {
+    int ret = OK;
+#ifdef TCP_FASTOPEN_CONNECT
+    if (opts.fastopen_connect &&
+        set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT") < 0) {
+        ret = ERR;
+    }
+#endif
+    return ret;
+}
+
+int apply_listen_socket_options(int fd, const SocketOptions &opts) {
+    int ret = OK;
+    // accepted sockets inherit the receive buffer, setting it on the listener
+    // lets the SYN-ACK advertise a matching window scale
+    if (opts.recv_buffer_size >= 0 &&
+        set_int_option(fd, SOL_SOCKET, SO_RCVBUF, opts.recv_buffer_size, "SO_RCVBUF") < 0) {
+        ret = ERR;
+    }
+    if (opts.defer_accept_s >= 0 &&
+        set_int_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts.defer_accept_s, "TCP_DEFER_ACCEPT") < 0) {
+        ret = ERR;
+    }
+#ifdef TCP_FASTOPEN
+    if (opts.fastopen_queue >= 0 &&
+        set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN, opts.fastopen_queue, "TCP_FASTOPEN") < 0) {
+        ret = ERR;
+    }
+#endif
+    return ret;
+}
+
+int attach_reuseport_cpu_bpf(int fd, uint32_t group_size) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    if (group_size == 0) {
+        return ERR;
+    }
+    struct sock_filter code[] = {
+        // A = raw_smp_processor_id()
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        // A = A % group_size
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, group_size },
+        // return A
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        LOG(ERROR) << "setsockopt SO_ATTACH_REUSEPORT_CBPF error " << strerror(errno);
+        return ERR;
+    }
+    return OK;
+#else
+    LOG(ERROR) << "SO_ATTACH_REUSEPORT_CBPF not supported";
+    return ERR;
+#endif
+}
+
+int bind_thread_to_cpu(int cpu) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0) {
+        return ERR;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        LOG(ERROR) << "pthread_setaffinity_np error " << strerror(ret);
+        return ERR;
+    }
+    return OK;
+}
+
+}
@@ -41,6 +41,71 @@ struct SocketType {
     Type type;
 };
 
+// IOEngine is the event engine the fiber scheduler of an io thread runs on.
+// With IOUring the acl fiber hooks submit reads, writes and accepts through io_uring
+// instead of waiting for readiness on epoll, handlers still block only their fiber.
+// IOUring ships disabled: it needs the ARCH_NET_IO_URING build option (off by default),
+// without it every io thread runs on epoll.
+enum class IOEngine {
+    Epoll,
+    IOUring,
+};
+
+// io_uring_available probes the kernel once, io_uring may be missing,
+// disabled by the io_uring_disabled sysctl or filtered by seccomp.
+// Always false unless built with ARCH_NET_IO_URING, acl fiber aborts on
+// an io_uring scheduler it was not built for.
+bool io_uring_available();
+
+// schedule_with_engine runs the fiber scheduler of the calling thread on engine,
+// IOUring falls back to epoll when io_uring_available() is false.
+void schedule_with_engine(IOEngine engine);
+
+// SocketOptions tune the tcp sockets a server accepts or a client connects,
+// negative values keep the kernel default.
+struct SocketOptions {
+    // disable Nagle, small rpc frames otherwise wait for the delayed ack (~40ms)
+    bool tcp_nodelay{true};
+    // TCP_QUICKACK is not sticky, the kernel drops back to delayed acks on its own,
+    // so this only acks the first segments quickly. Set it again after reads to keep it
+    bool tcp_quickack{false};
+    int send_buffer_size{-1};           // SO_SNDBUF bytes
+    int recv_buffer_size{-1};           // SO_RCVBUF bytes
+    // SO_BUSY_POLL microseconds, needs CAP_NET_ADMIN above net.core.busy_read
+    int busy_poll_us{-1};
+
+    bool keepalive{false};
+    int keepalive_idle_s{-1};           // TCP_KEEPIDLE
+    int keepalive_interval_s{-1};       // TCP_KEEPINTVL
+    int keepalive_count{-1};            // TCP_KEEPCNT
+
+    // listener only: wake accept once data arrives, at most defer_accept_s after the handshake
+    int defer_accept_s{-1};
+    // listener only: TCP_FASTOPEN queue length
+    int fastopen_queue{-1};
+    // client only: TCP_FASTOPEN_CONNECT, the first write goes out with the SYN
+    bool fastopen_connect{false};
+};
+
+// apply_socket_options sets the per connection options on a tcp socket,
+// call it before connect so the buffer sizes take part in window scaling.
+// Every option is tried, returns ERR if any of them failed.
+int apply_socket_options(int fd, const SocketOptions& opts);
+
+// apply_listen_socket_options sets the listener only options
+int apply_listen_socket_options(int fd, const SocketOptions& opts);
+
+// apply_connect_socket_options sets the client only options, they have to be set before connect
+int apply_connect_socket_options(int fd, const SocketOptions& opts);
+
+// attach_reuseport_cpu_bpf makes the SO_REUSEPORT group fd belongs to hand a new connection
+// to the socket with index (cpu % group_size), cpu being the one that processed the SYN.
+// Sockets are indexed in the order they started listening.
+int attach_reuseport_cpu_bpf(int fd, uint32_t group_size);
+
+// bind_thread_to_cpu pins the calling thread to cpu modulo the number of online cpus
+int bind_thread_to_cpu(int cpu);
+
 
 int unix_socket(int type = SOCK_STREAM);
 
@@ -85,6 +150,18 @@ ssize_t writev(int fd, const struct iovec *iov, int iovcnt, int timeout=0);
 ssize_t sendto(int sock, const void* buf, size_t len, int flags,
                const struct sockaddr* dest_addr, socklen_t addrlen);
 
+// recvmmsg receives up to vlen datagrams in one syscall, the fiber waits for the first one
+int recvmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags);
+
+// sendmmsg sends all vlen messages, waiting in the fiber while the socket buffer is full.
+// Returns how many were sent, -1 if none
+int sendmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags);
+
+// sendfile sends count bytes of in_fd starting at *offset to the socket out_fd.
+// regular files go through sendfile(2), pipes through splice(2), anything else
+// through a read/write loop. *offset is advanced by the bytes sent, even on error.
+ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count, int timeout=0);
+
 std::string transfer_ip_port(const struct sockaddr_in& addr);
 
 int set_non_blocking(int fd);
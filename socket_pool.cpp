@@ -1,11 +1,217 @@
 #include "socket_pool.h"
+#include <chrono>
 
 namespace arch_net {
 
 PooledTCPSocketStream::~PooledTCPSocketStream() {
-    if (drop || !pool->release(end_point, underlay)) {
-        delete underlay;
+    pool->release(end_point, underlay, drop);
+}
+
+TcpSocketPoolClient::TcpSocketPoolClient(ISocketClient *client, bool client_ownership,
+                                         const SocketPoolOption &option)
+    : client_(client), client_ownership_(client_ownership), option_(option), exit_chn_() {
+
+    // a quarter of the timeout keeps streams at most 25% past their deadline
+    int tick = option_.idle_timeout_ms > 0 ? std::max(option_.idle_timeout_ms / 4, 100) : 10000;
+    collector_ = create_fiber([this, tick]()->int {
+        while (true) {
+            bool found = false;
+            exit_chn_.pop(tick, &found);
+            if (found) break;
+            evict(now_ms());
+            refill();
+        }
+        wait_chn_.push(nullptr);
+        return -1;
+    });
+}
+
+TcpSocketPoolClient::~TcpSocketPoolClient() {
+    exit_chn_.push(nullptr);
+    (void)collector_;
+    wait_chn_.pop();
+    pools_.clear();
+    if (client_ownership_) {
+        delete client_;
+    }
+}
+
+int64_t TcpSocketPoolClient::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool TcpSocketPoolClient::reserve() {
+    if (option_.max_total <= 0) {
+        total_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    int total = total_.load(std::memory_order_relaxed);
+    do {
+        if (total >= option_.max_total) {
+            return false;
+        }
+    } while (!total_.compare_exchange_weak(total, total + 1, std::memory_order_relaxed));
+    return true;
+}
+
+ISocketStream *TcpSocketPoolClient::connect(EndPoint remote) {
+    while (true) {
+        StreamListNode* node = nullptr;
+        mutex_.lock();
+        auto it = pools_.find(remote.key());
+        if (it != pools_.end()) {
+            it->second.used_ms = now_ms();
+        }
+        if (it != pools_.end() && !it->second.idle.empty()) {
+            // most recently released first
+            node = it->second.idle.pop_back();
+            it->second.idle_count--;
+        }
+        mutex_.unlock();
+        if (!node) {
+            break;
+        }
+        // probed outside the lock, the node is ours now.
+        // readable while idle means the peer closed it or sent garbage
+        auto fd = node->stream->get_fd();
+        if (fd >= 0 && wait_fd_read_timeout(fd, 0) == 1) {
+            delete node;
+            unreserve();
+            continue;
+        }
+        auto ret = new PooledTCPSocketStream(node->stream.release(), this, remote);
+        delete node;
+        return ret;
+    }
+
+    if (!reserve()) {
+        LOG(ERROR) << "socket pool is full, max_total " << option_.max_total;
+        return nullptr;
+    }
+    auto stream = client_->connect(remote);
+    if (!stream) {
+        unreserve();
+        return nullptr;
+    }
+    return new PooledTCPSocketStream(stream, this, remote);
+}
+
+void TcpSocketPoolClient::release(const EndPoint &ep, ISocketStream *stream, bool drop) {
+    auto fd = stream->get_fd();
+    if (drop || (fd >= 0 && wait_fd_read_timeout(fd, 0) == 1)) {
+        delete stream;
+        unreserve();
+        return;
+    }
+    mutex_.lock();
+    auto& pool = pools_[ep.key()];
+    pool.endpoint = ep;
+    if (pool.used_ms == 0) {
+        pool.used_ms = now_ms();
+    }
+    if (pool.idle_count >= option_.max_idle_per_endpoint) {
+        mutex_.unlock();
+        delete stream;
+        unreserve();
+        return;
     }
+    auto node = new StreamListNode(ep, stream);
+    node->idle_since_ms = now_ms();
+    pool.idle.push_back(node);
+    pool.idle_count++;
+    mutex_.unlock();
 }
 
-}
\ No newline at end of file
+int TcpSocketPoolClient::warmup(const EndPoint &ep, int n) {
+    n = std::min(n, option_.max_idle_per_endpoint);
+    std::vector<ISocketStream*> streams;
+    for (int i = (int)idle_count(ep); i < n; i++) {
+        if (!reserve()) {
+            break;
+        }
+        auto stream = client_->connect(ep);
+        if (!stream) {
+            unreserve();
+            break;
+        }
+        streams.push_back(stream);
+    }
+    for (auto stream : streams) {
+        release(ep, stream, false);
+    }
+    return (int)idle_count(ep);
+}
+
+void TcpSocketPoolClient::evict(int64_t now_ms) {
+    std::vector<StreamListNode*> expired;
+    mutex_.lock();
+    for (auto it = pools_.begin(); it != pools_.end();) {
+        auto& pool = it->second;
+        // an endpoint nobody connects to any more keeps no idle streams
+        bool unused = option_.endpoint_timeout_ms > 0 &&
+                      pool.used_ms + option_.endpoint_timeout_ms <= now_ms;
+        int keep = unused ? 0 : option_.min_idle_per_endpoint;
+        // the front is the coldest stream of the endpoint
+        while (pool.idle_count > keep && !pool.idle.empty() &&
+               (unused || (option_.idle_timeout_ms > 0 &&
+                           pool.idle.front()->idle_since_ms + option_.idle_timeout_ms <= now_ms))) {
+            expired.push_back(pool.idle.pop_front());
+            pool.idle_count--;
+        }
+        // used endpoints below min_idle_per_endpoint stay for refill
+        if (pool.idle.empty() && (unused || option_.min_idle_per_endpoint <= 0)) {
+            it = pools_.erase(it);
+        } else {
+            it++;
+        }
+    }
+    mutex_.unlock();
+
+    for (auto node : expired) {
+        delete node;
+        unreserve();
+    }
+}
+
+void TcpSocketPoolClient::refill() {
+    if (option_.min_idle_per_endpoint <= 0) {
+        return;
+    }
+    std::vector<EndPoint> endpoints;
+    auto now = now_ms();
+    mutex_.lock();
+    for (auto& pair : pools_) {
+        // dialing an endpoint nobody uses would keep it alive forever
+        bool unused = option_.endpoint_timeout_ms > 0 &&
+                      pair.second.used_ms + option_.endpoint_timeout_ms <= now;
+        if (!unused && pair.second.idle_count < option_.min_idle_per_endpoint) {
+            endpoints.push_back(pair.second.endpoint);
+        }
+    }
+    mutex_.unlock();
+
+    // connects outside the lock, warmup hands the streams over with release
+    for (auto& ep : endpoints) {
+        warmup(ep, option_.min_idle_per_endpoint);
+    }
+}
+
+size_t TcpSocketPoolClient::idle_count() {
+    mutex_.lock();
+    defer(mutex_.unlock());
+    size_t n = 0;
+    for (auto& pair : pools_) {
+        n += pair.second.idle_count;
+    }
+    return n;
+}
+
+size_t TcpSocketPoolClient::idle_count(const EndPoint &ep) {
+    mutex_.lock();
+    defer(mutex_.unlock());
+    auto it = pools_.find(ep.key());
+    return it == pools_.end() ? 0 : it->second.idle_count;
+}
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include "common.h"
 #include "socket_stream.h"
+#include <algorithm>
+#include <atomic>
 
 namespace arch_net {
 
@@ -84,6 +86,7 @@ public:
     }
 
     int close() override {
+        drop = true;
         return underlay->close();
     }
 
@@ -97,58 +100,42 @@ public:
 struct StreamListNode : public intrusive_list_node<StreamListNode> {
     EndPoint key;
     std::unique_ptr<ISocketStream> stream;
+    // steady clock ms the stream went back to the pool
+    int64_t idle_since_ms{0};
 
     StreamListNode() {}
     StreamListNode(const EndPoint& key, ISocketStream* stream)
         : key(key), stream(stream){}
 };
 
+struct SocketPoolOption {
+    // idle streams kept per endpoint, extra released streams are closed
+    int max_idle_per_endpoint{16};
+    // idle eviction never closes the last min_idle_per_endpoint streams of an endpoint,
+    // and the collector reconnects endpoints that dropped below it
+    int min_idle_per_endpoint{0};
+    // endpoints nobody connected to for this long (e.g. the resolver dropped them) lose
+    // min_idle_per_endpoint, their idle streams are closed and they leave the pool.
+    // 0 keeps them forever
+    int endpoint_timeout_ms{10 * 60 * 1000};
+    // streams owned by the pool (idle + in use), connect fails beyond it, 0 for no limit
+    int max_total{0};
+    // idle streams older than this are closed, 0 to keep them until they fail
+    int idle_timeout_ms{60 * 1000};
+    // streams ApplicationClient opens to every endpoint on init
+    int warmup_per_endpoint{0};
+};
 
+// TcpSocketPoolClient reuses tcp streams per endpoint.
+// Idle streams of an endpoint form a LIFO list, connect takes the most recently used one
+// (warm cwnd and cache) and the collector evicts from the cold end, so the list is
+// already ordered by idle time and eviction only touches the streams it closes.
 class TcpSocketPoolClient : public ISocketClient {
 public:
-    TcpSocketPoolClient(ISocketClient* client, bool client_ownership)
-        : client_(client), client_ownership_(client_ownership), exit_chn_(){
-
-        collector_ = create_fiber([&]()->int {
-            std::vector<int> fds, readable_fds;
-            while (true) {
-                fds.clear();
-                readable_fds.clear();
-
-                bool found = false;
-                exit_chn_.pop(10000, &found);
-                if (found) break;
-                mutex_.lock();
-                for(auto & pair : fd2ep_map_) {
-                    fds.emplace_back(pair.first);
-                }
-                mutex_.unlock();
-                if (wait_fds_readable(fds, readable_fds, 0) <= 0) {
-                    continue;
-                }
-                mutex_.lock();
-                for (auto& fd : readable_fds) {
-                    drop_from_pool(fd);
-                }
-                mutex_.unlock();
-            }
-            wait_chn_.push(nullptr);
-            return -1;
-        });
-    }
+    TcpSocketPoolClient(ISocketClient* client, bool client_ownership,
+                        const SocketPoolOption& option = SocketPoolOption());
 
-    ~TcpSocketPoolClient() {
-        exit_chn_.push(nullptr);
-        (void)collector_;
-        wait_chn_.pop();
-        while (!stream_list_.empty()) {
-            auto node = stream_list_.pop_front();
-            delete node;
-        }
-        if (client_ownership_) {
-            delete client_;
-        }
-    }
+    ~TcpSocketPoolClient();
 
     ISocketStream *connect(const std::string &remote, int port) override {
         EndPoint ep;
@@ -156,87 +143,67 @@ public:
         return connect(ep);
     }
 
+    ISocketClient* set_socket_options(const SocketOptions& opts) override {
+        client_->set_socket_options(opts);
+        return this;
+    }
+
     ISocketStream *connect(const std::string &path) override {
         throw "not implementation";
     }
 
-    ISocketStream * connect(EndPoint remote) override {
-        mutex_.lock();
-        while (true) {
-            auto it = ep2stream_map_.find(remote);
-            if (it == ep2stream_map_.end()) {
-                mutex_.unlock();
-
-                auto stream = client_->connect(remote);
-                if (stream) {
-                    return new PooledTCPSocketStream(stream, this, remote);
-                }
-                return nullptr;
-            } else {
-                auto fd = it->second->stream->get_fd();
-                if (fd >= 0) {
-                    fd2ep_map_.erase(fd);
-                }
-                auto node = it->second;
-                ep2stream_map_.erase(it);
-                stream_list_.erase(node);
-                if (fd >= 0 && wait_fd_read_timeout(fd, 0) == 1) {
-                    delete node;
-                    continue;
-                }
-                auto ret = new PooledTCPSocketStream(dynamic_cast<TcpSocketStream*>(node->stream.release()), this, remote);
-                delete node;
-                mutex_.unlock();
-                return ret;
-            }
-        }
-    }
+    ISocketStream * connect(EndPoint remote) override;
 
-    bool release(const EndPoint& ep, ISocketStream* stream) {
-        mutex_.lock();
-        defer(mutex_.unlock());
-        auto fd = stream->get_fd();
-        if (fd >= 0) {
-            if (wait_fd_read_timeout(fd, 0) == 1) {
-                return false;
-            }
-            fd2ep_map_.emplace(fd, ep);
-        }
-        // stream back to pool
-        auto node = new StreamListNode(ep, stream);
-        ep2stream_map_.emplace(ep, node);
-        stream_list_.push_back(node);
-        return true;
-    }
+    // release takes stream back, it is closed if drop is set, it went bad
+    // or the endpoint already keeps max_idle_per_endpoint idle streams
+    void release(const EndPoint& ep, ISocketStream* stream, bool drop);
+
+    // warmup opens up to n idle streams to ep, returns how many the pool holds for it
+    int warmup(const EndPoint& ep, int n);
+
+    // evict closes idle streams released before now_ms - idle_timeout_ms, and every idle
+    // stream of the endpoints not connected to since now_ms - endpoint_timeout_ms
+    void evict(int64_t now_ms);
+
+    // refill opens streams to the endpoints connected to within endpoint_timeout_ms that
+    // have fewer than min_idle_per_endpoint idle ones
+    void refill();
 
-    void drop_from_pool(int fd) {
-        // find fdep & fdmap and remove
-        auto it = fd2ep_map_.find(fd);
-        if (it != fd2ep_map_.end()) {
-            auto ep = it->second;
-            for (auto map_it = ep2stream_map_.find(ep); map_it != ep2stream_map_.end() && map_it->first == ep; map_it++) {
-                if (map_it->second->stream->get_fd() == fd) {
-                    auto node = map_it->second;
-                    ep2stream_map_.erase(map_it);
-                    stream_list_.erase(node);
-                    delete node;
-                    break;
-                }
+    size_t idle_count();
+    size_t idle_count(const EndPoint& ep);
+    size_t total_count() { return total_.load(std::memory_order_relaxed); }
+
+    static int64_t now_ms();
+
+private:
+    struct EndPointPool {
+        EndPoint endpoint;
+        intrusive_list<StreamListNode> idle;
+        int idle_count{0};
+        // steady clock ms of the last connect, refill doesn't count
+        int64_t used_ms{0};
+
+        ~EndPointPool() {
+            while (!idle.empty()) {
+                delete idle.pop_front();
             }
-            fd2ep_map_.erase(it);
         }
-    }
+    };
+
+    // reserve counts a new stream against max_total
+    bool reserve();
+    void unreserve() { total_.fetch_sub(1, std::memory_order_relaxed); }
 
 private:
     ISocketClient* client_;
     bool client_ownership_;
+    SocketPoolOption option_;
     ACL_FIBER* collector_;
     acl::fiber_mutex mutex_;
     acl::fiber_tbox<bool> exit_chn_;
     acl::fiber_tbox<bool> wait_chn_;
-    std::unordered_multimap<EndPoint, StreamListNode*> ep2stream_map_;
-    std::unordered_map<int, EndPoint> fd2ep_map_;
-    intrusive_list<StreamListNode> stream_list_;
+    std::unordered_map<EndPointKey, EndPointPool> pools_;
+    std::atomic<int> total_{0};
 };
 
 }
\ No newline at end of file
@@ -63,7 +63,52 @@ ssize_t TcpSocketStream::send(const struct iovec *iov, int iovcnt, int flags) {
 }
 
 ssize_t TcpSocketStream::sendfile(int in_fd, off_t offset, size_t count) {
-    return 0;
+    return arch_net::sendfile(fd_, in_fd, &offset, count);
+}
+
+ssize_t sendfile_by_copy(ISocketStream* stream, int in_fd, off_t offset, size_t count) {
+    static const size_t kChunkSize = 64 * 1024;
+    std::unique_ptr<char[]> chunk(new char[std::min(count, kChunkSize)]);
+    size_t sent = 0;
+    while (sent < count) {
+        auto want = std::min(count - sent, kChunkSize);
+        auto n = ::pread(in_fd, chunk.get(), want, offset + sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG(ERROR) << "sendfile read error " << strerror(errno);
+            return ERR;
+        }
+        if (n == 0) {
+            break;
+        }
+        size_t written = 0;
+        while (written < (size_t)n) {
+            auto w = stream->send(chunk.get() + written, n - written);
+            if (w <= 0) {
+                return w < 0 ? w : ERR;
+            }
+            written += w;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t writev_by_send(ISocketStream* stream, const struct iovec* iov, int iovcnt) {
+    ssize_t sent = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        auto p = static_cast<const char*>(iov[i].iov_base);
+        size_t written = 0;
+        while (written < iov[i].iov_len) {
+            auto n = stream->send(p + written, iov[i].iov_len - written);
+            if (n <= 0) {
+                return sent > 0 ? sent : n;
+            }
+            written += n;
+            sent += n;
+        }
+    }
+    return sent;
 }
 
 
@@ -103,6 +148,8 @@ ISocketStream *TcpSocketClient::connect(EndPoint remote) {
         return nullptr;
     }
 
+    apply_socket_options(stream_scope->get_fd(), opts_);
+    apply_connect_socket_options(stream_scope->get_fd(), opts_);
     auto ret = arch_net::connect(stream_scope->get_fd(), remote.sock_addr);
     if (ret < 0) {
         LOG(ERROR) << "Failed to connect socket";
@@ -113,8 +160,19 @@ ISocketStream *TcpSocketClient::connect(EndPoint remote) {
 
 // TcpSocketServer impl
 int TcpSocketServer::init(const std::string &addr, uint16_t port) {
+    listen_addr_ = addr;
+    listen_port_ = port;
     listen_fd_ = arch_net::socket();
-    return arch_net::listen(listen_fd_, addr.c_str(), port);
+    int ret = arch_net::listen(listen_fd_, addr.c_str(), port);
+    if (ret >= 0 && port == 0) {
+        // the kernel picked the port, shard listeners and the tcp options need it
+        struct sockaddr_storage local;
+        socklen_t len = sizeof(local);
+        if (getsockname(listen_fd_, (struct sockaddr*)&local, &len) == 0) {
+            listen_port_ = ntohs(((struct sockaddr_in*)&local)->sin_port);
+        }
+    }
+    return ret;
 }
 
 int TcpSocketServer::init(const std::string &path) {
@@ -122,8 +180,17 @@ int TcpSocketServer::init(const std::string &path) {
     return arch_net::listen(listen_fd_, path);
 }
 
-ISocketStream *TcpSocketServer::accept() {
-    int cfd = arch_net::accept(listen_fd_);
+int TcpSocketServer::accept_fd(int listen_fd) {
+    int cfd = arch_net::accept(listen_fd);
+    // unix domain servers have no tcp options
+    if (cfd >= 0 && listen_port_ != 0) {
+        apply_socket_options(cfd, opts_);
+    }
+    return cfd;
+}
+
+ISocketStream *TcpSocketServer::accept(int listen_fd) {
+    int cfd = accept_fd(listen_fd);
     if (cfd < 0) {
         return nullptr;
     }
@@ -135,9 +202,20 @@ ISocketServer *TcpSocketServer::set_handler(ISocketServer::Handler&& handler) {
     return this;
 }
 
-int TcpSocketServer::accept_loop() {
+int TcpSocketServer::accept_loop(int listen_fd) {
     while (true) {
-        auto sess = accept();
+        auto sess = accept(listen_fd);
+        // registered before the stopping check, a shutdown that began later waits for it
+        if (sess != nullptr) {
+            conns_.add(sess);
+        }
+        if (is_stopping()) {
+            if (sess != nullptr) {
+                conns_.remove(sess);
+                delete sess;
+            }
+            break;
+        }
         if (sess == nullptr) {
             LOG(ERROR) << "accept new connection error";
             acl_fiber_delay(1);
@@ -145,21 +223,63 @@ int TcpSocketServer::accept_loop() {
         }
         // create new fiber
         go[this, sess] {
-            arch_net::TcpSocketServer::handler(this->handler_, sess);
+            this->handler(sess);
         };
     }
     return 0;
 }
 
+std::vector<int> TcpSocketServer::open_shard_listeners(int io_thread_num) {
+    std::lock_guard<acl::fiber_mutex> guard(listen_mutex_);
+    listen_fds_.assign(1, listen_fd_);
+    // unix sockets have no SO_REUSEPORT groups, a shutdown already woke up listen_fd_
+    if (accept_mode_ == AcceptMode::SharedListener || listen_port_ == 0 || is_stopping()) {
+        return listen_fds_;
+    }
+    int shards = io_thread_num;
+    if (accept_mode_ == AcceptMode::ReusePortCPU) {
+        // the program picks a listener by cpu, listeners past the cpu count would get nothing
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus > 0 && cpus < shards) {
+            shards = (int)cpus;
+        }
+    }
+    for (int i = 1; i < shards; i++) {
+        int fd = arch_net::socket();
+        if (arch_net::listen(fd, listen_addr_.c_str(), listen_port_) < 0) {
+            LOG(ERROR) << "open reuseport listener error, io threads share the listeners";
+            ::close(fd);
+            break;
+        }
+        listen_fds_.push_back(fd);
+    }
+    if (accept_mode_ == AcceptMode::ReusePortCPU && listen_fds_.size() == (size_t)shards) {
+        // the program belongs to the group, attaching it to one fd is enough
+        attach_reuseport_cpu_bpf(listen_fd_, shards);
+    }
+    return listen_fds_;
+}
+
 int TcpSocketServer::start(int io_thread_num) {
+    auto listen_fds = open_shard_listeners(io_thread_num);
+    if (listen_port_ != 0) {
+        for (auto fd : listen_fds) {
+            apply_listen_socket_options(fd, opts_);
+        }
+    }
 
     for (int i = 0; i < io_thread_num; i++) {
+        // io thread i is pinned to cpu i % ncpu, the listener the program picks for that cpu
+        int listen_fd = listen_fds[i % listen_fds.size()];
         auto thread = std::make_unique<std::thread>(
-            [this](){
-                go[this] {
-                    this->accept_loop();
+            [this, i, listen_fd](){
+                if (accept_mode_ == AcceptMode::ReusePortCPU) {
+                    bind_thread_to_cpu(i);
+                }
+                go[this, listen_fd] {
+                    this->accept_loop(listen_fd);
                 };
-                acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
+                schedule_with_engine(io_engine_);
                 wg_.done();
             });
         threads_.emplace_back(std::move(thread));
@@ -172,9 +292,85 @@ int TcpSocketServer::start(int io_thread_num) {
 }
 
 void TcpSocketServer::stop() {
+    shutdown(kDefaultDrainTimeout);
+}
+
+int TcpSocketServer::shutdown(int drain_timeout_ms) {
+    if (stopping_.exchange(true)) {
+        return 0;
+    }
+    // wakes up the accept fibers of every io thread, start opens no listeners after this
+    std::vector<int> listen_fds;
+    {
+        std::lock_guard<acl::fiber_mutex> guard(listen_mutex_);
+        if (listen_fds_.empty()) {
+            listen_fds_.assign(1, listen_fd_);
+        }
+        listen_fds = listen_fds_;
+    }
+    for (auto fd : listen_fds) {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    int forced = 0;
+    if (!conns_.wait_drained(drain_timeout_ms)) {
+        // the handlers see EOF/EPIPE and unwind by themselves
+        forced = conns_.for_each([](ISocketStream* stream) {
+            ::shutdown(stream->get_fd(), SHUT_RDWR);
+        });
+        LOG(ERROR) << "server stop, force close " << forced << " connections";
+        conns_.wait_drained(kForceCloseWait);
+    }
+    for (auto fd : listen_fds) {
+        ::close(fd);
+    }
+    return forced;
+}
+
+void ConnectionTracker::add(ISocketStream *stream) {
+    mutex_.lock();
+    streams_.insert(stream);
+    mutex_.unlock();
+}
 
+void ConnectionTracker::remove(ISocketStream *stream) {
+    mutex_.lock();
+    streams_.erase(stream);
+    mutex_.unlock();
+    if (draining_.load(std::memory_order_acquire)) {
+        removed_.push(nullptr);
+    }
 }
 
+bool ConnectionTracker::wait_drained(int timeout_ms) {
+    draining_.store(true, std::memory_order_release);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (size() > 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            return false;
+        }
+        bool found;
+        removed_.pop((int)left, &found);
+    }
+    return true;
+}
+
+int ConnectionTracker::for_each(const std::function<void(ISocketStream*)>& fn) {
+    mutex_.lock();
+    defer(mutex_.unlock());
+    for (auto stream : streams_) {
+        fn(stream);
+    }
+    return (int)streams_.size();
+}
+
+size_t ConnectionTracker::size() {
+    mutex_.lock();
+    defer(mutex_.unlock());
+    return streams_.size();
+}
 
 
 extern "C" ISocketClient* new_tcp_socket_client() {
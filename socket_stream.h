@@ -6,6 +6,71 @@ namespace arch_net {
 
 class Buffer;
 
+// EndPointKey is the identity of an inet endpoint: family, port and address bytes
+// (plus the scope of link local ipv6), fixed size so it hashes and compares without
+// allocating. Bytes the family doesn't use stay zero.
+struct EndPointKey {
+    uint16_t family{AF_UNSPEC};
+    uint16_t port{0};            // network order
+    uint32_t scope_id{0};
+    uint8_t addr[16]{};
+
+    static EndPointKey from(const sockaddr_storage& ss) {
+        EndPointKey key;
+        key.family = ss.ss_family;
+        if (ss.ss_family == AF_INET) {
+            auto in = sockaddr_in_cast(&ss);
+            key.port = in->sin_port;
+            memcpy(key.addr, &in->sin_addr, sizeof(in->sin_addr));
+        } else if (ss.ss_family == AF_INET6) {
+            auto in6 = sockaddr_in6_cast(&ss);
+            key.port = in6->sin6_port;
+            key.scope_id = in6->sin6_scope_id;
+            memcpy(key.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        }
+        return key;
+    }
+
+    size_t hash() const {
+        uint64_t lo, hi;
+        memcpy(&lo, addr, sizeof(lo));
+        memcpy(&hi, addr + 8, sizeof(hi));
+        uint64_t meta = ((uint64_t)family << 48) | ((uint64_t)port << 32) | scope_id;
+        return mix(lo ^ mix(hi ^ mix(meta)));
+    }
+
+    friend inline bool operator==(const EndPointKey& k1, const EndPointKey& k2) {
+        return memcmp(&k1, &k2, sizeof(EndPointKey)) == 0;
+    }
+
+    friend inline bool operator<(const EndPointKey& k1, const EndPointKey& k2) {
+        if (k1.family != k2.family) {
+            return k1.family < k2.family;
+        }
+        int c = memcmp(k1.addr, k2.addr, sizeof(k1.addr));
+        if (c != 0) {
+            return c < 0;
+        }
+        if (k1.port != k2.port) {
+            return ntohs(k1.port) < ntohs(k2.port);
+        }
+        return k1.scope_id < k2.scope_id;
+    }
+
+private:
+    // murmur3 fmix64
+    static uint64_t mix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+};
+
+static_assert(sizeof(EndPointKey) == 24, "EndPointKey must not have padding");
+
 struct EndPoint {
     std::string host;
     int port;
@@ -18,14 +83,18 @@ struct EndPoint {
     bool from(const std::string& _host, int _port);
 
     sockaddr* to_sockaddr() {return sockaddr_cast(&sock_addr);}
+
+    // key is computed from sock_addr, which users may fill directly
+    EndPointKey key() const { return EndPointKey::from(sock_addr); }
+
     friend inline bool operator==(const EndPoint& s1, const EndPoint& s2) {
-        return memcmp(&s1.sock_addr, &s2.sock_addr, sizeof(struct sockaddr_storage));
+        return s1.key() == s2.key();
+    }
+    friend inline bool operator!=(const EndPoint& s1, const EndPoint& s2) {
+        return !(s1 == s2);
     }
     friend inline bool operator<(const EndPoint& s1, const EndPoint& s2) {
-        if (!s1.host.empty() && !s2.host.empty()) {
-            return s1.host == s2.host ? s1.port < s2.port : s1.host < s2.host;
-        }
-        return ToIPPort(&s1.sock_addr) < ToIPPort(&s2.sock_addr);
+        return s1.key() < s2.key();
     }
 };
 
@@ -49,6 +118,14 @@ public:
     virtual ~ISocketStream(){}
 };
 
+// sendfile_by_copy is the sendfile fallback for streams that can not hand the
+// fd to the kernel (TLS, mux...): pread chunks of in_fd and send them through stream.
+ssize_t sendfile_by_copy(ISocketStream* stream, int in_fd, off_t offset, size_t count);
+
+// writev_by_send is the send(iovec) fallback for streams without a native writev:
+// every iovec is sent in order through send(buf), returns the bytes sent.
+ssize_t writev_by_send(ISocketStream* stream, const struct iovec* iov, int iovcnt);
+
 class ISocketClient {
 public:
     // Connect to a remote IPv4 endpoint.
@@ -58,9 +135,23 @@ public:
     // Connect to a Unix Domain Socket.
     virtual ISocketStream* connect(const std::string& path) = 0;
 
+    // applied to every tcp connection made afterwards, wrapping clients forward it
+    virtual ISocketClient* set_socket_options(const SocketOptions& opts) { return this; }
+
     virtual ~ISocketClient(){};
 };
 
+// AcceptMode decides how io threads share the listening port
+enum class AcceptMode {
+    // every io thread accepts on the same listen fd
+    SharedListener,
+    // every io thread owns a SO_REUSEPORT listen fd, the kernel hashes connections across them
+    ReusePort,
+    // ReusePort plus a BPF program handing a connection to the fd of the cpu that received it,
+    // io thread i is pinned to cpu i
+    ReusePortCPU,
+};
+
 class ISocketServer  {
 public:
     virtual int init(const std::string& addr, uint16_t port) = 0;
@@ -72,11 +163,52 @@ public:
     virtual int start(int io_thread_num = 1) = 0;
     virtual void stop() = 0;
 
+    static const int kDefaultDrainTimeout = 10 * 1000;
+    // how long shutdown waits for force closed connections to unwind
+    static const int kForceCloseWait = 1000;
+
+    // shutdown stops accepting, waits up to drain_timeout_ms for the live connections
+    // to finish and then force closes the rest, returns how many were force closed.
+    // It may be called from any thread, start() returns once the io threads are done.
+    virtual int shutdown(int drain_timeout_ms) { stop(); return 0; }
+
+    // must be set before start, servers that don't own io threads ignore it
+    virtual ISocketServer* set_io_engine(IOEngine engine) { return this; }
+
+    // must be set before start, servers that don't own io threads ignore it
+    virtual ISocketServer* set_accept_mode(AcceptMode mode) { return this; }
+
+    // must be set before start, applied to the listeners and every accepted tcp connection
+    virtual ISocketServer* set_socket_options(const SocketOptions& opts) { return this; }
+
     virtual int get_listen_fd() { return -1; }
 
     virtual ~ISocketServer(){};
 };
 
+// ConnectionTracker keeps the connections a server is serving so shutdown can drain them
+class ConnectionTracker {
+public:
+    void add(ISocketStream* stream);
+
+    void remove(ISocketStream* stream);
+
+    // wait_drained returns false if connections are still alive after timeout_ms,
+    // removals are only signaled once somebody started waiting
+    bool wait_drained(int timeout_ms);
+
+    // for_each calls fn on every live connection, returns how many there were
+    int for_each(const std::function<void(ISocketStream*)>& fn);
+
+    size_t size();
+
+private:
+    acl::fiber_mutex mutex_;
+    std::unordered_set<ISocketStream*> streams_;
+    std::atomic<bool> draining_{false};
+    acl::fiber_tbox<bool> removed_{false};
+};
+
 class TcpSocketStream : public ISocketStream {
 public:
     explicit TcpSocketStream(int fd) : fd_(fd) {}
@@ -136,7 +268,15 @@ public:
 
     ISocketStream * connect(EndPoint remote) override;
 
+    ISocketClient* set_socket_options(const SocketOptions& opts) override {
+        opts_ = opts;
+        return this;
+    }
+
     virtual TcpSocketStream* create_stream(SocketType type);
+
+private:
+    SocketOptions opts_;
 };
 
 
@@ -146,7 +286,9 @@ public:
 
     int init(const std::string &path) override;
 
-    virtual ISocketStream *accept() override;
+    ISocketStream *accept() override { return accept(listen_fd_); }
+
+    virtual ISocketStream *accept(int listen_fd);
 
     ISocketServer *set_handler(Handler&& handler) override;
 
@@ -154,9 +296,26 @@ public:
 
     void stop() override;
 
+    int shutdown(int drain_timeout_ms) override;
+
+    ISocketServer* set_io_engine(IOEngine engine) override {
+        io_engine_ = engine;
+        return this;
+    }
+
+    ISocketServer* set_accept_mode(AcceptMode mode) override {
+        accept_mode_ = mode;
+        return this;
+    }
+
+    ISocketServer* set_socket_options(const SocketOptions& opts) override {
+        opts_ = opts;
+        return this;
+    }
+
     int get_listen_fd() override { return listen_fd_; }
 
-    virtual int accept_loop();
+    virtual int accept_loop(int listen_fd);
 
 
 protected:
@@ -165,14 +324,43 @@ protected:
         return new TcpSocketStream(fd);
     }
 
-    static void handler(const Handler& m_handler, ISocketStream* sess) {
-        m_handler(sess);
+    // accept_loop registered sess in conns_
+    void handler(ISocketStream* sess) {
+        if (handshake(sess) == OK) {
+            handler_(sess);
+        }
+        conns_.remove(sess);
         delete sess;
     }
 
+    // handshake runs in the fiber of the connection before the handler, so a slow peer
+    // doesn't hold up the accept loop. A stream it fails never reaches the handler
+    virtual int handshake(ISocketStream* sess) { return OK; }
+
+    bool is_stopping() { return stopping_.load(std::memory_order_acquire); }
+
+    // accept_fd accepts a connection on listen_fd and applies the socket options
+    int accept_fd(int listen_fd);
+
+private:
+    // open_shard_listeners fills listen_fds_ with one listen fd per io thread when sharding,
+    // at most one per cpu in ReusePortCPU mode, and returns a copy of them
+    std::vector<int> open_shard_listeners(int io_thread_num);
+
 private:
     int listen_fd_;
+    std::string listen_addr_;
+    uint16_t listen_port_{0};
+    // per io thread listeners, listen_fds_[0] is listen_fd_. start and shutdown may run on
+    // different threads
+    acl::fiber_mutex listen_mutex_;
+    std::vector<int> listen_fds_;
     Handler handler_;
+    IOEngine io_engine_{IOEngine::Epoll};
+    AcceptMode accept_mode_{AcceptMode::SharedListener};
+    SocketOptions opts_;
+    std::atomic<bool> stopping_{false};
+    ConnectionTracker conns_;
 
     std::vector<std::unique_ptr<std::thread>> threads_;
     acl::wait_group wg_;
@@ -187,10 +375,17 @@ extern "C" ISocketServer* new_tcp_socket_server();
 
 // for EndPoint
 namespace std {
+template <>
+struct hash<arch_net::EndPointKey> {
+    std::size_t operator()(const arch_net::EndPointKey& key) const {
+        return key.hash();
+    }
+};
+
 template <>
 struct hash<arch_net::EndPoint> {
     std::size_t operator()(const arch_net::EndPoint& end_point) const {
-        return std::hash<std::string>()(std::string((const char*)&(end_point.sock_addr), sizeof(struct sockaddr_storage)));
+        return end_point.key().hash();
     }
 };
 
@@ -1,7 +1,15 @@
 #include "ssl_socket_stream.h"
 
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include <typeinfo>
+
 namespace arch_net { namespace ssl {
 
+static const unsigned char kSessionIdContext[] = "arch_net";
+
 int TLSContext::init(const std::string &ca_pem,
                      const std::string &cert_pem,
                      const std::string &key_pem) {
@@ -11,28 +19,266 @@ int TLSContext::init(const std::string &ca_pem,
             if (ctx_ == nullptr) {
                 return ERR;
             }
+            setup_sessions();
             return OK;
         case EncryptType::SERVER:
             ctx_ = get_server_context(ca_pem.c_str(), cert_pem.c_str(), key_pem.c_str());
             if (ctx_ == nullptr) {
                 return ERR;
             }
+            setup_sessions();
             return OK;
     }
     return ERR;
 }
 
+TLSContext::~TLSContext() {
+    for (auto& it : sessions_) {
+        SSL_SESSION_free(it.second);
+    }
+    if (ctx_) {
+        SSL_CTX_free(ctx_);
+    }
+    OPENSSL_cleanse(ticket_keys_.data(), ticket_keys_.size() * sizeof(TicketKey));
+}
+
+bool TLSContext::enable_ktls(bool on) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (on) {
+        SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+    } else {
+        SSL_CTX_clear_options(ctx_, SSL_OP_ENABLE_KTLS);
+    }
+    ktls_ = on;
+    return true;
+#else
+    if (on) {
+        LOG(ERROR) << "openssl is built without ktls";
+    }
+    return false;
+#endif
+}
+
+int64_t HandshakeHistogram::percentile(double p) const {
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)(total * p + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return (int64_t)1 << i;
+        }
+    }
+    return (int64_t)1 << (kBuckets - 1);
+}
+
+void TLSContext::set_handshake_offload(CPUWorkerPool* pool, int max_concurrent) {
+    offload_pool_ = pool;
+    offload_limit_ = std::max(1, max_concurrent);
+}
+
+void TLSContext::acquire_offload_slot() {
+    offload_mutex_.lock();
+    while (offload_running_ >= offload_limit_) {
+        offload_cond_.wait(offload_mutex_);
+    }
+    offload_running_++;
+    if (offload_running_ > offload_peak_.load(std::memory_order_relaxed)) {
+        offload_peak_.store(offload_running_, std::memory_order_relaxed);
+    }
+    offload_mutex_.unlock();
+}
+
+void TLSContext::release_offload_slot() {
+    offload_mutex_.lock();
+    offload_running_--;
+    offload_mutex_.unlock();
+    offload_cond_.notify();
+}
+
+void TLSContext::setup_sessions() {
+    SSL_CTX_set_app_data(ctx_, this);
+
+    if (type_ == EncryptType::CLIENT) {
+        if (!option_.client_session_store) {
+            SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options(ctx_, SSL_OP_NO_TICKET);
+            return;
+        }
+        // sessions are kept per endpoint by the context, not in the openssl client cache
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx_, &TLSContext::new_session_cb);
+        return;
+    }
+
+    if (option_.session_cache) {
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx_, option_.session_cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx_, option_.session_timeout_s);
+    // the server verifies its peers, resumption is refused without a session id context
+    SSL_CTX_set_session_id_context(ctx_, kSessionIdContext, sizeof(kSessionIdContext) - 1);
+
+    if (!option_.tickets) {
+        SSL_CTX_set_options(ctx_, SSL_OP_NO_TICKET);
+        return;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_, &TLSContext::ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx_, &TLSContext::ticket_key_cb);
+#endif
+}
+
+bool TLSContext::find_ticket_key(const unsigned char* name, TicketKey& key, bool& current) {
+    std::lock_guard<acl::fiber_mutex> guard(mutex_);
+    if (name) {
+        for (size_t i = 0; i < ticket_keys_.size(); i++) {
+            if (memcmp(ticket_keys_[i].name, name, sizeof(key.name)) == 0) {
+                key = ticket_keys_[i];
+                current = i == 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int64_t now = time(nullptr);
+    if (ticket_keys_.empty() || now - ticket_keys_[0].created_s >= option_.ticket_key_rotation_s) {
+        TicketKey fresh;
+        if (RAND_bytes(fresh.name, sizeof(fresh.name)) != 1 ||
+            RAND_priv_bytes(fresh.aes_key, sizeof(fresh.aes_key)) != 1 ||
+            RAND_priv_bytes(fresh.hmac_key, sizeof(fresh.hmac_key)) != 1) {
+            LOG(ERROR) << "generate ticket key failed";
+            if (ticket_keys_.empty()) {
+                return false;
+            }
+        } else {
+            fresh.created_s = now;
+            ticket_keys_.insert(ticket_keys_.begin(), fresh);
+            if (ticket_keys_.size() > 2) {
+                OPENSSL_cleanse(&ticket_keys_.back(), sizeof(TicketKey));
+                ticket_keys_.pop_back();
+            }
+        }
+    }
+    key = ticket_keys_[0];
+    current = true;
+    return true;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TLSContext::ticket_key_cb(SSL* ssl, unsigned char* name, unsigned char* iv,
+                              EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* hmac, int enc) {
+#else
+int TLSContext::ticket_key_cb(SSL* ssl, unsigned char* name, unsigned char* iv,
+                              EVP_CIPHER_CTX* cipher, HMAC_CTX* hmac, int enc) {
+#endif
+    auto self = static_cast<TLSContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    TicketKey key;
+    bool current = false;
+    if (!self->find_ticket_key(enc ? nullptr : name, key, current)) {
+        // encrypting: no ticket is issued, decrypting: full handshake
+        return enc ? -1 : 0;
+    }
+    defer(OPENSSL_cleanse(&key, sizeof(key)));
+
+    if (enc) {
+        memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+            return -1;
+        }
+    } else if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+        return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    if (EVP_MAC_init(hmac, key.hmac_key, sizeof(key.hmac_key), params) != 1) {
+        return -1;
+    }
+#else
+    if (HMAC_Init_ex(hmac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), nullptr) != 1) {
+        return -1;
+    }
+#endif
+    if (enc) {
+        return 1;
+    }
+    // tls 1.3 clients use a ticket once, so every resumption hands out a fresh one.
+    // A ticket of the previous key is accepted once more and replaced as well
+    return current && SSL_version(ssl) < TLS1_3_VERSION ? 1 : 2;
+}
+
+int TLSContext::new_session_cb(SSL* ssl, SSL_SESSION* session) {
+    auto stream = static_cast<TLSSocketStream*>(SSL_get_ex_data(ssl, TLSSocketStream::stream_index()));
+    if (!stream || !stream->has_session_key_) {
+        return 0;
+    }
+    stream->ctx_->store_session(stream->session_key_, session);
+    return 1;
+}
+
+SSL_SESSION* TLSContext::take_session(const EndPointKey& key) {
+    std::lock_guard<acl::fiber_mutex> guard(mutex_);
+    auto it = sessions_.find(key);
+    if (it == sessions_.end()) {
+        return nullptr;
+    }
+    if (!SSL_SESSION_is_resumable(it->second)) {
+        SSL_SESSION_free(it->second);
+        sessions_.erase(it);
+        return nullptr;
+    }
+    auto session = it->second;
+    if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+        // tls 1.3 tickets are single use, the handshake stores the next one
+        sessions_.erase(it);
+        return session;
+    }
+    SSL_SESSION_up_ref(session);
+    return session;
+}
+
+void TLSContext::store_session(const EndPointKey& key, SSL_SESSION* session) {
+    std::lock_guard<acl::fiber_mutex> guard(mutex_);
+    auto& slot = sessions_[key];
+    if (slot) {
+        SSL_SESSION_free(slot);
+    }
+    slot = session;
+}
+
 
 TLSSocketStream::TLSSocketStream(TLSContext *ctx, ISocketStream *stream, bool ownership)
-    : inner_stream_(stream), m_ownership_(ownership) {
+    : ctx_(ctx), inner_stream_(stream), m_ownership_(ownership) {
 
     ssl = SSL_new(ctx->ssl_ctx());
     SSL_set_fd(ssl, stream->get_fd());
+    SSL_set_ex_data(ssl, stream_index(), this);
 
-    ssbio = BIO_new(BIO_s_sock_stream());
+    // ktls is only set up on the socket bio SSL_set_fd made, keep it for plain tcp streams.
+    // Other streams with an fd (udp, mux, subclasses overriding io) have to see every byte
+    bool socket_bio = ctx->ktls() && stream->get_fd() >= 0 && typeid(*stream) == typeid(TcpSocketStream);
+    if (!socket_bio) {
+        ssbio = BIO_new(BIO_s_sock_stream());
 
-    BIO_ctrl(ssbio, BIO_C_SET_FILE_PTR, 0, stream);
-    SSL_set_bio(ssl, ssbio, ssbio);
+        BIO_ctrl(ssbio, BIO_C_SET_FILE_PTR, 0, this);
+        SSL_set_bio(ssl, ssbio, ssbio);
+
+        // read whatever the socket has instead of a record header and then its body,
+        // ktls would refuse the records already read ahead so it is left off there
+        SSL_set_read_ahead(ssl, 1);
+    }
 
     switch (ctx->encrypt_type()) {
         case EncryptType::CLIENT:
@@ -56,7 +302,7 @@ TLSSocketStream::~TLSSocketStream() {
 
 int TLSSocketStream::client_handshake() {
     /* Perform SSL handshake with the server */
-    if (SSL_do_handshake(ssl) != 1) {
+    if (handshake() != 1) {
         LOG(ERROR) << "SSL Handshake failed";
         return ERR;
     }
@@ -72,13 +318,211 @@ int TLSSocketStream::client_handshake() {
 int TLSSocketStream::server_handshake() {
     /* Now perform handshake */
     int rc;
-    if ((rc = SSL_accept(ssl)) != 1) {
+    if ((rc = handshake()) != 1) {
         LOG(ERROR) << "Could not perform SSL handshake, with return value: " << rc;
         return ERR;
     }
     return OK;
 }
 
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int TLSSocketStream::handshake() {
+    auto start = now_us();
+    int rc;
+    // without the stream bio openssl reads the socket itself, the worker must not block on it
+    if (ctx_->offload_pool_ && ssbio) {
+        rc = offload_handshake(ctx_->offload_pool_);
+    } else {
+        rc = SSL_do_handshake(ssl);
+    }
+    ctx_->handshake_latency_.add(now_us() - start);
+    return rc;
+}
+
+int TLSSocketStream::offload_handshake(CPUWorkerPool* pool) {
+    auto start = now_us();
+    ctx_->acquire_offload_slot();
+    defer(ctx_->release_offload_slot());
+    ctx_->handshake_wait_.add(now_us() - start);
+
+    if (!handshake_) {
+        handshake_.reset(new HandshakeBuffers());
+    }
+    offloading_ = true;
+    defer(offloading_ = false);
+
+    while (true) {
+        int rc = -1;
+        int err = SSL_ERROR_NONE;
+        acl::wait_group wg;
+        wg.add(1);
+        pool->addTask([&]() {
+            // a handshake failed earlier on this worker may have left errors behind,
+            // SSL_get_error would report them instead of WANT_READ
+            ERR_clear_error();
+            rc = SSL_do_handshake(ssl);
+            if (rc != 1) {
+                // the error queue belongs to the worker thread
+                err = SSL_get_error(ssl, rc);
+            }
+            wg.done();
+        }, 0);
+        wg.wait();
+
+        auto& out = handshake_->out;
+        while (out.size() > 0) {
+            auto n = inner_stream_->send(out.data(), out.size());
+            if (n <= 0) {
+                return -1;
+            }
+            out.Retrieve(n);
+        }
+        if (rc == 1 || err != SSL_ERROR_WANT_READ) {
+            return rc;
+        }
+
+        handshake_->in.EnsureWritableBytes(kMaxRecord);
+        if (handshake_->in.ReadFromSocketStream(inner_stream_) <= 0) {
+            return -1;
+        }
+    }
+}
+
+int TLSSocketStream::bio_write(BIO* b, const char* buf, int cnt) {
+    BIO_clear_retry_flags(b);
+    if (offloading_) {
+        handshake_->out.Append(buf, cnt);
+        return cnt;
+    }
+    return inner_stream_->send(buf, cnt);
+}
+
+int TLSSocketStream::bio_read(BIO* b, char* buf, int cnt) {
+    BIO_clear_retry_flags(b);
+    // what an offloaded handshake read past its last record is handed out first
+    if (handshake_ && handshake_->in.size() > 0) {
+        int n = std::min<size_t>(cnt, handshake_->in.size());
+        memcpy(buf, handshake_->in.data(), n);
+        handshake_->in.Retrieve(n);
+        return n;
+    }
+    if (offloading_) {
+        // the io fiber reads the socket between the handshake steps
+        BIO_set_retry_read(b);
+        return -1;
+    }
+    return inner_stream_->recv(buf, cnt);
+}
+
+int TLSSocketStream::stream_index() {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+void TLSSocketStream::set_session_key(const EndPointKey& key) {
+    session_key_ = key;
+    has_session_key_ = true;
+
+    SSL_SESSION* session = ctx_->take_session(key);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+ssize_t TLSSocketStream::recv(const struct iovec *iov, int iovcnt, int flags) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        auto base = (char*)iov[i].iov_base;
+        size_t off = 0;
+        while (off < iov[i].iov_len) {
+            // only go on with what is decrypted already, the next record may not have arrived
+            if (total > 0 && SSL_pending(ssl) <= 0) {
+                return total;
+            }
+            int n = SSL_read(ssl, base + off, iov[i].iov_len - off);
+            if (n <= 0) {
+                return total > 0 ? total : n;
+            }
+            off += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+ssize_t TLSSocketStream::send(const struct iovec *iov, int iovcnt, int flags) {
+    if (ktls_send()) {
+        return inner_stream_->send(iov, iovcnt, flags);
+    }
+
+    ssize_t total = 0;
+    size_t pending = 0;
+    auto flush = [&]() -> bool {
+        if (pending == 0) {
+            return true;
+        }
+        int n = SSL_write(ssl, record_buf_.get(), pending);
+        if (n <= 0) {
+            return false;
+        }
+        total += n;
+        pending = 0;
+        return true;
+    };
+
+    for (int i = 0; i < iovcnt; i++) {
+        auto base = (const char*)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        // a piece filling whole records is not copied, SSL_write cuts it itself
+        if (pending == 0 && len >= kMaxRecord) {
+            int n = SSL_write(ssl, base, len);
+            if (n <= 0) {
+                return total > 0 ? total : n;
+            }
+            total += n;
+            continue;
+        }
+        if (!record_buf_) {
+            record_buf_.reset(new char[kMaxRecord]);
+        }
+        while (len > 0) {
+            size_t copy = std::min(len, kMaxRecord - pending);
+            memcpy(record_buf_.get() + pending, base, copy);
+            pending += copy;
+            base += copy;
+            len -= copy;
+            if (pending == kMaxRecord && !flush()) {
+                return total > 0 ? total : ERR;
+            }
+        }
+    }
+    if (!flush()) {
+        return total > 0 ? total : ERR;
+    }
+    return total;
+}
+
+bool TLSSocketStream::ktls_send() {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+bool TLSSocketStream::ktls_recv() {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+
 BIO_METHOD *TLSSocketStream::BIO_s_sock_stream() {
     static std::unique_ptr<BIO_METHOD, BIOMethodDeleter> meth(
             BIO_meth_new(BIO_TYPE_SOURCE_SINK, "BIO_ARCH_NET_SOCK_STREAM"));
@@ -129,6 +573,7 @@ ISocketStream *TLSSocketClient::connect(EndPoint remote) {
 
     std::unique_ptr<ISocketStream> stream_scope(stream);
     auto tls_stream = dynamic_cast<TLSSocketStream*>(stream_scope.get());
+    tls_stream->set_session_key(remote.key());
 
     int ret = tls_stream->client_handshake();
     if (ret < 0) {
@@ -138,26 +583,17 @@ ISocketStream *TLSSocketClient::connect(EndPoint remote) {
     return stream_scope.release();
 }
 
-ISocketStream *TLSSocketServer::accept() {
-    int cfd = arch_net::accept(get_listen_fd());
+ISocketStream *TLSSocketServer::accept(int listen_fd) {
+    int cfd = accept_fd(listen_fd);
     if (cfd < 0) {
         return nullptr;
     }
 
-    auto stream = new_tls_stream(ctx, create_stream(cfd), true);
-    if (!stream) {
-        return nullptr;
-    }
-
-    std::unique_ptr<ISocketStream> stream_scope(stream);
-    auto tls_stream = dynamic_cast<TLSSocketStream*>(stream_scope.get());
-
-    int ret = tls_stream->server_handshake();
-    if (ret < 0) {
-        return nullptr;
-    }
+    return new_tls_stream(ctx, create_stream(cfd), true);
+}
 
-    return stream_scope.release();
+int TLSSocketServer::handshake(ISocketStream *sess) {
+    return dynamic_cast<TLSSocketStream*>(sess)->server_handshake();
 }
 
 
@@ -165,10 +601,11 @@ void OpenSSLGlobalInit() { (void)GlobalSSLContext::getInstance(); }
 
 TLSContext* new_server_tls_context(const std::string& ca_pem,
                                    const std::string& cert_pem,
-                                   const std::string& key_pem)
+                                   const std::string& key_pem,
+                                   const TLSSessionOption& option)
                                    {
     OpenSSLGlobalInit();
-    std::unique_ptr<TLSContext> ctx = std::make_unique<TLSContext>(EncryptType::SERVER);
+    std::unique_ptr<TLSContext> ctx = std::make_unique<TLSContext>(EncryptType::SERVER, option);
     if (ctx->init(ca_pem, cert_pem, key_pem) != OK)
         return nullptr;
     return ctx.release();
@@ -176,9 +613,10 @@ TLSContext* new_server_tls_context(const std::string& ca_pem,
 
 TLSContext* new_client_tls_context(const std::string& ca_pem,
                                    const std::string& cert_pem,
-                                   const std::string& key_pem) {
+                                   const std::string& key_pem,
+                                   const TLSSessionOption& option) {
     OpenSSLGlobalInit();
-    std::unique_ptr<TLSContext> ctx = std::make_unique<TLSContext>(EncryptType::CLIENT);
+    std::unique_ptr<TLSContext> ctx = std::make_unique<TLSContext>(EncryptType::CLIENT, option);
     if (ctx->init(ca_pem, cert_pem, key_pem) != OK) {
         return nullptr;
     }
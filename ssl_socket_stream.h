@@ -22,9 +22,49 @@ public:
     ~GlobalSSLContext() {}
 };
 
+// TLSSessionOption lets handshakes resume earlier sessions instead of paying
+// the certificate exchange and the key agreement again
+struct TLSSessionOption {
+    // servers cache sessions in the SSL_CTX, shared by every io thread using the context
+    bool session_cache = true;
+    int session_cache_size = 20 * 1024;
+    int session_timeout_s = 300;
+    // stateless resumption. Ticket keys are replaced every ticket_key_rotation_s,
+    // tickets of the previous key are still accepted and renewed
+    bool tickets = true;
+    int ticket_key_rotation_s = 3600;
+    // clients keep the latest session of every endpoint and offer it on the next connect
+    bool client_session_store = true;
+};
+
+// HandshakeHistogram counts handshake latencies in power of two microsecond buckets
+class HandshakeHistogram {
+public:
+    static const int kBuckets = 32;
+
+    void add(int64_t us) {
+        int bucket = us <= 0 ? 0 : std::min(kBuckets - 1, 64 - __builtin_clzll((uint64_t)us));
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    // percentile returns the upper bound in us of the bucket holding the p (0~1) sample
+    int64_t percentile(double p) const;
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets]{};
+    std::atomic<uint64_t> count_{0};
+};
+
 class TLSContext {
 public:
-    TLSContext(EncryptType type) :type_(type) {}
+    TLSContext(EncryptType type, const TLSSessionOption& option = TLSSessionOption())
+        : type_(type), option_(option) {}
+
+    ~TLSContext();
+
     int init(const std::string& ca_pem,
              const std::string& cert_pem,
              const std::string& key_pem);
@@ -33,19 +73,98 @@ public:
 
     EncryptType encrypt_type() { return type_; }
 
+    // take_session returns a reference to the session stored for key, nullptr if there is none
+    SSL_SESSION* take_session(const EndPointKey& key);
+
+    // store_session keeps session, owning the reference, as the one to resume for key
+    void store_session(const EndPointKey& key, SSL_SESSION* session);
+
+    // enable_ktls lets openssl hand the record encryption to the kernel after the handshake.
+    // Streams over a TcpSocketStream made afterwards drive its fd directly instead of the stream,
+    // each stream falls back to userspace when the kernel or the cipher does not support it.
+    // Returns false if openssl is built without ktls
+    bool enable_ktls(bool on = true);
+
+    bool ktls() { return ktls_; }
+
+    // set_handshake_offload runs the handshake crypto of streams made afterwards on pool,
+    // while their io fibers only move the handshake records. At most max_concurrent
+    // handshakes are on the pool at once, the others wait for a slot in their fibers.
+    // ktls streams do their own socket io and keep handshaking inline.
+    // On a client context new_session_cb, and with it store_session, then run on the
+    // pool threads and take mutex_ there
+    void set_handshake_offload(CPUWorkerPool* pool, int max_concurrent);
+
+    // the most offloaded handshakes that were on the pool at once
+    int offload_peak() const { return offload_peak_.load(std::memory_order_relaxed); }
+
+    // time from the start of a handshake to its end, offloaded or not
+    const HandshakeHistogram& handshake_latency() const { return handshake_latency_; }
+
+    // time offloaded handshakes waited for a slot
+    const HandshakeHistogram& handshake_wait() const { return handshake_wait_; }
+
+private:
+    struct TicketKey {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+        int64_t created_s;
+    };
+
+    void setup_sessions();
+
+    // find_ticket_key returns the key to encrypt a new ticket with, rotating it when due,
+    // or with name the key a ticket was encrypted with. current tells whether it is the newest
+    bool find_ticket_key(const unsigned char* name, TicketKey& key, bool& current);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int ticket_key_cb(SSL* ssl, unsigned char* name, unsigned char* iv,
+                             EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* hmac, int enc);
+#else
+    static int ticket_key_cb(SSL* ssl, unsigned char* name, unsigned char* iv,
+                             EVP_CIPHER_CTX* cipher, HMAC_CTX* hmac, int enc);
+#endif
+
+    static int new_session_cb(SSL* ssl, SSL_SESSION* session);
+
+    friend class TLSSocketStream;
+
+    void acquire_offload_slot();
+    void release_offload_slot();
+
 private:
-    SSL_CTX* ctx_;
+    SSL_CTX* ctx_{nullptr};
     EncryptType type_;
+    TLSSessionOption option_;
+    bool ktls_{false};
+
+    acl::fiber_mutex mutex_;
+    // newest first, the current key and the one before it
+    std::vector<TicketKey> ticket_keys_;
+    std::unordered_map<EndPointKey, SSL_SESSION*> sessions_;
+
+    CPUWorkerPool* offload_pool_{nullptr};
+    int offload_limit_{0};
+    int offload_running_{0};
+    std::atomic<int> offload_peak_{0};
+    acl::fiber_mutex offload_mutex_;
+    acl::fiber_cond offload_cond_;
+
+    HandshakeHistogram handshake_latency_;
+    HandshakeHistogram handshake_wait_;
 };
 
 
 TLSContext* new_server_tls_context(const std::string& ca_pem,
                             const std::string& cert_pem,
-                            const std::string& key_pem);
+                            const std::string& key_pem,
+                            const TLSSessionOption& option = TLSSessionOption());
 
 TLSContext* new_client_tls_context(const std::string& ca_pem,
                                    const std::string& cert_pem,
-                                   const std::string& key_pem) ;
+                                   const std::string& key_pem,
+                                   const TLSSessionOption& option = TLSSessionOption());
 
 
 class TLSSocketStream : public ISocketStream {
@@ -58,6 +177,17 @@ public:
 
     int server_handshake();
 
+    // set_session_key offers the session stored for key on the client handshake
+    // and stores the sessions the server hands out after it
+    void set_session_key(const EndPointKey& key);
+
+    // session_reused tells whether the handshake resumed a session
+    bool session_reused() { return SSL_session_reused(ssl) == 1; }
+
+    // ktls_send / ktls_recv tell whether the kernel encrypts / decrypts the records
+    bool ktls_send();
+    bool ktls_recv();
+
     ssize_t recv(Buffer *buff) override {
         auto n = recv(buff->WriteBegin(), buff->WritableBytes(), 0);
         if (n > 0) {
@@ -67,7 +197,8 @@ public:
 
     ssize_t recv(void* buf, size_t cnt, int flags = 0) override { return SSL_read(ssl, buf, cnt);}
 
-    ssize_t recv(const struct iovec* iov, int iovcnt, int flags = 0) override { return recv(iov[0].iov_base, iov[0].iov_len); }
+    // recv scatters the decrypted bytes over the iovecs, it blocks for the first one only
+    ssize_t recv(const struct iovec* iov, int iovcnt, int flags = 0) override;
 
     ssize_t send(Buffer *buff) override {
         auto n = send(buff->data(), buff->size(), 0);
@@ -79,9 +210,18 @@ public:
 
     ssize_t send(const void* buf, size_t cnt, int flags = 0) override { return SSL_write(ssl, buf, cnt);}
 
-    ssize_t send(const struct iovec* iov, int iovcnt, int flags = 0) override { return send(iov[0].iov_base, iov[0].iov_len); }
+    // send gathers small iovecs into records of up to kMaxRecord bytes, so a header and
+    // its body go out as one record in one write. With ktls the kernel frames the
+    // plain writes into records, so writev and sendfile go straight to the socket
+    ssize_t send(const struct iovec* iov, int iovcnt, int flags = 0) override;
 
-    ssize_t sendfile(int fd, off_t offset, size_t size) override {return -2;} // Not support
+    // otherwise the file has to be copied through SSL_write
+    ssize_t sendfile(int fd, off_t offset, size_t size) override {
+        if (ktls_send()) {
+            return inner_stream_->sendfile(fd, offset, size);
+        }
+        return sendfile_by_copy(this, fd, offset, size);
+    }
 
     int get_fd() override { return inner_stream_->get_fd();}
 
@@ -94,11 +234,11 @@ private:
 
     static BIO_METHOD* BIO_s_sock_stream();
 
-    static ISocketStream* get_bio_sock_stream(BIO* b) { return (ISocketStream*)BIO_get_data(b);}
+    static TLSSocketStream* get_bio_sock_stream(BIO* b) { return (TLSSocketStream*)BIO_get_data(b);}
 
-    static int ssbio_bwrite(BIO* b, const char* buf, int cnt) { return get_bio_sock_stream(b)->send(buf, cnt);}
+    static int ssbio_bwrite(BIO* b, const char* buf, int cnt) { return get_bio_sock_stream(b)->bio_write(b, buf, cnt);}
 
-    static int ssbio_bread(BIO* b, char* buf, int cnt) { return get_bio_sock_stream(b)->recv(buf, cnt);}
+    static int ssbio_bread(BIO* b, char* buf, int cnt) { return get_bio_sock_stream(b)->bio_read(b, buf, cnt);}
 
     static int ssbio_bputs(BIO* bio, const char* str) { return ssbio_bwrite(bio, str, strlen(str));}
 
@@ -136,11 +276,39 @@ private:
 
     static int ssbio_destroy(BIO*) { return 1; }
 
+    friend class TLSContext;
+
+    // largest plaintext of a tls record
+    static const size_t kMaxRecord = 16 * 1024;
+
+    int bio_write(BIO* b, const char* buf, int cnt);
+    int bio_read(BIO* b, char* buf, int cnt);
+
+    // handshake runs SSL_do_handshake inline or on the offload pool of the context
+    int handshake();
+    int offload_handshake(CPUWorkerPool* pool);
+
+    // the records of an offloaded handshake, the bio of the worker only touches these
+    struct HandshakeBuffers {
+        Buffer in;
+        Buffer out;
+    };
+
+    // ex_data slot of the SSL pointing back at its stream
+    static int stream_index();
+
 private:
+    TLSContext* ctx_;
+    EndPointKey session_key_{};
+    bool has_session_key_{false};
     ISocketStream* inner_stream_;
     bool m_ownership_;
     SSL* ssl;
-    BIO* ssbio;
+    BIO* ssbio{nullptr};
+    // gathers the iovecs of one send into records
+    std::unique_ptr<char[]> record_buf_;
+    std::unique_ptr<HandshakeBuffers> handshake_;
+    bool offloading_{false};
 };
 
 
@@ -166,6 +334,10 @@ public:
 
     virtual ISocketStream* connect(const std::string& remote, int port) override;
 
+    ISocketClient* set_socket_options(const SocketOptions& opts) override {
+        inner_client_->set_socket_options(opts);
+        return this;
+    }
 };
 
 
@@ -174,9 +346,16 @@ public:
 
     TLSSocketServer(TLSContext* ctx): ctx(ctx) {}
 
-    ISocketStream *accept() override;
+    using TcpSocketServer::accept;
+
+    // accept wraps the connection, the server handshake runs in its own fiber
+    // by handshake(), or inside the first recv or send when accepted directly
+    ISocketStream *accept(int listen_fd) override;
 
-private:public:
+protected:
+    int handshake(ISocketStream* sess) override;
+
+public:
     TLSContext* ctx;
 };
 
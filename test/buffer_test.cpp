@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+#include <glog/logging.h>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "../buffer.h"
+#include "../io_buffer.h"
+#include "../buffer_pool.h"
+#include "../socket_stream.h"
+
+using namespace arch_net;
+
+static std::string make_content(size_t n) {
+    std::string s;
+    s.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        s.push_back('a' + i % 26);
+    }
+    return s;
+}
+
+TEST(TestIOBuffer, test_append_and_cut)
+{
+    auto content = make_content(100 * 1024);
+    IOBuffer buf;
+    // many small appends fill blocks in place
+    for (size_t i = 0; i < content.size(); i += 100) {
+        buf.Append(content.data() + i, 100);
+    }
+    ASSERT_EQ(buf.size(), content.size());
+    ASSERT_LT(buf.block_count(), content.size() / IOBlock::kDefaultSize + 2);
+    ASSERT_EQ(buf.ToString(), content);
+
+    IOBuffer head;
+    ASSERT_EQ(buf.Cut(&head, 10000), 10000u);
+    ASSERT_EQ(head.ToString(), content.substr(0, 10000));
+    ASSERT_EQ(buf.ToString(), content.substr(10000));
+
+    // boundary block is shared, appending to head must not clobber buf
+    head.Append("xyz", 3);
+    ASSERT_EQ(buf.ToString(), content.substr(10000));
+    ASSERT_EQ(head.ToString(), content.substr(0, 10000) + "xyz");
+
+    ASSERT_EQ(buf.Skip(buf.size() - 5), content.size() - 10005);
+    ASSERT_EQ(buf.ToString(), content.substr(content.size() - 5));
+    buf.Clear();
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(buf.block_count(), 0u);
+}
+
+TEST(TestIOBuffer, test_prepend_and_share)
+{
+    IOBuffer buf;
+    buf.Append(std::string("body"));
+    buf.PrependUInt32(4);
+    ASSERT_EQ(buf.size(), 8u);
+    // the first block reserves cheap prepend space
+    ASSERT_EQ(buf.block_count(), 1u);
+
+    uint32_t len = 0;
+    buf.CopyTo(&len, sizeof len);
+    ASSERT_EQ(ntohl(len), 4u);
+
+    IOBuffer shared = buf.Share();
+    ASSERT_EQ(shared.ToString(), buf.ToString());
+    // shared blocks can't be written in place anymore
+    shared.Prepend("#", 1);
+    ASSERT_EQ(shared.size(), 9u);
+    ASSERT_EQ(buf.size(), 8u);
+    ASSERT_EQ(shared.ToString().substr(1), buf.ToString());
+
+    IOBuffer all;
+    all.Append(buf);
+    all.Append(std::move(shared));
+    ASSERT_TRUE(shared.empty());
+    ASSERT_EQ(all.size(), 17u);
+}
+
+TEST(TestIOBuffer, test_user_data)
+{
+    static int released = 0;
+    std::string data = make_content(4096);
+    {
+        IOBuffer buf;
+        buf.AppendUserData(&data[0], data.size(), [](void*, void* arg) { (*(int*)arg)++; }, &released);
+        IOBuffer part;
+        buf.Cut(&part, 1000);
+        buf.Clear();
+        ASSERT_EQ(released, 0);
+        ASSERT_EQ(part.ToString(), data.substr(0, 1000));
+    }
+    ASSERT_EQ(released, 1);
+}
+
+TEST(TestIOBuffer, test_large_user_data)
+{
+    // address space only, the bytes are never touched
+    const size_t len = (size_t)5 << 30;
+    void* data = mmap(nullptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_NE(data, MAP_FAILED);
+    {
+        IOBuffer buf;
+        buf.AppendUserData(data, len, IOBlock::NoopDeleter);
+        ASSERT_EQ(buf.length(), len);
+        ASSERT_EQ(buf.block_ref(0).length, len);
+
+        IOBuffer part;
+        const size_t n = ((size_t)4 << 30) + 1;
+        ASSERT_EQ(buf.Cut(&part, n), n);
+        ASSERT_EQ(part.block_ref(0).length, n);
+        ASSERT_EQ(buf.block_ref(0).offset, n);
+        ASSERT_EQ(buf.length(), len - n);
+    }
+    munmap(data, len);
+}
+
+TEST(TestIOBuffer, test_writev)
+{
+    auto content = make_content(4 * 1024 * 1024);
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    IOBuffer out;
+    // mix copied blocks and referenced user data, more blocks than a single writev takes
+    for (size_t i = 0; i < content.size(); i += 4096) {
+        if ((i / 4096) % 2) {
+            out.AppendUserData(&content[i], 4096, IOBlock::NoopDeleter);
+        } else {
+            out.Append(content.data() + i, 4096);
+        }
+    }
+    ASSERT_GT(out.block_count(), 256u);
+
+    TcpSocketStream writer(sv[0]);
+    TcpSocketStream reader(sv[1]);
+    IOBuffer in;
+    std::thread t([&]() {
+        ASSERT_EQ(in.ReadNFromSocketStream(&reader, content.size()), (ssize_t)content.size());
+    });
+    ASSERT_EQ(out.WriteToSocketStream(&writer), (ssize_t)content.size());
+    ASSERT_TRUE(out.empty());
+    t.join();
+    ASSERT_EQ(in.ToString(), content);
+}
+
+TEST(TestBufferPool, test_size_class)
+{
+    auto& pool = GlobalBufferPool::getInstance();
+    auto small = pool.Get(20);
+    ASSERT_GE(small->WritableBytes(), 20u);
+    ASSERT_LT(small->capacity(), 4096u);
+
+    auto big = pool.Get(100 * 1024);
+    ASSERT_GE(big->WritableBytes(), 100u * 1024);
+
+    // a buffer grown to 4MB must not come back as a heartbeat buffer
+    small->EnsureWritableBytes(4 * 1024 * 1024);
+    auto before = pool.stats();
+    pool.Release(small);
+    pool.Release(big);
+    auto after = pool.stats();
+    ASSERT_EQ(after.drops, before.drops + 1);
+    ASSERT_GE(after.bytes_retained, before.bytes_retained + (int64_t)(100 * 1024));
+
+    auto reused = pool.Get(200 * 1024);
+    ASSERT_EQ(reused, big);
+    ASSERT_EQ(reused->size(), 0u);
+    ASSERT_EQ(pool.stats().hits, after.hits + 1);
+    pool.Release(reused);
+}
+
+TEST(TestBufferPool, test_cross_thread)
+{
+    auto& pool = GlobalBufferPool::getInstance();
+    pool.Trim();
+    const int n = 200;
+    std::vector<Buffer*> buffs;
+    for (int i = 0; i < n; i++) {
+        buffs.push_back(pool.Get(2000));
+    }
+    // released on another thread, the thread cache overflows into the depot
+    // and the cache itself is flushed when the thread exits
+    std::thread([&]() {
+        for (auto b : buffs) {
+            pool.Release(b);
+        }
+    }).join();
+
+    auto before = pool.stats();
+    std::vector<Buffer*> again;
+    for (int i = 0; i < n; i++) {
+        again.push_back(pool.Get(2000));
+    }
+    auto after = pool.stats();
+    ASSERT_EQ(after.hits - before.hits, (uint64_t)n);
+    ASSERT_EQ(after.misses, before.misses);
+    for (auto b : again) {
+        pool.Release(b);
+    }
+}
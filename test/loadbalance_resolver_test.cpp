@@ -1,6 +1,8 @@
 
 #include <gtest/gtest.h>
 #include "../load_balance.h"
+#include "../resolver.h"
+#include <mutex>
 
 TEST(Test_LB_RV, test_RandomLB)
 {
@@ -76,4 +78,499 @@ TEST(Test_LB_RV, test_Consistent_RandomLB)
     for (auto& c : count) {
         std::cout << c.first << " " << c.second << std::endl;
     }
-}
\ No newline at end of file
+}
+static std::vector<arch_net::ServerNode> make_servers(int n) {
+    std::vector<arch_net::ServerNode> servers;
+    for (int i = 0; i < n; i++) {
+        servers.emplace_back();
+        servers.back().endpoint.host = "127.0.0.1";
+        servers.back().endpoint.port = 8000 + i;
+        servers.back().tag = arch_net::string_printf("%d", i);
+    }
+    return servers;
+}
+
+static uint32_t key_seed(int i) {
+    auto key = arch_net::string_printf("test_key_%d", i);
+    uint32_t hash_val;
+    MurmurHash3_x86_32(key.c_str(), key.size(), 0, &hash_val);
+    return hash_val;
+}
+
+// MovedKeys are the shares of keys that change server when one server leaves the cluster,
+// of all the keys and of the keys whose server stays
+struct MovedKeys {
+    double all;
+    double from_alive;
+};
+
+static MovedKeys moved_keys(arch_net::LoadBalanceType type, int removed, int keys) {
+    auto servers = make_servers(10);
+    std::unique_ptr<arch_net::LoadBalance> lb(arch_net::new_load_balance(type));
+    lb->on_changed(servers);
+    std::vector<std::string> before;
+    for (int i = 0; i < keys; i++) {
+        before.push_back(lb->get_next(key_seed(i)).tag);
+    }
+    auto removed_tag = servers[removed].tag;
+    servers.erase(servers.begin() + removed);
+    lb->on_changed(servers);
+    int moved = 0, moved_from_alive = 0;
+    for (int i = 0; i < keys; i++) {
+        auto tag = lb->get_next(key_seed(i)).tag;
+        if (tag != before[i]) {
+            moved++;
+            moved_from_alive += before[i] != removed_tag;
+        }
+    }
+    return MovedKeys{(double)moved / keys, (double)moved_from_alive / keys};
+}
+
+TEST(Test_LB_RV, bench_consistent_balance)
+{
+    using arch_net::LoadBalanceType;
+    const int loops = 1000000;
+    const int keys = 100000;
+    std::vector<std::pair<const char*, LoadBalanceType>> types = {
+        {"ring", LoadBalanceType::ConsistentHash},
+        {"maglev", LoadBalanceType::Maglev},
+        {"jump", LoadBalanceType::JumpHash},
+    };
+    for (auto& type : types) {
+        std::unique_ptr<arch_net::LoadBalance> lb(arch_net::new_load_balance(type.second));
+        lb->on_changed(make_servers(10));
+        for (int threads : {1, 4}) {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&]() {
+                    uint32_t seed = 0;
+                    for (int i = 0; i < loops; i++) {
+                        seed = seed * 1664525 + 1013904223;
+                        ASSERT_FALSE(lb->get_next(seed).tag.empty());
+                    }
+                });
+            }
+            for (auto& w : workers) {
+                w.join();
+            }
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            std::cout << type.first << " " << threads << " threads: "
+                      << (int64_t)loops * threads * 1000000 / std::max<int64_t>(us, 1) << " lookups/s" << std::endl;
+        }
+
+        auto moved = moved_keys(type.second, 4, keys);
+        std::cout << type.first << " remove server 4 of 10, moved keys: " << moved.all * 100 << "%" << std::endl;
+        if (type.second == LoadBalanceType::JumpHash) {
+            continue;
+        }
+        ASSERT_LT(moved.all, 0.15);
+        if (type.second == LoadBalanceType::ConsistentHash) {
+            // a ring only moves the keys of the removed server
+            ASSERT_EQ(moved.from_alive, 0);
+        }
+    }
+}
+
+TEST(Test_LB_RV, test_jump_hash_removal)
+{
+    using arch_net::LoadBalanceType;
+    const int keys = 100000;
+    // the key order follows the ports here, the last server leaving moves only its own keys
+    auto last = moved_keys(LoadBalanceType::JumpHash, 9, keys);
+    ASSERT_EQ(last.from_alive, 0);
+    ASSERT_LT(last.all, 0.15);
+    // a middle one shifts the buckets after it: the keys of servers 5-9 move as well
+    auto middle = moved_keys(LoadBalanceType::JumpHash, 4, keys);
+    ASSERT_GT(middle.from_alive, 0.4);
+    ASSERT_GT(middle.all, 0.5);
+}
+
+TEST(Test_LB_RV, test_alias_table)
+{
+    auto servers = make_servers(4);
+    servers[0].weight = 400;
+    servers[1].weight = 200;
+    servers[2].weight = 100;
+    servers[3].weight = 0;
+    arch_net::WeightedRandomBalance lb;
+    lb.on_changed(servers);
+    std::unordered_map<std::string, int> count;
+    const int loops = 70000;
+    for (int i = 0; i < loops; i++) {
+        count[lb.get_next(0).tag]++;
+    }
+    ASSERT_NEAR(count["0"], loops * 4 / 7, loops / 50);
+    ASSERT_NEAR(count["1"], loops * 2 / 7, loops / 50);
+    ASSERT_NEAR(count["2"], loops * 1 / 7, loops / 50);
+    ASSERT_EQ(count["3"], 0);
+    // the same seed keeps the same server
+    ASSERT_EQ(lb.get_next(42).tag, lb.get_next(42).tag);
+}
+
+static std::vector<arch_net::ServerNode> make_addressed_servers(int n) {
+    auto servers = make_servers(n);
+    for (auto& server : servers) {
+        server.endpoint.from(server.endpoint.host, server.endpoint.port);
+    }
+    return servers;
+}
+
+TEST(Test_LB_RV, test_p2c_ewma)
+{
+    auto servers = make_addressed_servers(4);
+    std::unique_ptr<arch_net::LoadBalance> lb(arch_net::new_load_balance(arch_net::LoadBalanceType::P2CEWMA));
+    lb->on_changed(servers);
+    std::unordered_map<std::string, int> count;
+    const int loops = 10000;
+    for (int i = 0; i < loops; i++) {
+        auto node = lb->get_next(0);
+        count[node.tag]++;
+        lb->on_start(node.endpoint);
+        // server 0 is 50 times slower
+        lb->on_finish(node.endpoint, node.tag == "0" ? 50000 : 1000, false);
+    }
+    ASSERT_LT(count["0"], loops / 20);
+
+    // membership changes keep the latency history
+    servers.pop_back();
+    lb->on_changed(servers);
+    count.clear();
+    for (int i = 0; i < 1000; i++) {
+        count[lb->get_next(0).tag]++;
+    }
+    ASSERT_LT(count["0"], 50);
+}
+
+TEST(Test_LB_RV, test_least_outstanding)
+{
+    auto servers = make_addressed_servers(4);
+    std::unique_ptr<arch_net::LoadBalance> lb(arch_net::new_load_balance(arch_net::LoadBalanceType::LeastOutstanding));
+    lb->on_changed(servers);
+    std::unordered_map<std::string, int> count;
+    for (int i = 0; i < 4000; i++) {
+        auto node = lb->get_next(0);
+        count[node.tag]++;
+        lb->on_start(node.endpoint);
+        // server 0 never answers, its queue keeps growing
+        if (node.tag != "0") {
+            lb->on_finish(node.endpoint, 1000, false);
+        }
+    }
+    ASSERT_LT(count["0"], 20);
+}
+
+// StubDNSServer answers A queries on 127.0.0.1 with the configured addresses, AAAA with none.
+// With nxdomain set, or a name set that the query doesn't match, it answers NXDOMAIN
+class StubDNSServer {
+public:
+    StubDNSServer() {
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::bind(fd_, (struct sockaddr*)&addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(fd_, (struct sockaddr*)&addr, &len);
+        endpoint.from("127.0.0.1", ntohs(addr.sin_port));
+        thread_ = std::thread([this]() { serve(); });
+    }
+
+    ~StubDNSServer() {
+        stop_ = true;
+        thread_.join();
+        ::close(fd_);
+    }
+
+    void set_records(const std::vector<std::string>& addrs, uint32_t ttl) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        addrs_ = addrs;
+        ttl_ = ttl;
+    }
+
+    void set_name(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        name_ = name;
+    }
+
+    std::vector<std::string> names() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return names_;
+    }
+
+    std::atomic<bool> answer{true};
+    std::atomic<bool> nxdomain{false};
+    std::atomic<int> queries{0};
+    arch_net::EndPoint endpoint;
+
+private:
+    void serve() {
+        uint8_t buf[512];
+        while (!stop_) {
+            struct pollfd pfd{fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 20) <= 0) {
+                continue;
+            }
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            auto n = recvfrom(fd_, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+            if (n < 12) {
+                continue;
+            }
+            queries++;
+            if (!answer) {
+                continue;
+            }
+            // question ends after the name, qtype and qclass
+            size_t pos = 12;
+            std::string qname;
+            while (pos < (size_t)n && buf[pos] != 0) {
+                if (!qname.empty()) {
+                    qname += '.';
+                }
+                qname.append((char*)buf + pos + 1, std::min<size_t>(buf[pos], n - pos - 1));
+                pos += buf[pos] + 1;
+            }
+            pos += 5;
+            uint16_t qtype = (buf[pos - 4] << 8) | buf[pos - 3];
+            std::vector<std::string> addrs;
+            uint32_t ttl;
+            bool missing;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                addrs = addrs_;
+                ttl = ttl_;
+                names_.push_back(qname);
+                missing = nxdomain || (!name_.empty() && qname != name_);
+            }
+            if (qtype != 1 || missing) {
+                addrs.clear();
+            }
+            std::string out((char*)buf, pos);
+            out[2] = (char)0x81;
+            out[3] = (char)(missing ? 0x83 : 0x80);
+            out[6] = 0;
+            out[7] = (char)addrs.size();
+            for (auto& addr : addrs) {
+                uint8_t rr[16] = {0xc0, 0x0c, 0, 1, 0, 1,
+                                  (uint8_t)(ttl >> 24), (uint8_t)(ttl >> 16), (uint8_t)(ttl >> 8), (uint8_t)ttl,
+                                  0, 4};
+                inet_pton(AF_INET, addr.c_str(), rr + 12);
+                out.append((char*)rr, sizeof(rr));
+            }
+            sendto(fd_, out.data(), out.size(), 0, (struct sockaddr*)&from, fromlen);
+        }
+    }
+
+    int fd_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+    std::mutex mutex_;
+    std::vector<std::string> addrs_;
+    uint32_t ttl_{0};
+    std::string name_;
+    std::vector<std::string> names_;
+};
+
+class CountingBalance : public arch_net::LoadBalance {
+public:
+    arch_net::ServerNode get_next(uint32_t seed, const std::vector<arch_net::ServerNode>& servers = {}) override {
+        return servers.empty() ? arch_net::ServerNode{} : servers[0];
+    }
+    void on_changed(const std::vector<arch_net::ServerNode> &new_servers) override { changes++; }
+    std::atomic<int> changes{0};
+};
+
+static std::vector<std::string> resolved(arch_net::ResolverWithLB& resolver) {
+    std::vector<arch_net::ServerNode> servers;
+    resolver.get_servers(servers);
+    std::vector<std::string> out;
+    for (auto& server : servers) {
+        out.push_back(arch_net::ToIPPort(&server.endpoint.sock_addr));
+    }
+    return out;
+}
+
+template<class Pred>
+static bool wait_until(Pred&& pred, int timeout_ms = 3000) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+TEST(Test_LB_RV, test_dns_refresh)
+{
+    StubDNSServer dns;
+    dns.set_records({"10.0.0.2", "10.0.0.1"}, 0);
+
+    arch_net::DNSResolverOption option;
+    option.nameservers.push_back(dns.endpoint);
+    option.query_timeout_ms = 100;
+    option.min_refresh_ms = 50;
+    option.max_retry_ms = 100;
+    auto lb = new CountingBalance();
+    arch_net::DNSResolver resolver("service.test:8080", option, lb);
+
+    std::vector<std::string> expected = {"10.0.0.1:8080", "10.0.0.2:8080"};
+    ASSERT_EQ(resolved(resolver), expected);
+    ASSERT_EQ(lb->changes.load(), 1);
+
+    // the same answer again doesn't bother the load balance
+    auto refreshed = resolver.refresh_count();
+    ASSERT_TRUE(wait_until([&]() { return resolver.refresh_count() >= refreshed + 3; }));
+    ASSERT_EQ(lb->changes.load(), 1);
+
+    dns.set_records({"10.0.0.2", "10.0.0.3"}, 0);
+    expected = {"10.0.0.2:8080", "10.0.0.3:8080"};
+    ASSERT_TRUE(wait_until([&]() { return resolved(resolver) == expected; }));
+    ASSERT_EQ(lb->changes.load(), 2);
+
+    // nameserver gone: keep serving the stale servers
+    dns.answer = false;
+    refreshed = resolver.refresh_count();
+    ASSERT_TRUE(wait_until([&]() { return resolver.refresh_count() >= refreshed + 2; }));
+    ASSERT_EQ(resolved(resolver), expected);
+    ASSERT_EQ(resolver.get_next(0).endpoint, resolver.get_next(0).endpoint);
+    ASSERT_EQ(lb->changes.load(), 2);
+}
+
+TEST(Test_LB_RV, test_dns_nxdomain_fallback)
+{
+    StubDNSServer first, second;
+    first.nxdomain = true;
+    second.nxdomain = true;
+
+    arch_net::DNSResolverOption option;
+    option.nameservers = {first.endpoint, second.endpoint};
+    option.ndots = 1;
+    option.query_timeout_ms = 100;
+    auto lb = new CountingBalance();
+    // NXDOMAIN from every nameserver still leaves /etc/hosts
+    arch_net::DNSResolver resolver("localhost:8080", option, lb);
+
+    auto servers = resolved(resolver);
+    ASSERT_NE(std::find(servers.begin(), servers.end(), "127.0.0.1:8080"), servers.end());
+    // the first NXDOMAIN settles the name, no AAAA query and no second nameserver
+    ASSERT_EQ(first.queries.load(), 1);
+    ASSERT_EQ(second.queries.load(), 0);
+}
+
+TEST(Test_LB_RV, test_dns_search_list)
+{
+    StubDNSServer first, second;
+    first.answer = false;
+    second.set_records({"10.0.0.1"}, 30);
+    second.set_name("api.svc.cluster.local");
+
+    arch_net::DNSResolverOption option;
+    option.nameservers = {first.endpoint, second.endpoint};
+    option.search = {"ns.svc.cluster.local", "svc.cluster.local"};
+    option.ndots = 5;
+    option.query_timeout_ms = 100;
+    auto lb = new CountingBalance();
+    arch_net::DNSResolver resolver("api:8080", option, lb);
+
+    std::vector<std::string> expected = {"10.0.0.1:8080"};
+    ASSERT_EQ(resolved(resolver), expected);
+    // the silent nameserver is skipped, NXDOMAIN moves on to the next search name
+    ASSERT_EQ(first.queries.load(), 2);
+    ASSERT_EQ(second.names(), (std::vector<std::string>{"api.ns.svc.cluster.local", "api.svc.cluster.local",
+                                                        "api.svc.cluster.local"}));
+
+    std::vector<std::string> candidates;
+    arch_net::search_names("api", option.search, 5, candidates);
+    ASSERT_EQ(candidates, (std::vector<std::string>{"api.ns.svc.cluster.local", "api.svc.cluster.local", "api"}));
+    arch_net::search_names("a.b.c.d.e", option.search, 2, candidates);
+    ASSERT_EQ(candidates[0], "a.b.c.d.e");
+    arch_net::search_names("api.", option.search, 5, candidates);
+    ASSERT_EQ(candidates, std::vector<std::string>{"api"});
+}
+
+static int picks_of(arch_net::ResolverWithLB& resolver, const arch_net::EndPoint& endpoint, int loops) {
+    int n = 0;
+    for (int i = 0; i < loops; i++) {
+        n += resolver.get_next(key_seed(i)).endpoint == endpoint;
+    }
+    return n;
+}
+
+TEST(Test_LB_RV, test_outlier_ejection)
+{
+    arch_net::FixedListResolver resolver({{"127.0.0.1", 9001}, {"127.0.0.1", 9002},
+                                          {"127.0.0.1", 9003}, {"127.0.0.1", 9004}});
+    resolver.with_load_balance(arch_net::new_load_balance(arch_net::LoadBalanceType::ConsistentHash));
+    arch_net::OutlierDetectionOption option;
+    option.consecutive_failures = 3;
+    option.base_ejection_ms = 200;
+    resolver.with_outlier_detection(option);
+
+    std::vector<arch_net::ServerNode> servers;
+    resolver.get_servers(servers);
+    auto bad = servers[0].endpoint;
+    ASSERT_GT(picks_of(resolver, bad, 1000), 0);
+
+    // a success in between resets the count
+    resolver.on_finish(bad, 0, true);
+    resolver.on_finish(bad, 0, true);
+    resolver.on_finish(bad, 1000, false);
+    resolver.on_finish(bad, 0, true);
+    resolver.on_finish(bad, 0, true);
+    ASSERT_EQ(resolver.ejected_count(), 0u);
+    resolver.on_finish(bad, 0, true);
+    ASSERT_EQ(resolver.ejected_count(), 1u);
+    ASSERT_EQ(picks_of(resolver, bad, 1000), 0);
+
+    // at most half of the servers are ejected
+    for (int i = 0; i < 3; i++) {
+        resolver.on_finish(servers[1].endpoint, 0, true);
+        resolver.on_finish(servers[2].endpoint, 0, true);
+    }
+    ASSERT_EQ(resolver.ejected_count(), 2u);
+    for (int i = 0; i < 3; i++) {
+        resolver.on_finish(servers[1].endpoint, 1000, false);
+    }
+
+    // readmitted after base_ejection_ms, the next ejection lasts twice as long
+    ASSERT_TRUE(wait_until([&]() { return resolver.ejected_count() == 0; }));
+    ASSERT_GT(picks_of(resolver, bad, 1000), 0);
+    for (int i = 0; i < 3; i++) {
+        resolver.on_finish(bad, 0, true);
+    }
+    ASSERT_EQ(resolver.ejected_count(), 1u);
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(wait_until([&]() { return resolver.ejected_count() == 0; }));
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(350));
+}
+
+TEST(Test_LB_RV, test_outlier_probe)
+{
+    arch_net::FixedListResolver resolver({{"127.0.0.1", 9001}, {"127.0.0.1", 9002}, {"127.0.0.1", 9003}});
+    std::atomic<bool> down{true};
+    arch_net::EndPoint bad;
+    bad.from("127.0.0.1", 9002);
+    arch_net::OutlierDetectionOption option;
+    option.consecutive_failures = 2;
+    option.base_ejection_ms = 40;
+    option.max_ejection_ms = 200;
+    option.probe_interval_ms = 10;
+    option.probe = [&](const arch_net::EndPoint& endpoint) {
+        return !(down && endpoint == bad);
+    };
+    resolver.with_outlier_detection(option);
+
+    // probes eject an endpoint that gets no traffic and keep it out while they fail
+    ASSERT_TRUE(wait_until([&]() { return resolver.ejected_count() == 1; }));
+    ASSERT_EQ(picks_of(resolver, bad, 1000), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_EQ(resolver.ejected_count(), 1u);
+
+    down = false;
+    ASSERT_TRUE(wait_until([&]() { return resolver.ejected_count() == 0; }));
+    ASSERT_GT(picks_of(resolver, bad, 1000), 0);
+}
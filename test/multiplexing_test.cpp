@@ -3,6 +3,7 @@
 #include "../mux_session.h"
 #include "../common.h"
 #include "../http/websocket.h"
+#include "../io_buffer.h"
 
 using namespace arch_net;
 
@@ -29,59 +30,569 @@ static int test_handler(arch_net::ISocketStream* stream) {
 
 TEST(Test_mux, Test_session)
 {
+    auto tcp_server = new_tcp_socket_server();
+    mux::MultiplexingSocketServer mux_server(tcp_server, true);
+    ASSERT_GE(mux_server.init("127.0.0.1", 18888), 0);
+    mux_server.set_handler(test_handler);
+    std::thread serve([&]() {
+        mux_server.start(1);
+    });
 
-    IOWorkerPool server_pool(1);
-
+    acl::fiber_tbox<bool> done;
     IOWorkerPool client_pool(1);
-    server_pool.addTask([&]() {
-       auto tcp_server = new_tcp_socket_server();
-       auto mux_server = mux::MultiplexingSocketServer(tcp_server, true);
-
-       mux_server.init("127.0.0.1", 18888);
-       mux_server.set_handler(test_handler);
-       mux_server.start(1);
-
+    client_pool.addTask([&]() {
+        auto client = new_tcp_socket_client();
+        auto mux_client = std::make_unique<mux::MultiplexingSocketClient>(client, true);
+        auto stream = mux_client->connect("127.0.0.1", 18888);
+        EXPECT_NE(stream, nullptr);
+        for (int i = 0; stream && i < 3; i++) {
+            Buffer buffer;
+            buffer.Append("1234567890");
+            EXPECT_EQ(stream->send(&buffer), 10);
+            EXPECT_EQ(stream->recv(&buffer), 10);
+            EXPECT_EQ(buffer.ToString(), "1234567890");
+        }
+        delete stream;
+        mux_client.reset();
+        LOG(INFO) << "client exit";
+        done.push(nullptr);
     });
 
-//    acl::fiber_tbox<int> p1;
-//    p1.pop();
+    done.pop();
+    mux_server.shutdown(1000);
+    serve.join();
+}
 
-    client_pool.addTask([&]() {
+// run_fiber runs fn in a fiber and schedules until the fibers it started are done,
+// sessions and streams wait on fiber primitives and need a scheduler under them
+static void run_fiber(const std::function<void()>& fn) {
+    go[&]() {
+        fn();
+    };
+    acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
+}
+
+// SessionPair connects a client and a server session over a socketpair, the test deletes them
+struct SessionPair {
+    template <typename Stream = TcpSocketStream>
+    static SessionPair open(const mux::FlowControlOption& flow = mux::FlowControlOption()) {
+        SessionPair pair;
+        int sv[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        pair.server = new mux::MultiplexingSession(new Stream(sv[0]), true, mux::MuxStreamType::Server, flow);
+        pair.client = new mux::MultiplexingSession(new Stream(sv[1]), true, mux::MuxStreamType::Client, flow);
+        return pair;
+    }
 
-        acl_fiber_sleep(2);
+    mux::MultiplexingSession* server{nullptr};
+    mux::MultiplexingSession* client{nullptr};
+};
 
-        auto client = new_tcp_socket_client();
+TEST(Test_mux, bench_small_streams)
+{
+    run_fiber([&]() {
+        const int streams = 1000;
+        const int frames = 50;
+        const size_t frame_size = 32;
+        auto sessions = SessionPair::open();
+        auto server = sessions.server;
+        auto client = sessions.client;
 
-        {
-            auto mux_client = std::make_unique<mux::MultiplexingSocketClient>(client, true);
-
-            {
-                auto stream = mux_client->connect("127.0.0.1", 18888);
-                Buffer buffer;
-                buffer.Append("1234567890");
-                while (1) {
-                    auto n = stream->send(&buffer);
-                    LOG(INFO) << "client send: " << n;
-                    if (n < 0) {
-                        break;
+        std::atomic<size_t> received{0};
+        acl::wait_group readers;
+        readers.add(streams);
+        go[&]() {
+            for (int i = 0; i < streams; i++) {
+                auto stream = server->accept_stream();
+                if (!stream) {
+                    break;
+                }
+                go[&, stream]() {
+                    char buf[1024];
+                    size_t n = 0;
+                    while (n < frames * frame_size) {
+                        auto r = stream->recv(buf, sizeof buf);
+                        if (r <= 0) {
+                            break;
+                        }
+                        n += r;
                     }
+                    received += n;
+                    readers.done();
+                };
+            }
+        };
+
+        std::vector<ISocketStream*> opened;
+        for (int i = 0; i < streams; i++) {
+            opened.push_back(client->open_stream());
+            ASSERT_NE(opened.back(), nullptr);
+        }
 
-                    n = stream->recv(&buffer);
-                    if (n <= 0) {
+        // every stream keeps one small frame in flight, the send loop coalesces them
+        auto start = std::chrono::steady_clock::now();
+        acl::wait_group writers;
+        writers.add(streams);
+        for (auto stream : opened) {
+            go[&, stream]() {
+                char payload[frame_size];
+                memset(payload, 'x', sizeof payload);
+                for (int i = 0; i < frames; i++) {
+                    if (stream->send(payload, sizeof payload) != (ssize_t)sizeof payload) {
                         break;
                     }
-                    LOG(INFO) << "client recv: " << n << " " << buffer.ToString();
-                    acl_fiber_sleep(1);
                 }
+                writers.done();
+            };
+        }
+        writers.wait();
+        readers.wait();
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        ASSERT_EQ(received.load(), streams * frames * frame_size);
+        std::cout << streams << " streams, " << frame_size << " byte frames: "
+                  << (int64_t)streams * frames * 1000000 / std::max<int64_t>(us, 1) << " frames/s" << std::endl;
+
+        for (auto stream : opened) {
+            delete stream;
+        }
+        delete client;
+        delete server;
+    });
+}
+
+TEST(Test_mux, test_zero_copy_recv)
+{
+    run_fiber([&]() {
+        auto sessions = SessionPair::open();
+        auto server = sessions.server;
+        auto client = sessions.client;
+
+        auto stream = client->open_stream();
+        ASSERT_NE(stream, nullptr);
+        auto accepted = dynamic_cast<mux::MultiplexingStream*>(server->accept_stream());
+        ASSERT_NE(accepted, nullptr);
+
+        std::string big(64 * 1024, 'b');
+        for (size_t i = 0; i < big.size(); i++) {
+            big[i] = 'a' + i % 26;
+        }
+        ASSERT_EQ(stream->send(big.data(), big.size()), (ssize_t)big.size());
+        for (int i = 0; i < 10; i++) {
+            auto small = string_printf("small-%d;", i);
+            ASSERT_EQ(stream->send(small.data(), small.size()), (ssize_t)small.size());
+        }
+
+        std::string expected = big;
+        for (int i = 0; i < 10; i++) {
+            expected += string_printf("small-%d;", i);
+        }
+        IOBuffer received;
+        while (received.size() < expected.size()) {
+            ASSERT_GT(accepted->recv(&received), 0);
+        }
+        ASSERT_EQ(received.ToString(), expected);
+        // the big frame stays in one block, the small ones share the session read block
+        ASSERT_LE(received.block_count(), 3u);
+
+        // plain recv copies out of the same buffer
+        ASSERT_EQ(stream->send("tail", 4), 4);
+        char buf[16];
+        ASSERT_EQ(accepted->recv(buf, 2, 0), 2);
+        ASSERT_EQ(accepted->recv(buf + 2, sizeof buf - 2, 0), 2);
+        ASSERT_EQ(std::string(buf, 4), "tail");
+
+        delete stream;
+        delete accepted;
+        delete client;
+        delete server;
+    });
+}
+
+// SlowStream holds every write back a little, so pings see a rtt like a real link has
+class SlowStream : public TcpSocketStream {
+public:
+    using TcpSocketStream::TcpSocketStream;
+    ssize_t send(const struct iovec *iov, int iovcnt, int flags) override {
+        acl_fiber_delay(2);
+        return TcpSocketStream::send(iov, iovcnt, flags);
+    }
+};
+
+// transfer pushes size bytes through one stream and returns the receive window it ended with
+static uint32_t transfer(const mux::FlowControlOption& flow, size_t size) {
+    auto sessions = SessionPair::open<SlowStream>(flow);
+    auto server = sessions.server;
+    auto client = sessions.client;
+    // let the first pings measure the rtt
+    while (server->rtt_us() == 0 || client->rtt_us() == 0) {
+        acl_fiber_delay(1);
+    }
+
+    auto stream = client->open_stream();
+    auto accepted = dynamic_cast<mux::MultiplexingStream*>(server->accept_stream());
+    EXPECT_NE(accepted, nullptr);
+
+    std::string chunk(64 * 1024, 0);
+    for (size_t i = 0; i < chunk.size(); i++) {
+        chunk[i] = 'a' + i % 26;
+    }
+    acl::wait_group writer;
+    writer.add(1);
+    go[&]() {
+        for (size_t sent = 0; sent < size; sent += chunk.size()) {
+            EXPECT_EQ(stream->send(chunk.data(), chunk.size()), (ssize_t)chunk.size());
+        }
+        writer.done();
+    };
+    IOBuffer received;
+    size_t total = 0;
+    while (total < size) {
+        auto n = accepted->recv(&received);
+        EXPECT_GT(n, 0);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+        // the payload is the chunk over and over
+        if (received.size() >= chunk.size()) {
+            EXPECT_EQ(received.ToString().substr(0, chunk.size()), chunk);
+            received.Skip(chunk.size());
+        }
+    }
+    writer.wait();
+    EXPECT_EQ(total, size);
+    auto window = accepted->window_size();
+
+    delete stream;
+    delete accepted;
+    delete client;
+    delete server;
+    return window;
+}
+
+TEST(Test_mux, test_flow_control)
+{
+    run_fiber([&]() {
+        mux::FlowControlOption flow;
+        // far more than a window, the connection window has to come back many times too
+        flow.connection_window = 1024 * 1024;
+        flow.max_stream_window = 4 * 1024 * 1024;
+        auto window = transfer(flow, 32 * 1024 * 1024);
+        std::cout << "auto tuned window: " << window << std::endl;
+        ASSERT_GT(window, (uint32_t)mux::FLAGS_MaxStreamWindowSize);
+        ASSERT_LE(window, flow.max_stream_window);
+
+        // past the memory budget windows stay at the floor
+        flow.window_memory_budget = 1;
+        window = transfer(flow, 4 * 1024 * 1024);
+        ASSERT_EQ(window, (uint32_t)mux::FLAGS_MaxStreamWindowSize);
+    });
+}
+
+// rpc_p99 measures small echo round trips on their own stream while another stream
+// pushes bulk data through the same session, returns the p99 in microseconds
+static int64_t rpc_p99(const mux::StreamPriority& rpc_priority) {
+    auto sessions = SessionPair::open();
+    auto server = sessions.server;
+    auto client = sessions.client;
+
+    auto bulk = client->open_stream();
+    auto bulk_accepted = server->accept_stream();
+    auto rpc = client->open_stream(rpc_priority);
+    auto rpc_accepted = server->accept_stream();
+    EXPECT_NE(bulk_accepted, nullptr);
+    EXPECT_NE(rpc_accepted, nullptr);
+
+    std::atomic<bool> stop{false};
+    acl::wait_group wg;
+    wg.add(3);
+    go[&]() {
+        std::string chunk(1024 * 1024, 'x');
+        while (!stop && bulk->send(chunk.data(), chunk.size()) > 0) {
+        }
+        wg.done();
+    };
+    go[&]() {
+        char buf[64 * 1024];
+        while (!stop && bulk_accepted->recv(buf, sizeof buf) > 0) {
+        }
+        wg.done();
+    };
+    go[&]() {
+        char buf[64];
+        ssize_t n;
+        while ((n = rpc_accepted->recv(buf, sizeof buf)) > 0) {
+            if (rpc_accepted->send(buf, n) != n) {
+                break;
+            }
+        }
+        wg.done();
+    };
+
+    // let the bulk stream fill the session first
+    acl_fiber_delay(100);
+    std::vector<int64_t> latencies;
+    for (int i = 0; i < 200; i++) {
+        char req[16] = "ping";
+        char resp[16];
+        auto begin = std::chrono::steady_clock::now();
+        EXPECT_EQ(rpc->send(req, sizeof req), (ssize_t)sizeof req);
+        size_t got = 0;
+        while (got < sizeof resp) {
+            auto n = rpc->recv(resp + got, sizeof resp - got);
+            EXPECT_GT(n, 0);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin).count());
+    }
+    stop = true;
+
+    delete rpc;
+    delete bulk;
+    delete client;
+    wg.wait();
+    delete rpc_accepted;
+    delete bulk_accepted;
+    delete server;
+
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[latencies.size() * 99 / 100];
+}
+
+TEST(Test_mux, bench_rpc_latency_under_bulk)
+{
+    run_fiber([&]() {
+        // same level: round robin lets a small frame in after at most one bulk quantum
+        auto shared = rpc_p99(mux::StreamPriority());
+        mux::StreamPriority high;
+        high.level = 0;
+        // a higher level overtakes the bulk stream at the next batch
+        auto prioritized = rpc_p99(high);
+        std::cout << "rpc p99 with bulk, same level: " << shared << "us, high level: "
+                  << prioritized << "us" << std::endl;
+        ASSERT_LT(shared, 1000 * 1000);
+        ASSERT_LT(prioritized, 1000 * 1000);
+    });
+}
+
+TEST(Test_mux, test_weighted_share)
+{
+    run_fiber([&]() {
+        auto sessions = SessionPair::open();
+        auto server = sessions.server;
+        auto client = sessions.client;
+
+        mux::StreamPriority light, heavy;
+        light.weight = 16;
+        heavy.weight = 48;
+        ISocketStream* streams[2] = {client->open_stream(light), client->open_stream(heavy)};
+        ISocketStream* accepted[2] = {server->accept_stream(), server->accept_stream()};
+        ASSERT_NE(accepted[0], nullptr);
+        ASSERT_NE(accepted[1], nullptr);
+
+        std::atomic<bool> stop{false};
+        std::atomic<size_t> received[2] = {{0}, {0}};
+        acl::wait_group wg;
+        for (int i = 0; i < 2; i++) {
+            wg.add(2);
+            go[&, i]() {
+                std::string chunk(1024 * 1024, 'x');
+                while (!stop && streams[i]->send(chunk.data(), chunk.size()) > 0) {
+                }
+                wg.done();
+            };
+            go[&, i]() {
+                char buf[64 * 1024];
+                ssize_t n;
+                while ((n = accepted[i]->recv(buf, sizeof buf)) > 0) {
+                    received[i] += n;
+                }
+                wg.done();
+            };
+        }
+        acl_fiber_delay(1000);
+        size_t light_bytes = received[0], heavy_bytes = received[1];
+        stop = true;
+        std::cout << "weight 16: " << light_bytes << " bytes, weight 48: " << heavy_bytes
+                  << " bytes" << std::endl;
+        // both backlogged the whole time, the link splits about 1:3
+        ASSERT_GT(light_bytes, 0u);
+        ASSERT_GT(heavy_bytes, light_bytes * 3 / 2);
 
+        delete streams[0];
+        delete streams[1];
+        delete client;
+        wg.wait();
+        delete accepted[0];
+        delete accepted[1];
+        delete server;
+    });
+}
 
+// PairClient connects over socketpairs, each one served by an echo session of its own
+class PairClient : public ISocketClient {
+public:
+    ~PairClient() {
+        for (auto session : sessions) {
+            session->close();
+        }
+        // accept loops and handlers are done with the sessions before they go
+        wg.wait();
+        for (auto session : sessions) {
+            delete session;
+        }
+    }
+
+    ISocketStream *connect(const std::string &remote, int port) override { return nullptr; }
+
+    ISocketStream *connect(const std::string &path) override { return nullptr; }
+
+    ISocketStream *connect(EndPoint remote) override {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            return nullptr;
+        }
+        auto server = new mux::MultiplexingSession(new TcpSocketStream(sv[0]), true, mux::MuxStreamType::Server);
+        sessions.push_back(server);
+        wg.add(1);
+        go[this, server]() {
+            ISocketStream* stream;
+            while ((stream = server->accept_stream()) != nullptr) {
+                wg.add(1);
+                go[this, stream]() {
+                    test_handler(stream);
+                    delete stream;
+                    wg.done();
+                };
+            }
+            wg.done();
+        };
+        return new TcpSocketStream(sv[1]);
+    }
+
+    ISocketClient* set_socket_options(const SocketOptions& opts) override { return this; }
+
+    std::vector<mux::MultiplexingSession*> sessions;
+    acl::wait_group wg;
+};
+
+TEST(Test_mux, test_session_fan_out)
+{
+    run_fiber([&]() {
+        for (auto placement : {mux::SessionPlacement::LeastLoaded, mux::SessionPlacement::RoundRobin}) {
+            auto pair_client = new PairClient();
+            mux::MuxClientOption option;
+            option.max_sessions_per_endpoint = 3;
+            option.streams_per_session = 2;
+            option.placement = placement;
+            option.idle_timeout_ms = 200;
+            auto client = new mux::MultiplexingSocketClient(pair_client, false, option);
+            EndPoint ep;
+            ep.from("127.0.0.1", 18889);
+
+            std::vector<ISocketStream*> streams;
+            for (int i = 0; i < 6; i++) {
+                streams.push_back(client->connect(ep));
+                ASSERT_NE(streams.back(), nullptr);
+                // a session is dialed whenever the others are full
+                ASSERT_EQ(client->session_count(ep), (size_t)(i / 2 + 1));
+            }
+            // past the fan-out streams go on the existing sessions
+            streams.push_back(client->connect(ep));
+            ASSERT_NE(streams.back(), nullptr);
+            ASSERT_EQ(client->session_count(ep), 3u);
+            ASSERT_EQ(pair_client->sessions.size(), 3u);
+
+            for (auto stream : streams) {
+                char buf[16];
+                ASSERT_EQ(stream->send("hello", 5), 5);
+                ASSERT_EQ(stream->recv(buf, sizeof buf), 5);
+                ASSERT_EQ(std::string(buf, 5), "hello");
+            }
+
+            // sessions without streams are retired once idle for the timeout
+            delete streams.back();
+            streams.pop_back();
+            acl_fiber_delay(500);
+            ASSERT_EQ(client->session_count(ep), 3u);
+            for (auto stream : streams) {
                 delete stream;
             }
+            for (int i = 0; i < 50 && client->session_count(ep) > 0; i++) {
+                acl_fiber_delay(100);
+            }
+            ASSERT_EQ(client->session_count(ep), 0u);
+
+            delete client;
+            delete pair_client;
         }
-        LOG(INFO) << "client exit";
+    });
+}
+
+TEST(Test_mux, test_stream_outlives_client)
+{
+    run_fiber([&]() {
+        auto pair_client = new PairClient();
+        auto client = new mux::MultiplexingSocketClient(pair_client, false);
+        EndPoint ep;
+        ep.from("127.0.0.1", 18889);
+        auto stream = client->connect(ep);
+        ASSERT_NE(stream, nullptr);
+        char buf[16];
+        ASSERT_EQ(stream->send("hello", 5), 5);
+        ASSERT_EQ(stream->recv(buf, sizeof buf), 5);
 
+        // the client closes its sessions, the stream keeps its own one alive until deleted
+        delete client;
+        ASSERT_EQ(stream->send("hello", 5), -1);
+        delete stream;
+        delete pair_client;
     });
+}
+
+TEST(Test_mux, bench_idle_streams)
+{
+    run_fiber([&]() {
+        auto sessions = SessionPair::open();
+        auto server = sessions.server;
+        auto client = sessions.client;
+
+        const int n = 10000;
+        std::vector<ISocketStream*> streams, accepted;
+        // the second round reuses the stream objects the first one freed
+        for (int round = 0; round < 2; round++) {
+            auto begin = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; i++) {
+                streams.push_back(client->open_stream());
+                ASSERT_NE(streams.back(), nullptr);
+                accepted.push_back(server->accept_stream());
+                ASSERT_NE(accepted.back(), nullptr);
+            }
+            auto cost = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+            std::cout << "round " << round << ": " << n << " idle streams a side, "
+                      << sizeof(mux::MultiplexingStream) << " bytes each, open "
+                      << cost / n << "us per stream" << std::endl;
 
-    acl::fiber_tbox<int> p;
-    p.pop();
+            ASSERT_EQ(streams.back()->send("x", 1), 1);
+            char c;
+            ASSERT_EQ(accepted.back()->recv(&c, 1), 1);
+            for (auto stream : streams) {
+                delete stream;
+            }
+            for (auto stream : accepted) {
+                delete stream;
+            }
+            streams.clear();
+            accepted.clear();
+        }
+
+        delete client;
+        delete server;
+    });
 }
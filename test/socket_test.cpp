@@ -1,10 +1,12 @@
 
 #include <gtest/gtest.h>
 #include <glog/logging.h>
+#include <netinet/tcp.h>
 #include "../socket_stream.h"
 #include "../buffer.h"
 #include "../http/request.h"
 #include "../socket.h"
+#include "../socket_pool.h"
 using namespace arch_net::coin;
 //static int test_handler(arch_net::ISocketStream* stream) {
 //    LOG(INFO) << "new connection";
@@ -76,4 +78,371 @@ TEST(TestSocket, test_dns)
     arch_net::dns_resolve("2408:8606:1800:501::2:f", addrs);
 
     std::cout << container_to_string(addrs.begin(), addrs.end()) << std::endl;
-}
\ No newline at end of file
+}
+
+static std::string read_all(int fd, size_t size) {
+    std::string out;
+    char buf[8192];
+    while (out.size() < size) {
+        auto n = ::read(fd, buf, sizeof buf);
+        if (n <= 0) break;
+        out.append(buf, n);
+    }
+    return out;
+}
+
+TEST(TestSocket, test_sendfile)
+{
+    std::string content;
+    for (int i = 0; i < 4 * 1024 * 1024; i++) {
+        content.push_back('a' + i % 26);
+    }
+    char path[] = "/tmp/arch_net_sendfileXXXXXX";
+    int file_fd = mkstemp(path);
+    ASSERT_GE(file_fd, 0);
+    ASSERT_EQ(::write(file_fd, content.data(), content.size()), (ssize_t)content.size());
+
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    // regular file: sendfile(2), starting at an offset
+    {
+        off_t offset = 1000;
+        std::string received;
+        std::thread reader([&]() { received = read_all(sv[1], content.size() - offset); });
+        arch_net::TcpSocketStream stream(sv[0]);
+        ASSERT_EQ(stream.sendfile(file_fd, offset, content.size() - offset), (ssize_t)(content.size() - offset));
+        reader.join();
+        ASSERT_EQ(received, content.substr(offset));
+        // the socket is back in the blocking mode it came in
+        ASSERT_FALSE(fcntl(sv[0], F_GETFL) & O_NONBLOCK);
+        stream.close();
+    }
+    ::close(sv[1]);
+
+    // pipe: splice(2)
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    {
+        int pfd[2];
+        ASSERT_EQ(pipe(pfd), 0);
+        std::string part = content.substr(0, 60000);
+        std::thread writer([&]() { ::write(pfd[1], part.data(), part.size()); ::close(pfd[1]); });
+        std::string received;
+        std::thread reader([&]() { received = read_all(sv[1], part.size()); });
+        arch_net::TcpSocketStream stream(sv[0]);
+        ASSERT_EQ(stream.sendfile(pfd[0], 0, part.size()), (ssize_t)part.size());
+        writer.join();
+        reader.join();
+        ASSERT_EQ(received, part);
+        ::close(pfd[0]);
+        stream.close();
+    }
+    ::close(sv[1]);
+    ::close(file_fd);
+    unlink(path);
+}
+
+// EchoServer serves echo connections on a 127.0.0.1 port picked by the kernel.
+// configure runs before start, it may replace the handler
+class EchoServer {
+public:
+    explicit EchoServer(int threads = 1,
+                        const std::function<void(arch_net::ISocketServer*)>& configure = nullptr)
+        : server_(arch_net::new_tcp_socket_server()) {
+        EXPECT_GE(server_->init("127.0.0.1", 0), 0);
+        struct sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(server_->get_listen_fd(), (struct sockaddr*)&addr, &len);
+        port_ = ntohs(addr.sin_port);
+        server_->set_handler([this](arch_net::ISocketStream* stream) -> int {
+            char buf[64];
+            while (true) {
+                auto n = stream->recv(buf, sizeof buf);
+                if (n <= 0) break;
+                if (stream->send(buf, n) <= 0) break;
+            }
+            finished++;
+            return 0;
+        });
+        if (configure) {
+            configure(server_.get());
+        }
+        thread_ = std::thread([this, threads]() { server_->start(threads); });
+    }
+
+    ~EchoServer() {
+        shutdown(500);
+        thread_.join();
+    }
+
+    // shutdown returns the connections force closed, 0 once already shut down
+    int shutdown(int drain_timeout_ms) { return server_->shutdown(drain_timeout_ms); }
+
+    uint16_t port() const { return port_; }
+
+    std::atomic<int> finished{0};
+
+private:
+    std::unique_ptr<arch_net::ISocketServer> server_;
+    uint16_t port_{0};
+    std::thread thread_;
+};
+
+TEST(TestSocket, test_graceful_stop)
+{
+    EchoServer server;
+    std::unique_ptr<arch_net::ISocketClient> client(arch_net::new_tcp_socket_client());
+    std::unique_ptr<arch_net::ISocketStream> leaving(client->connect("127.0.0.1", server.port()));
+    std::unique_ptr<arch_net::ISocketStream> idle(client->connect("127.0.0.1", server.port()));
+    ASSERT_TRUE(leaving && idle);
+    char buf[64];
+    for (auto& c : {leaving.get(), idle.get()}) {
+        ASSERT_EQ(c->send("ping", 4), 4);
+        ASSERT_EQ(c->recv(buf, sizeof buf), 4);
+    }
+
+    // one connection goes away while draining, the idle one is force closed at the deadline
+    std::thread closer([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        leaving->close();
+    });
+    auto forced = server.shutdown(500);
+    closer.join();
+    ASSERT_EQ(forced, 1);
+    ASSERT_EQ(server.finished.load(), 2);
+    ASSERT_LE(idle->recv(buf, sizeof buf), 0);
+
+    std::unique_ptr<arch_net::ISocketStream> late(client->connect("127.0.0.1", server.port()));
+    ASSERT_FALSE(late);
+}
+
+TEST(TestSocket, test_reuseport_accept)
+{
+    for (auto mode : {arch_net::AcceptMode::ReusePort, arch_net::AcceptMode::ReusePortCPU}) {
+        EchoServer server(4, [mode](arch_net::ISocketServer* s) { s->set_accept_mode(mode); });
+
+        std::vector<std::thread> clients;
+        std::atomic<int> ok{0};
+        for (int i = 0; i < 16; i++) {
+            clients.emplace_back([&]() {
+                std::unique_ptr<arch_net::ISocketClient> client(arch_net::new_tcp_socket_client());
+                for (int j = 0; j < 8; j++) {
+                    std::unique_ptr<arch_net::ISocketStream> conn(client->connect("127.0.0.1", server.port()));
+                    char buf[64];
+                    if (conn && conn->send("ping", 4) == 4 && conn->recv(buf, sizeof buf) == 4) {
+                        ok++;
+                    }
+                }
+            });
+        }
+        for (auto& t : clients) {
+            t.join();
+        }
+        ASSERT_EQ(ok.load(), 16 * 8);
+        ASSERT_EQ(server.shutdown(500), 0);
+    }
+}
+
+TEST(TestSocket, test_shutdown_during_start)
+{
+    // a shutdown racing start must still wake up every shard listener, or start never returns
+    for (int i = 0; i < 20; i++) {
+        std::unique_ptr<arch_net::ISocketServer> server(arch_net::new_tcp_socket_server());
+        ASSERT_GE(server->init("127.0.0.1", 0), 0);
+        server->set_accept_mode(arch_net::AcceptMode::ReusePortCPU);
+        server->set_handler([](arch_net::ISocketStream* stream) -> int { return 0; });
+        std::thread serve([&]() { server->start(4); });
+        if (i % 2) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        server->shutdown(100);
+        serve.join();
+    }
+}
+
+TEST(TestSocket, test_io_uring_engine)
+{
+    // without io_uring in the kernel or in acl the server runs on epoll, it serves either way
+#ifndef ARCH_NET_IO_URING
+    // the default build ships io_uring disabled, this only covers the epoll fallback
+    ASSERT_FALSE(arch_net::io_uring_available());
+#endif
+    LOG(INFO) << "io_uring available: " << arch_net::io_uring_available();
+    EchoServer server(1, [](arch_net::ISocketServer* s) { s->set_io_engine(arch_net::IOEngine::IOUring); });
+
+    std::unique_ptr<arch_net::ISocketClient> client(arch_net::new_tcp_socket_client());
+    std::unique_ptr<arch_net::ISocketStream> conn(client->connect("127.0.0.1", server.port()));
+    ASSERT_TRUE(conn);
+    char buf[64];
+    ASSERT_EQ(conn->send("ping", 4), 4);
+    ASSERT_EQ(conn->recv(buf, sizeof buf), 4);
+    ASSERT_EQ(std::string(buf, 4), "ping");
+}
+
+static int get_int_option(int fd, int level, int name) {
+    int value = 0;
+    socklen_t len = sizeof(value);
+    getsockopt(fd, level, name, &value, &len);
+    return value;
+}
+
+TEST(TestSocket, test_socket_options)
+{
+    arch_net::SocketOptions opts;
+    opts.recv_buffer_size = 256 * 1024;
+    opts.keepalive = true;
+    opts.keepalive_idle_s = 30;
+    opts.defer_accept_s = 1;
+
+    std::atomic<int> nodelay{-1}, keepidle{-1};
+    EchoServer server(1, [&](arch_net::ISocketServer* s) {
+        s->set_socket_options(opts);
+        s->set_handler([&](arch_net::ISocketStream* stream) -> int {
+            nodelay = get_int_option(stream->get_fd(), IPPROTO_TCP, TCP_NODELAY);
+            keepidle = get_int_option(stream->get_fd(), IPPROTO_TCP, TCP_KEEPIDLE);
+            char buf[64];
+            auto n = stream->recv(buf, sizeof buf);
+            if (n > 0) {
+                stream->send(buf, n);
+            }
+            return 0;
+        });
+    });
+
+    std::unique_ptr<arch_net::ISocketClient> client(arch_net::new_tcp_socket_client());
+    arch_net::SocketOptions client_opts;
+    client_opts.send_buffer_size = 64 * 1024;
+    client->set_socket_options(client_opts);
+    std::unique_ptr<arch_net::ISocketStream> conn(client->connect("127.0.0.1", server.port()));
+    ASSERT_TRUE(conn);
+    ASSERT_EQ(get_int_option(conn->get_fd(), IPPROTO_TCP, TCP_NODELAY), 1);
+    // the kernel doubles the requested size for bookkeeping
+    ASSERT_GE(get_int_option(conn->get_fd(), SOL_SOCKET, SO_SNDBUF), 64 * 1024);
+    // with TCP_DEFER_ACCEPT the handler only runs once data arrived
+    char buf[64];
+    ASSERT_EQ(conn->send("ping", 4), 4);
+    ASSERT_EQ(conn->recv(buf, sizeof buf), 4);
+    ASSERT_EQ(nodelay.load(), 1);
+    ASSERT_EQ(keepidle.load(), 30);
+}
+
+TEST(TestSocket, test_socket_pool)
+{
+    EchoServer server;
+
+    arch_net::SocketPoolOption option;
+    option.max_idle_per_endpoint = 2;
+    option.min_idle_per_endpoint = 1;
+    option.max_total = 3;
+    arch_net::TcpSocketPoolClient pool(arch_net::new_tcp_socket_client(), true, option);
+    arch_net::EndPoint ep;
+    ep.from("127.0.0.1", server.port());
+
+    // warmup stops at max_idle_per_endpoint
+    ASSERT_EQ(pool.warmup(ep, 4), 2);
+    ASSERT_EQ(pool.total_count(), 2u);
+
+    std::vector<std::unique_ptr<arch_net::ISocketStream>> streams;
+    for (int i = 0; i < 3; i++) {
+        streams.emplace_back(pool.connect(ep));
+        ASSERT_TRUE(streams.back());
+        char buf[64];
+        ASSERT_EQ(streams.back()->send("ping", 4), 4);
+        ASSERT_EQ(streams.back()->recv(buf, sizeof buf), 4);
+    }
+    ASSERT_EQ(pool.idle_count(ep), 0u);
+    ASSERT_EQ(pool.total_count(), 3u);
+    std::unique_ptr<arch_net::ISocketStream> over(pool.connect(ep));
+    ASSERT_FALSE(over);
+
+    // streams are released in order, the third one exceeds max_idle_per_endpoint
+    // and the most recently pooled one is handed out first
+    int last_fd = streams[1]->get_fd();
+    streams.clear();
+    ASSERT_EQ(pool.idle_count(ep), 2u);
+    ASSERT_EQ(pool.total_count(), 2u);
+    std::unique_ptr<arch_net::ISocketStream> reused(pool.connect(ep));
+    ASSERT_EQ(reused->get_fd(), last_fd);
+    reused.reset();
+
+    pool.evict(arch_net::TcpSocketPoolClient::now_ms() + option.idle_timeout_ms);
+    ASSERT_EQ(pool.idle_count(ep), 1u);
+    ASSERT_EQ(pool.total_count(), 1u);
+
+    // a stream that went bad is not pooled again, refill brings the endpoint back to min_idle
+    std::unique_ptr<arch_net::ISocketStream> broken(pool.connect(ep));
+    broken->close();
+    broken.reset();
+    ASSERT_EQ(pool.idle_count(ep), 0u);
+    ASSERT_EQ(pool.total_count(), 0u);
+    pool.refill();
+    ASSERT_EQ(pool.idle_count(ep), 1u);
+    ASSERT_EQ(pool.total_count(), 1u);
+
+    // an endpoint nobody connected to for endpoint_timeout_ms loses min_idle and leaves the pool
+    pool.evict(arch_net::TcpSocketPoolClient::now_ms() + option.endpoint_timeout_ms);
+    ASSERT_EQ(pool.idle_count(ep), 0u);
+    ASSERT_EQ(pool.total_count(), 0u);
+    pool.refill();
+    ASSERT_EQ(pool.idle_count(), 0u);
+    ASSERT_EQ(pool.total_count(), 0u);
+}
+
+TEST(TestSocket, test_endpoint_key)
+{
+    arch_net::EndPoint a, b, c, v6, v6_other_port;
+    ASSERT_TRUE(a.from("10.0.0.1", 80));
+    ASSERT_TRUE(b.from("10.0.0.1:80"));
+    ASSERT_TRUE(c.from("10.0.0.2", 80));
+    ASSERT_TRUE(v6.from("::1", 80));
+    ASSERT_TRUE(v6_other_port.from("::1", 81));
+
+    // host strings don't take part, only the address
+    b.host = "example";
+    ASSERT_TRUE(a == b);
+    ASSERT_EQ(std::hash<arch_net::EndPoint>()(a), std::hash<arch_net::EndPoint>()(b));
+    ASSERT_TRUE(a != c);
+    ASSERT_TRUE(a < c);
+    ASSERT_FALSE(c < a);
+    ASSERT_FALSE(a < b || b < a);
+    ASSERT_TRUE(v6 != v6_other_port);
+    ASSERT_TRUE(v6 < v6_other_port);
+    // ipv4 sorts before ipv6
+    ASSERT_TRUE(c < v6);
+}
+
+TEST(TestSocket, bench_pool_connect_release)
+{
+    const int loops = 200000;
+    for (int endpoints : {8, 256}) {
+        arch_net::TcpSocketPoolClient pool(arch_net::new_tcp_socket_client(), true);
+        std::vector<arch_net::EndPoint> eps(endpoints);
+        std::vector<int> peers;
+        for (int i = 0; i < endpoints; i++) {
+            eps[i].from(arch_net::string_printf("10.0.%d.%d", i / 256, i % 256), 8000 + i % 7);
+            // a socketpair stands in for the connection, the pool only looks at the fd
+            int sv[2];
+            ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+            pool.release(eps[i], new arch_net::TcpSocketStream(sv[0]), false);
+            peers.push_back(sv[1]);
+        }
+        ASSERT_EQ(pool.idle_count(), (size_t)endpoints);
+
+        // every connect finds its endpoint, probes the idle stream and hands it back on release
+        int reused = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int n = 0; n < loops; n++) {
+            std::unique_ptr<arch_net::ISocketStream> stream(pool.connect(eps[n % endpoints]));
+            reused += stream != nullptr;
+        }
+        auto end = std::chrono::steady_clock::now();
+        ASSERT_EQ(reused, loops);
+        ASSERT_EQ(pool.idle_count(), (size_t)endpoints);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        std::cout << endpoints << " endpoints x " << loops << " connect + release: "
+                  << ns / loops << "ns each" << std::endl;
+        for (auto fd : peers) {
+            ::close(fd);
+        }
+    }
+}
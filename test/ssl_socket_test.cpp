@@ -3,6 +3,10 @@
 #include <glog/logging.h>
 #include "../socket_stream.h"
 #include "../ssl_socket_stream.h"
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
 
 static int ssl_test_handler(arch_net::ISocketStream* stream) {
     LOG(INFO) << "new connection";
@@ -104,3 +108,491 @@ TEST(SSL_SOCKET_STREAM, Test_OPENSSLSOCKET)
     std::this_thread::sleep_for(std::chrono::seconds(10000));
 }
 
+
+static const char* kCA = "../../arch_net/test/mtls_test/keys/ca/ca_cert.pem";
+
+static double cpu_now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double thread_cpu_now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// run_handshakes makes n tls connections over socketpairs, each exchanging one byte so
+// that tls 1.3 tickets get delivered, and returns how many of them resumed a session.
+// server_cpu_us gets the cpu time of the thread the server streams ran on
+static int run_handshakes(arch_net::ssl::TLSContext* server_ctx,
+                          arch_net::ssl::TLSContext* client_ctx, int n,
+                          double* server_cpu_us = nullptr) {
+    std::vector<std::pair<int, int>> pairs(n);
+    for (auto& pair : pairs) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            return -1;
+        }
+        pair = {fds[0], fds[1]};
+    }
+
+    std::thread server_thread([&]() {
+        double cpu_start = thread_cpu_now_us();
+        defer(if (server_cpu_us) *server_cpu_us = thread_cpu_now_us() - cpu_start);
+        for (auto& pair : pairs) {
+            std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                    server_ctx, new arch_net::TcpSocketStream(pair.first), true));
+            auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+            if (tls->server_handshake() != 0) {
+                continue;
+            }
+            char c;
+            if (stream->recv(&c, 1) == 1) {
+                stream->send(&c, 1);
+            }
+        }
+    });
+
+    arch_net::EndPoint ep;
+    ep.from("127.0.0.1", 8888);
+    int reused = 0;
+    for (auto& pair : pairs) {
+        std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                client_ctx, new arch_net::TcpSocketStream(pair.second), true));
+        auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+        tls->set_session_key(ep.key());
+        if (tls->client_handshake() != 0) {
+            continue;
+        }
+        char c = 'x';
+        if (stream->send(&c, 1) == 1 && stream->recv(&c, 1) == 1 && tls->session_reused()) {
+            reused++;
+        }
+    }
+    server_thread.join();
+    return reused;
+}
+
+TEST(SSL_SOCKET_STREAM, bench_session_resumption)
+{
+    const int n = 200;
+    // the close_notify of a stream may reach a peer that already closed
+    signal(SIGPIPE, SIG_IGN);
+    for (bool resume : {false, true}) {
+        arch_net::ssl::TLSSessionOption option;
+        option.session_cache = resume;
+        option.tickets = resume;
+        option.client_session_store = resume;
+
+        std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+                "../../arch_net/test/mtls_test/keys/server/private/server_key.pem", option));
+        std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+                "../../arch_net/test/mtls_test/keys/client/private/client_key.pem", option));
+        ASSERT_TRUE(server_ctx && client_ctx);
+
+        auto start = std::chrono::steady_clock::now();
+        double cpu_start = cpu_now_us();
+        int reused = run_handshakes(server_ctx.get(), client_ctx.get(), n);
+        double cpu_us = cpu_now_us() - cpu_start;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << (resume ? "resumption" : "full handshake") << ": " << n / secs << " handshakes/s, "
+                  << cpu_us / n << " cpu us/conn (client + server), reused " << reused << std::endl;
+        if (resume) {
+            // only the first connection pays the full handshake
+            EXPECT_EQ(reused, n - 1);
+        } else {
+            EXPECT_EQ(reused, 0);
+        }
+    }
+}
+
+// tcp_pair connects two tcp sockets over loopback, ktls can not be set up on unix sockets
+static bool tcp_pair(int& server_fd, int& client_fd) {
+    int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (::bind(lfd, (sockaddr*)&addr, len) != 0 || ::listen(lfd, 1) != 0 ||
+        ::getsockname(lfd, (sockaddr*)&addr, &len) != 0) {
+        ::close(lfd);
+        return false;
+    }
+    client_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(client_fd, (sockaddr*)&addr, len) != 0) {
+        ::close(lfd);
+        ::close(client_fd);
+        return false;
+    }
+    server_fd = ::accept(lfd, nullptr, nullptr);
+    ::close(lfd);
+    return server_fd >= 0;
+}
+
+TEST(SSL_SOCKET_STREAM, bench_ktls_sendfile)
+{
+    const size_t file_size = 16 << 20;
+    const int rounds = 8;
+    signal(SIGPIPE, SIG_IGN);
+
+    char path[] = "/tmp/arch_net_ktls_XXXXXX";
+    int file_fd = mkstemp(path);
+    ASSERT_GE(file_fd, 0);
+    unlink(path);
+    std::string chunk(1 << 20, 'k');
+    for (size_t i = 0; i < file_size; i += chunk.size()) {
+        ASSERT_EQ(write(file_fd, chunk.data(), chunk.size()), (ssize_t)chunk.size());
+    }
+
+    for (bool ktls : {false, true}) {
+        std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+                "../../arch_net/test/mtls_test/keys/server/private/server_key.pem"));
+        std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+                "../../arch_net/test/mtls_test/keys/client/private/client_key.pem"));
+        ASSERT_TRUE(server_ctx && client_ctx);
+        server_ctx->enable_ktls(ktls);
+        client_ctx->enable_ktls(ktls);
+
+        int server_fd, client_fd;
+        ASSERT_TRUE(tcp_pair(server_fd, client_fd));
+
+        size_t received = 0;
+        std::thread server_thread([&]() {
+            std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                    server_ctx.get(), new arch_net::TcpSocketStream(server_fd), true));
+            if (dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get())->server_handshake() != 0) {
+                return;
+            }
+            std::unique_ptr<char[]> buf(new char[256 << 10]);
+            while (received < file_size * rounds) {
+                auto n = stream->recv(buf.get(), 256 << 10);
+                if (n <= 0) {
+                    break;
+                }
+                received += n;
+            }
+        });
+
+        std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                client_ctx.get(), new arch_net::TcpSocketStream(client_fd), true));
+        auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+        ASSERT_EQ(tls->client_handshake(), 0);
+
+        auto start = std::chrono::steady_clock::now();
+        double cpu_start = cpu_now_us();
+        for (int i = 0; i < rounds; i++) {
+            ASSERT_EQ(stream->sendfile(file_fd, 0, file_size), (ssize_t)file_size);
+        }
+        server_thread.join();
+        double cpu_us = cpu_now_us() - cpu_start;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        EXPECT_EQ(received, file_size * rounds);
+        std::cout << (ktls ? "ktls requested" : "userspace") << ": send ktls " << tls->ktls_send()
+                  << ", recv ktls " << tls->ktls_recv() << ", " << received / secs / (1 << 20) << " MB/s, "
+                  << cpu_us / (received >> 20) << " cpu us/MB" << std::endl;
+    }
+    close(file_fd);
+}
+
+// CountingStream counts the writes reaching the socket under a tls stream
+class CountingStream : public arch_net::TcpSocketStream {
+public:
+    explicit CountingStream(int fd) : arch_net::TcpSocketStream(fd) {}
+
+    ssize_t send(const void* buf, size_t count, int flags = 0) override {
+        writes++;
+        bytes += count;
+        return arch_net::TcpSocketStream::send(buf, count, flags);
+    }
+
+    size_t writes = 0;
+    size_t bytes = 0;
+};
+
+TEST(SSL_SOCKET_STREAM, test_ktls_wrapped_stream)
+{
+    signal(SIGPIPE, SIG_IGN);
+    std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+            "../../arch_net/test/mtls_test/keys/server/private/server_key.pem"));
+    std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+            "../../arch_net/test/mtls_test/keys/client/private/client_key.pem"));
+    ASSERT_TRUE(server_ctx && client_ctx);
+    server_ctx->enable_ktls(true);
+
+    // a stream overriding io keeps seeing every record though its fd would do for ktls
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    auto inner = new CountingStream(fds[0]);
+    std::thread client_thread([&]() {
+        std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                client_ctx.get(), new arch_net::TcpSocketStream(fds[1]), true));
+        char c = 'x';
+        if (dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get())->client_handshake() == 0) {
+            stream->send(&c, 1);
+            stream->recv(&c, 1);
+        }
+    });
+    std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(server_ctx.get(), inner, true));
+    ASSERT_EQ(dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get())->server_handshake(), 0);
+    char c;
+    ASSERT_EQ(stream->recv(&c, 1), 1);
+    ASSERT_EQ(stream->send(&c, 1), 1);
+    client_thread.join();
+    ASSERT_GT(inner->writes, 0u);
+}
+
+TEST(SSL_SOCKET_STREAM, bench_vectored_send)
+{
+    const int messages = 20000;
+    signal(SIGPIPE, SIG_IGN);
+
+    std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+            "../../arch_net/test/mtls_test/keys/server/private/server_key.pem"));
+    std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+            "../../arch_net/test/mtls_test/keys/client/private/client_key.pem"));
+    ASSERT_TRUE(server_ctx && client_ctx);
+
+    std::string header(16, 'h'), body(200, 'b'), large(40 << 10, 'l');
+
+    for (bool gather : {false, true}) {
+        int fds[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+        const size_t expect = large.size() + header.size() + body.size() +
+                              messages * (header.size() + body.size());
+        std::string first;
+        size_t received = 0;
+        std::thread server_thread([&]() {
+            std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                    server_ctx.get(), new arch_net::TcpSocketStream(fds[0]), true));
+            if (dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get())->server_handshake() != 0) {
+                return;
+            }
+            std::unique_ptr<char[]> buf(new char[64 << 10]);
+            while (received < expect) {
+                struct iovec iov[2] = {{buf.get(), 1000}, {buf.get() + 1000, (64 << 10) - 1000}};
+                auto n = stream->recv(iov, 2);
+                if (n <= 0) {
+                    break;
+                }
+                if (first.size() < large.size() + header.size() + body.size()) {
+                    first.append(buf.get(), std::min<size_t>(n, large.size() + header.size() + body.size() - first.size()));
+                }
+                received += n;
+            }
+        });
+
+        auto inner = new CountingStream(fds[1]);
+        std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(client_ctx.get(), inner, true));
+        ASSERT_EQ(dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get())->client_handshake(), 0);
+        inner->writes = 0;
+        inner->bytes = 0;
+
+        auto send = [&](const struct iovec* iov, int iovcnt) {
+            return gather ? stream->send(iov, iovcnt) : arch_net::writev_by_send(stream.get(), iov, iovcnt);
+        };
+
+        // a record sized piece first, then header and body pairs
+        struct iovec mixed[3] = {{(void*)large.data(), large.size()},
+                                 {(void*)header.data(), header.size()},
+                                 {(void*)body.data(), body.size()}};
+        ASSERT_EQ(send(mixed, 3), (ssize_t)(large.size() + header.size() + body.size()));
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < messages; i++) {
+            ASSERT_EQ(send(mixed + 1, 2), (ssize_t)(header.size() + body.size()));
+        }
+        server_thread.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        EXPECT_EQ(received, expect);
+        EXPECT_EQ(first, large + header + body);
+        std::cout << (gather ? "gathered" : "per iovec") << ": " << messages / secs << " msgs/s, "
+                  << (double)inner->writes / messages << " writes/msg, "
+                  << (double)inner->bytes / messages << " wire bytes/msg" << std::endl;
+    }
+}
+
+TEST(SSL_SOCKET_STREAM, test_offload_concurrency_limit)
+{
+    const int n = 16;
+    const int limit = 2;
+    signal(SIGPIPE, SIG_IGN);
+    CPUWorkerPool pool(4);
+
+    arch_net::ssl::TLSSessionOption option;
+    option.session_cache = false;
+    option.tickets = false;
+    option.client_session_store = false;
+    std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+            "../../arch_net/test/mtls_test/keys/server/private/server_key.pem", option));
+    std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+            "../../arch_net/test/mtls_test/keys/client/private/client_key.pem", option));
+    ASSERT_TRUE(server_ctx && client_ctx);
+    server_ctx->set_handshake_offload(&pool, limit);
+
+    std::vector<std::pair<int, int>> pairs(n);
+    for (auto& pair : pairs) {
+        int fds[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        pair = {fds[0], fds[1]};
+    }
+
+    // every server handshake runs in a fiber of its own, n of them compete for limit slots
+    std::atomic<int> served{0};
+    std::thread server_thread([&]() {
+        for (auto& pair : pairs) {
+            int fd = pair.first;
+            go[&, fd]() {
+                std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                        server_ctx.get(), new arch_net::TcpSocketStream(fd), true));
+                auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+                // one byte back and forth, the peer stays until the handshake wrote everything
+                char c;
+                if (tls->server_handshake() == 0 && stream->recv(&c, 1) == 1 && stream->send(&c, 1) == 1) {
+                    served++;
+                }
+            };
+        }
+        acl::fiber::schedule();
+    });
+
+    std::atomic<int> connected{0};
+    std::vector<std::thread> clients;
+    for (auto& pair : pairs) {
+        int fd = pair.second;
+        clients.emplace_back([&, fd]() {
+            std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                    client_ctx.get(), new arch_net::TcpSocketStream(fd), true));
+            auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+            char c = 'x';
+            if (tls->client_handshake() == 0 && stream->send(&c, 1) == 1 && stream->recv(&c, 1) == 1) {
+                connected++;
+            }
+        });
+    }
+    for (auto& t : clients) {
+        t.join();
+    }
+    server_thread.join();
+
+    ASSERT_EQ(served.load(), n);
+    ASSERT_EQ(connected.load(), n);
+    ASSERT_LE(server_ctx->offload_peak(), limit);
+    EXPECT_EQ(server_ctx->offload_peak(), limit);
+    // every offloaded handshake recorded its wait for a slot
+    ASSERT_EQ(server_ctx->handshake_wait().count(), (uint64_t)n);
+    ASSERT_EQ(server_ctx->handshake_latency().count(), (uint64_t)n);
+}
+
+TEST(SSL_SOCKET_STREAM, test_handshake_off_accept_loop)
+{
+    signal(SIGPIPE, SIG_IGN);
+    CPUWorkerPool pool(2);
+
+    std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+            "../../arch_net/test/mtls_test/keys/server/private/server_key.pem"));
+    std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+            kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+            "../../arch_net/test/mtls_test/keys/client/private/client_key.pem"));
+    ASSERT_TRUE(server_ctx && client_ctx);
+    server_ctx->set_handshake_offload(&pool, 4);
+
+    std::unique_ptr<arch_net::ISocketServer> server(arch_net::ssl::new_tls_server(server_ctx.get()));
+    ASSERT_GE(server->init("127.0.0.1", 0), 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(getsockname(server->get_listen_fd(), (struct sockaddr*)&addr, &len), 0);
+    server->set_handler([](arch_net::ISocketStream* stream) -> int {
+        char c;
+        if (stream->recv(&c, 1) == 1) {
+            stream->send(&c, 1);
+        }
+        return 0;
+    });
+    std::thread serve([&]() {
+        server->start(1);
+    });
+
+    // connected but silent, its server handshake waits for a ClientHello that never comes
+    int stalled = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(stalled, (struct sockaddr*)&addr, len), 0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(fd, (struct sockaddr*)&addr, len), 0);
+    std::atomic<bool> echoed{false};
+    std::thread client([&]() {
+        std::unique_ptr<arch_net::ISocketStream> stream(arch_net::ssl::new_tls_stream(
+                client_ctx.get(), new arch_net::TcpSocketStream(fd), true));
+        auto tls = dynamic_cast<arch_net::ssl::TLSSocketStream*>(stream.get());
+        char c = 'x';
+        if (tls->client_handshake() == 0 && stream->send(&c, 1) == 1 && stream->recv(&c, 1) == 1) {
+            echoed = true;
+        }
+    });
+
+    // the accept loop takes the second connection while the first one still stalls
+    for (int i = 0; i < 300 && !echoed; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    bool served = echoed;
+    // a client still waiting for its handshake gives up
+    shutdown(fd, SHUT_RDWR);
+    close(stalled);
+    client.join();
+    server->shutdown(100);
+    serve.join();
+    ASSERT_TRUE(served);
+}
+
+TEST(SSL_SOCKET_STREAM, bench_offload_handshake)
+{
+    const int n = 100;
+    signal(SIGPIPE, SIG_IGN);
+    CPUWorkerPool pool(2);
+
+    arch_net::ssl::TLSSessionOption option;
+    option.session_cache = false;
+    option.tickets = false;
+    option.client_session_store = false;
+
+    for (bool offload : {false, true}) {
+        std::unique_ptr<arch_net::ssl::TLSContext> server_ctx(arch_net::ssl::new_server_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/server/server_cert.pem",
+                "../../arch_net/test/mtls_test/keys/server/private/server_key.pem", option));
+        std::unique_ptr<arch_net::ssl::TLSContext> client_ctx(arch_net::ssl::new_client_tls_context(
+                kCA, "../../arch_net/test/mtls_test/keys/client/client_cert.pem",
+                "../../arch_net/test/mtls_test/keys/client/private/client_key.pem", option));
+        ASSERT_TRUE(server_ctx && client_ctx);
+        if (offload) {
+            server_ctx->set_handshake_offload(&pool, 4);
+        }
+
+        double server_cpu_us = 0;
+        auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(run_handshakes(server_ctx.get(), client_ctx.get(), n, &server_cpu_us), 0);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        auto& latency = server_ctx->handshake_latency();
+        EXPECT_EQ(latency.count(), (uint64_t)n);
+        std::cout << (offload ? "offloaded" : "inline") << ": " << n / secs << " handshakes/s, "
+                  << server_cpu_us / n << " io thread cpu us/handshake, latency p50 " << latency.percentile(0.5)
+                  << "us p99 " << latency.percentile(0.99) << "us, slot wait p99 "
+                  << server_ctx->handshake_wait().percentile(0.99) << "us" << std::endl;
+    }
+}
@@ -3,6 +3,7 @@
 #include "../socket.h"
 #include "fiber/go_fiber.hpp"
 #include "../udp/udp_socket_stream.h"
+#include <netinet/udp.h>
 
 void setFdpro(int fd, int property){
     int sockopt = 1;
@@ -214,4 +215,209 @@ TEST(Test_UDP, test_2)
         acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
     }
 
-}
\ No newline at end of file
+}
+
+enum class UDPBatchMode {
+    PerDatagram,
+    Batched,
+    BatchedGSO,
+};
+
+// udp_pps sends count datagrams of size bytes over loopback and returns the packets/sec
+// the receiver saw, it stops once the socket stays quiet for 200ms
+static double udp_pps(UDPBatchMode mode, int count, size_t size) {
+    const int batch = 32;
+    int rfd = arch_net::udp_socket();
+    int sfd = arch_net::udp_socket();
+    int rcvbuf = 8 << 20;
+    setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (::bind(rfd, (sockaddr*)&addr, len) != 0 || getsockname(rfd, (sockaddr*)&addr, &len) != 0) {
+        return 0;
+    }
+
+    int received = 0;
+    auto last = std::chrono::steady_clock::now();
+    std::thread receiver([&]() {
+        arch_net::DatagramBatch datagrams(batch, 2048);
+        char buf[2048];
+        while (arch_net::wait_fd_read_timeout(rfd, 200) > 0) {
+            int n = mode == UDPBatchMode::PerDatagram ? (::recv(rfd, buf, sizeof(buf), 0) > 0 ? 1 : 0)
+                                                      : datagrams.recv(rfd);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+            last = std::chrono::steady_clock::now();
+        }
+    });
+
+    std::string payload(size, 'u');
+    std::vector<struct iovec> iovs(batch, {(void*)payload.data(), size});
+    std::vector<struct mmsghdr> msgs(batch);
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    auto start = std::chrono::steady_clock::now();
+    for (int sent = 0; sent < count; sent += batch) {
+        if (mode == UDPBatchMode::PerDatagram) {
+            for (int i = 0; i < batch; i++) {
+                ::sendto(sfd, payload.data(), size, 0, (sockaddr*)&addr, len);
+            }
+            continue;
+        }
+        int vlen = mode == UDPBatchMode::Batched ? batch : 1;
+        for (int i = 0; i < vlen; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addr;
+            msgs[i].msg_hdr.msg_namelen = len;
+            msgs[i].msg_hdr.msg_iov = mode == UDPBatchMode::Batched ? &iovs[i] : iovs.data();
+            msgs[i].msg_hdr.msg_iovlen = mode == UDPBatchMode::Batched ? 1 : batch;
+        }
+        if (mode == UDPBatchMode::BatchedGSO) {
+            // one message, the kernel cuts it into batch datagrams
+            msgs[0].msg_hdr.msg_control = ctrl;
+            msgs[0].msg_hdr.msg_controllen = sizeof(ctrl);
+            auto cmsg = CMSG_FIRSTHDR(&msgs[0].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = size;
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+        if (arch_net::sendmmsg(sfd, msgs.data(), vlen, 0) < 0) {
+            break;
+        }
+    }
+    receiver.join();
+    ::close(rfd);
+    ::close(sfd);
+    double secs = std::chrono::duration<double>(last - start).count();
+    return secs > 0 ? received / secs : 0;
+}
+
+TEST(Test_UDP, bench_batched_pps)
+{
+    const int count = 200000;
+    for (size_t size : {64, 1200}) {
+        double plain = udp_pps(UDPBatchMode::PerDatagram, count, size);
+        double batched = udp_pps(UDPBatchMode::Batched, count, size);
+        double gso = udp_pps(UDPBatchMode::BatchedGSO, count, size);
+        std::cout << size << "B datagrams, sendto/recv: " << plain << " pps, sendmmsg/recvmmsg: " << batched
+                  << " pps, gso + recvmmsg: " << gso << " pps" << std::endl;
+        EXPECT_GT(batched, 0);
+    }
+}
+
+TEST(Test_UDP, test_datagram_batch_truncated)
+{
+    int rfd = arch_net::udp_socket();
+    int sfd = arch_net::udp_socket();
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(::bind(rfd, (sockaddr*)&addr, len), 0);
+    ASSERT_EQ(getsockname(rfd, (sockaddr*)&addr, &len), 0);
+
+    std::string big(3000, 'b'), small(100, 's');
+    ASSERT_EQ(::sendto(sfd, big.data(), big.size(), 0, (sockaddr*)&addr, len), (ssize_t)big.size());
+    ASSERT_EQ(::sendto(sfd, small.data(), small.size(), 0, (sockaddr*)&addr, len), (ssize_t)small.size());
+
+    // the first datagram overflows its slot, the second fits
+    arch_net::DatagramBatch batch(4, 2048);
+    ASSERT_EQ(batch.recv(rfd), 2);
+    ASSERT_TRUE(batch.truncated(0));
+    ASSERT_FALSE(batch.truncated(1));
+    ASSERT_EQ(std::string(batch.data(1), batch.size(1)), small);
+    ::close(rfd);
+    ::close(sfd);
+}
+
+// kcp_echo sends payload as one kcp message to an echo UDPSocketServer and returns the echo.
+// The client runs without congestion window and a window of 128 segments, so one kcp
+// flush emits the whole message: more than kMaxOutput segments, in gso runs
+static std::string kcp_echo(bool gro, const std::string& payload,
+                            const std::function<void(arch_net::UDPSocketStream*)>& prepare = nullptr) {
+    const size_t kMaxMessage = 256 * 1024;
+    arch_net::UDPSocketServer server;
+    server.set_gro(gro);
+    server.init("127.0.0.1", 0);
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    getsockname(server.get_listen_fd(), (sockaddr*)&addr, &len);
+    server.set_handler([&](arch_net::ISocketStream* stream) -> int {
+        std::vector<char> buf(kMaxMessage);
+        while (true) {
+            auto n = stream->recv(buf.data(), buf.size(), 0);
+            if (n <= 0) break;
+            if (stream->send(buf.data(), n, 0) < 0) break;
+        }
+        return 0;
+    });
+    std::thread serve([&]() { server.start(1); });
+
+    std::string echoed;
+    go[&]() {
+        arch_net::UDPSocketClient client;
+        auto stream = static_cast<arch_net::UDPSocketStream*>(client.connect("127.0.0.1", ntohs(addr.sin_port)));
+        if (!stream) {
+            return;
+        }
+        stream->set_nodelay(true, 10, 2, true);
+        stream->set_window(128, 128);
+        if (prepare) {
+            prepare(stream);
+        }
+        if (stream->send(payload.data(), payload.size(), 0) == (ssize_t)payload.size()) {
+            std::vector<char> buf(kMaxMessage);
+            auto n = stream->recv(buf.data(), buf.size(), 0);
+            if (n > 0) {
+                echoed.assign(buf.data(), n);
+            }
+        }
+        delete stream;
+    };
+    acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
+
+    // the echo handler waits for more, it is force closed
+    server.shutdown(100);
+    serve.join();
+    return echoed;
+}
+
+static std::string kcp_payload() {
+    // 72 full segments and a short one
+    std::string payload(100000, 0);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = 'a' + i % 26;
+    }
+    return payload;
+}
+
+TEST(Test_UDP, test_kcp_gro_round_trip)
+{
+    arch_net::UDPSocketStream::set_gso(true);
+    auto payload = kcp_payload();
+    ASSERT_EQ(kcp_echo(true, payload), payload);
+}
+
+TEST(Test_UDP, test_kcp_gso_fallback)
+{
+    auto payload = kcp_payload();
+
+    // SO_NO_CHECK makes the kernel refuse gso sends with EINVAL,
+    // the segments go out again one datagram each and gso stays off
+    arch_net::UDPSocketStream::set_gso(true);
+    ASSERT_EQ(kcp_echo(false, payload, [](arch_net::UDPSocketStream* stream) {
+        int on = 1;
+        setsockopt(stream->get_fd(), SOL_SOCKET, SO_NO_CHECK, &on, sizeof(on));
+    }), payload);
+    ASSERT_FALSE(arch_net::UDPSocketStream::gso_enabled());
+
+    // gso off from the start: plain sendmmsg batches
+    arch_net::UDPSocketStream::set_gso(false);
+    ASSERT_EQ(kcp_echo(false, payload), payload);
+    arch_net::UDPSocketStream::set_gso(true);
+}
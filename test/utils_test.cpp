@@ -4,6 +4,9 @@
 #include "gtest/gtest.h"
 #include "../utils/compression.h"
 #include "../utils/util.h"
+#include "../utils/object_pool.hpp"
+#include <fiber/fiber_tbox.hpp>
+#include <thread>
 
 TEST(Utils_Test, test_TimerProvider)
 {
@@ -98,4 +101,87 @@ TEST(test_Utils, Test_Compression)
 
         delete[] outbuf;
     }
-}
\ No newline at end of file
+}
+// the fiber_tbox based pool ObjectPool used to be, kept for comparison
+template<class Type>
+class TboxObjectPool {
+public:
+    TboxObjectPool(int size = DefaultSize, int max_size = MaxSize) : max_size_(max_size) {
+        for (int i = 0; i < size; i++) {
+            pool_.push(new Type);
+        }
+    }
+
+    Type* Get() {
+        auto t = pool_.pop(0);
+        return t == nullptr ? new Type : t;
+    }
+
+    void Release(Type* t) {
+        if (pool_.size() > max_size_) {
+            delete t;
+            return;
+        }
+        pool_.push(t);
+    }
+
+private:
+    acl::fiber_tbox<Type> pool_;
+    int max_size_;
+};
+
+struct PoolItem {
+    int64_t owner{-1};
+    char payload[64];
+};
+
+template<class Pool>
+static int64_t bench_pool(Pool& pool, int threads, int loops) {
+    std::atomic<int> broken{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&, i]() {
+            for (int n = 0; n < loops; n++) {
+                auto item = pool.Get();
+                if (item->owner != -1) {
+                    broken++;
+                }
+                item->owner = i;
+                item->owner = -1;
+                pool.Release(item);
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_EQ(broken.load(), 0);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+TEST(Utils_Test, test_ObjectPool)
+{
+    const int loops = 200000;
+    for (int threads : {1, 4, 16}) {
+        ObjectPool<PoolItem> lock_free;
+        TboxObjectPool<PoolItem> tbox;
+        auto a = bench_pool(lock_free, threads, loops);
+        auto b = bench_pool(tbox, threads, loops);
+        std::cout << "threads " << threads << " x " << loops << " get/release"
+                  << ", lock free: " << a << "us, fiber_tbox: " << b << "us" << std::endl;
+    }
+
+    // objects beyond max_size are freed, the pool never hands out one twice
+    ObjectPool<PoolItem> pool(2, 4);
+    std::vector<PoolItem*> items;
+    for (int i = 0; i < 16; i++) {
+        items.push_back(pool.Get());
+    }
+    std::sort(items.begin(), items.end());
+    ASSERT_EQ(std::unique(items.begin(), items.end()), items.end());
+    for (auto item : items) {
+        pool.Release(item);
+    }
+}
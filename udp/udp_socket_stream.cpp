@@ -1,16 +1,46 @@
 
 #include "udp_socket_stream.h"
+#include <netinet/udp.h>
 
 namespace arch_net {
 
+#ifdef UDP_SEGMENT
+// cleared the first time the kernel refuses a gso send
+static std::atomic<bool> gso_supported{true};
+#endif
+
+DatagramBatch::DatagramBatch(int slots, size_t slot_size)
+        : slots_(slots), slot_size_(slot_size), buf_(new char[slots * slot_size]),
+          msgs_(slots), iovs_(slots), addrs_(slots) {
+    for (int i = 0; i < slots_; i++) {
+        iovs_[i].iov_base = buf_.get() + i * slot_size_;
+        iovs_[i].iov_len = slot_size_;
+    }
+}
+
+int DatagramBatch::recv(int fd) {
+    for (int i = 0; i < slots_; i++) {
+        memset(&msgs_[i], 0, sizeof(msgs_[i]));
+        msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+        msgs_[i].msg_hdr.msg_name = &addrs_[i];
+        msgs_[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+    }
+    return arch_net::recvmmsg(fd, msgs_.data(), slots_, 0);
+}
+
 UDPSocketStream::UDPSocketStream(uint32_t conn_id, int fd, EndPoint addr, SideType type)
         : kcp_(ikcp_create(conn_id, this)), sock_fd_(fd), peer_addr_(addr), type_(type),
-          recv_buf_(2048, 0), timer_chn_(), recv_chn_(false) {
+          recv_buf_(2048, 0), timer_chn_(), recv_chn_(false), out_buf_(16 * 1024, 0) {
+    if (type_ == SideType::Client) {
+        in_batch_.reset(new DatagramBatch(kRecvBatch, kDatagramSize));
+    }
 #if defined(DISABLE_KCP)
 
 #else
     kcp_->output = UDPSocketStream::kcp_output;
-    ikcp_update(kcp_.get(), iclock());
+    update(iclock());
+    timer_wg_.add(1);
     go [&] {
         auto current = iclock();
         while (true) {
@@ -18,17 +48,22 @@ UDPSocketStream::UDPSocketStream(uint32_t conn_id, int fd, EndPoint addr, SideTy
             bool found;
             timer_chn_.pop(next_time - current, &found);
             if (found) {
+                timer_wg_.done();
                 return;
             }
             current = iclock();
-            ikcp_update(kcp_.get(), current);
+            update(current);
         }
     };
 #endif
 }
 
 UDPSocketStream::~UDPSocketStream() {
+#if !defined(DISABLE_KCP)
+    // the timer fiber uses the stream until it saw the stop
     timer_chn_.push(nullptr);
+    timer_wg_.wait();
+#endif
 }
 
 ssize_t UDPSocketStream::recv(Buffer *buff) {
@@ -53,15 +88,14 @@ ssize_t UDPSocketStream::recv(void *buf, size_t count, int flags) {
             // get one packet
             if (nrecv >= 0 ) return nrecv;
 
-            recv_buf_.Reset();
-            socklen_t addr_len = sizeof(struct sockaddr);
-            auto n = arch_net::recvfrom(sock_fd_, recv_buf_.WriteBegin(), recv_buf_.WritableBytes(),flags,
-                                        peer_addr_.to_sockaddr(), &addr_len);
+            auto n = in_batch_->recv(sock_fd_);
             if (n < 0) {
                 return -1;
             }
-            recv_buf_.WriteBytes(n);
-            ikcp_input(kcp_.get(), recv_buf_.data(), recv_buf_.size());
+            for (int i = 0; i < n; i++) {
+                memcpy(&peer_addr_.sock_addr, &in_batch_->addr(i), sizeof(peer_addr_.sock_addr));
+                ikcp_input(kcp_.get(), in_batch_->data(i), in_batch_->size(i));
+            }
             //ikcp_update(kcp_.get(), iclock());
         }
     } else {
@@ -101,33 +135,144 @@ ssize_t UDPSocketStream::send(const void *buf, size_t count, int flags) {
     if (ret < 0) {
         return -1;
     }
-    ikcp_update(kcp_.get(), iclock());
+    update(iclock());
     return count;
 }
 
 ssize_t UDPSocketStream::send(const struct iovec *iov, int iovcnt, int flags) {
-    return 0;
+    return writev_by_send(this, iov, iovcnt);
 }
 
 ssize_t UDPSocketStream::sendfile(int in_fd, off_t offset, size_t count) {
-    return 0;
+    return sendfile_by_copy(this, in_fd, offset, count);
 }
 
 int UDPSocketStream::get_fd() {
-    return 0;
+    // server side streams share the listen fd, it isn't theirs to hand out
+    return type_ == SideType::Client ? sock_fd_ : -1;
+}
+
+void UDPSocketStream::set_gso(bool on) {
+#ifdef UDP_SEGMENT
+    gso_supported.store(on, std::memory_order_relaxed);
+#endif
+}
+
+bool UDPSocketStream::gso_enabled() {
+#ifdef UDP_SEGMENT
+    return gso_supported.load(std::memory_order_relaxed);
+#else
+    return false;
+#endif
 }
 
 int UDPSocketStream::kcp_output(const char *buf, int len, struct IKCPCB *kcp, void *user) {
     auto* stream = (UDPSocketStream*)user;
-    socklen_t addr_len = sizeof(struct sockaddr);
-    auto n = arch_net::sendto(stream->sock_fd_, buf, len, 0, (stream->peer_addr_.to_sockaddr()),addr_len);
-    if (n < 0) {
-        LOG(ERROR) << "send error";
-        return -1;
+    // kcp reuses buf for the next segment, it is copied and sent when the tick is done
+    stream->out_buf_.Append(buf, len);
+    stream->out_lens_.push_back(len);
+    if (stream->out_lens_.size() >= kMaxOutput) {
+        stream->flush_output();
     }
-    //LOG(INFO) << "kcp out put";
-    //ikcp_update(stream->kcp_.get(), iclock());
-    return n;
+    return len;
+}
+
+void UDPSocketStream::update(IUINT32 current) {
+    ikcp_update(kcp_.get(), current);
+    flush_output();
+}
+
+void UDPSocketStream::flush_output() {
+    size_t count = out_lens_.size();
+    if (count == 0) {
+        return;
+    }
+    defer({
+        out_buf_.Reset();
+        out_lens_.clear();
+    });
+
+    out_iovs_.resize(count);
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        out_iovs_[i].iov_base = (char*)out_buf_.data() + offset;
+        out_iovs_[i].iov_len = out_lens_[i];
+        offset += out_lens_[i];
+    }
+
+    socklen_t addr_len = peer_addr_.sock_addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    bool gso = false;
+#ifdef UDP_SEGMENT
+    gso = gso_supported.load(std::memory_order_relaxed);
+    const size_t ctrl_size = CMSG_SPACE(sizeof(uint16_t));
+    out_ctrl_.assign(count * ctrl_size, 0);
+#endif
+
+    out_msgs_.resize(count);
+    size_t msgs = 0;
+    for (size_t i = 0; i < count;) {
+        size_t end = i + 1;
+        if (gso) {
+            // a run of equal segments, a shorter one may end it
+            size_t bytes = out_lens_[i];
+            while (end < count && out_lens_[end] <= out_lens_[i] && bytes + out_lens_[end] <= kMaxGSOBytes) {
+                bytes += out_lens_[end];
+                if (out_lens_[end++] < out_lens_[i]) {
+                    break;
+                }
+            }
+        }
+
+        auto& msg = out_msgs_[msgs].msg_hdr;
+        memset(&out_msgs_[msgs], 0, sizeof(out_msgs_[msgs]));
+        msg.msg_name = peer_addr_.to_sockaddr();
+        msg.msg_namelen = addr_len;
+        msg.msg_iov = &out_iovs_[i];
+        msg.msg_iovlen = end - i;
+#ifdef UDP_SEGMENT
+        if (end - i > 1) {
+            msg.msg_control = out_ctrl_.data() + msgs * ctrl_size;
+            msg.msg_controllen = ctrl_size;
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = out_lens_[i];
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+#endif
+        msgs++;
+        i = end;
+    }
+
+    int sent = arch_net::sendmmsg(sock_fd_, out_msgs_.data(), msgs, 0);
+    if (sent == (int)msgs) {
+        return;
+    }
+#ifdef UDP_SEGMENT
+    if (gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+        // no gso on this kernel or device, the rest goes out one datagram each
+        LOG(ERROR) << "udp gso unsupported, fall back to plain datagrams: " << strerror(errno);
+        gso_supported.store(false, std::memory_order_relaxed);
+        size_t done = 0;
+        for (int m = 0; m < std::max(sent, 0); m++) {
+            done += out_msgs_[m].msg_hdr.msg_iovlen;
+        }
+        for (size_t i = done; i < count; i++) {
+            memset(&out_msgs_[i - done], 0, sizeof(out_msgs_[0]));
+            auto& msg = out_msgs_[i - done].msg_hdr;
+            msg.msg_name = peer_addr_.to_sockaddr();
+            msg.msg_namelen = addr_len;
+            msg.msg_iov = &out_iovs_[i];
+            msg.msg_iovlen = 1;
+        }
+        if (arch_net::sendmmsg(sock_fd_, out_msgs_.data(), count - done, 0) == (int)(count - done)) {
+            return;
+        }
+    }
+#endif
+    // kcp retransmits what did not go out
+    LOG(ERROR) << "send error " << strerror(errno);
 }
 
 ISocketStream *UDPSocketClient::connect(const std::string &remote, int port) {
@@ -168,6 +313,12 @@ ISocketStream *UDPSocketClient::connect(EndPoint remote) {
 
 int UDPSocketServer::init(const std::string &addr, uint16_t port) {
     int fd = udp_server(addr.c_str(), port);
+#ifdef UDP_GRO
+    int on = 1;
+    if (gro_ && setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        LOG(ERROR) << "setsockopt UDP_GRO error " << strerror(errno);
+    }
+#endif
     listen_fds_.push_back(fd);
     return 0;
 }
@@ -186,34 +337,59 @@ ISocketServer *UDPSocketServer::set_handler(ISocketServer::Handler &&handler) {
 }
 
 int UDPSocketServer::accept_loop(int index) {
-    Buffer recv_buf(2048, 0);
-    EndPoint client;
-    socklen_t addr_len = sizeof(struct sockaddr);
+    DatagramBatch batch(UDPSocketStream::kRecvBatch, gro_ ? 65536 : UDPSocketStream::kDatagramSize);
+    std::vector<UDPSocketStream*> woken;
     int listen_fd = listen_fds_[index];
     while (true) {
-        auto ret = arch_net::recvfrom(listen_fd, recv_buf.WriteBegin(),
-                                      recv_buf.WritableBytes(), 0, client.to_sockaddr(), &addr_len);
+        auto ret = batch.recv(listen_fd);
+        if (closing_.load(std::memory_order_acquire)) {
+            break;
+        }
         if(ret < 0 ) {
             LOG(ERROR) << "recv error";
             acl_fiber_delay(1);
             continue;
         }
-        recv_buf.WriteBytes(ret);
-
-        uint32_t conn_id = recv_buf.PeekUInt32();
-        std::string client_addr = ToIPPort(&client.sock_addr);
-        auto it = streams_.find(client_addr);
-        if (it == streams_.end()) {
-            auto stream = new UDPSocketStream(conn_id, listen_fd, client, SideType::Server);
-            streams_.emplace(client_addr, stream);
-            go[&] {
-                this->handler(this->handler_, client_addr, stream);
-            };
-        } else {
-            it->second->recv_done(&recv_buf);
+
+        streams_mutex_.lock();
+        for (int i = 0; i < ret; i++) {
+            if (batch.truncated(i) || batch.size(i) < sizeof(uint32_t)) {
+                continue;
+            }
+            EndPoint client;
+            memcpy(&client.sock_addr, &batch.addr(i), sizeof(client.sock_addr));
+            std::string client_addr = ToIPPort(&client.sock_addr);
+            auto it = streams_.find(client_addr);
+            if (it == streams_.end()) {
+                // draining: the live streams keep getting their datagrams, new peers are turned away
+                if (stopping_.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                uint32_t conn_id;
+                memcpy(&conn_id, batch.data(i), sizeof(conn_id));
+                conn_id = ntohl(conn_id);
+                auto stream = new UDPSocketStream(conn_id, listen_fd, client, SideType::Server);
+                streams_.emplace(client_addr, stream);
+                // registered before the handler runs, shutdown can't miss it
+                conns_.add(stream);
+                go[this, client_addr, stream] {
+                    this->handler(client_addr, stream);
+                };
+            } else {
+                it->second->recv_datagram(batch.data(i), batch.size(i));
+                if (std::find(woken.begin(), woken.end(), it->second) == woken.end()) {
+                    woken.push_back(it->second);
+                }
+            }
         }
-        recv_buf.Reset();
+        // one wake up per stream, its recv feeds everything queued to kcp at once
+        for (auto stream : woken) {
+            stream->recv_done();
+        }
+        streams_mutex_.unlock();
+        woken.clear();
     }
+    return 0;
 }
 
 int UDPSocketServer::start(int thread_num) {
@@ -224,7 +400,7 @@ int UDPSocketServer::start(int thread_num) {
                 go[&] {
                     this->accept_loop(i);
                 };
-                acl::fiber::schedule_with(acl::FIBER_EVENT_T_KERNEL);
+                schedule_with_engine(io_engine_);
             });
         threads_.emplace_back(std::move(thread));
     }
@@ -236,7 +412,35 @@ int UDPSocketServer::start(int thread_num) {
 }
 
 void UDPSocketServer::stop() {
+    shutdown(kDefaultDrainTimeout);
+}
 
+int UDPSocketServer::shutdown(int drain_timeout_ms) {
+    if (stopping_.exchange(true)) {
+        return 0;
+    }
+    // the receive loops keep feeding the live streams while they drain,
+    // they only stop creating new ones. A stream created before they saw
+    // stopping_ is in conns_ once the mutex is released
+    streams_mutex_.lock();
+    streams_mutex_.unlock();
+    int forced = 0;
+    if (!conns_.wait_drained(drain_timeout_ms)) {
+        forced = conns_.for_each([](ISocketStream* stream) {
+            static_cast<UDPSocketStream*>(stream)->shutdown_recv();
+        });
+        LOG(ERROR) << "udp server stop, force close " << forced << " streams";
+        conns_.wait_drained(kForceCloseWait);
+    }
+    // SHUT_RD wakes up the receive loops
+    closing_.store(true, std::memory_order_release);
+    for (auto fd : listen_fds_) {
+        ::shutdown(fd, SHUT_RD);
+    }
+    for (auto fd : listen_fds_) {
+        ::close(fd);
+    }
+    return forced;
 }
 
 }
\ No newline at end of file
@@ -14,6 +14,29 @@ enum SideType {
 
 static bool RecvDone = 1;
 
+// DatagramBatch holds the buffers recvmmsg fills, slots datagrams of slot_size bytes each
+class DatagramBatch {
+public:
+    DatagramBatch(int slots, size_t slot_size);
+
+    // recv waits for datagrams on fd and returns how many arrived, -1 on error
+    int recv(int fd);
+
+    const char* data(int i) const { return buf_.get() + i * slot_size_; }
+    size_t size(int i) const { return msgs_[i].msg_len; }
+    // the datagram did not fit its slot
+    bool truncated(int i) const { return msgs_[i].msg_hdr.msg_flags & MSG_TRUNC; }
+    const sockaddr_storage& addr(int i) const { return addrs_[i]; }
+
+private:
+    int slots_;
+    size_t slot_size_;
+    std::unique_ptr<char[]> buf_;
+    std::vector<struct mmsghdr> msgs_;
+    std::vector<struct iovec> iovs_;
+    std::vector<sockaddr_storage> addrs_;
+};
+
 class UDPSocketStream : public ISocketStream {
 public:
     UDPSocketStream(uint32_t conn_id, int fd, EndPoint addr, SideType type);
@@ -39,11 +62,39 @@ public:
 
     int close() override { return arch_net::close(sock_fd_); }
 
-    void recv_done(Buffer* buff) {
-        recv_buf_.Append(buff->NextAll());
+    // the server queues every datagram of a receive batch, then wakes the stream once
+    void recv_datagram(const char* data, size_t len) {
+        recv_buf_.Append(data, len);
+    }
+
+    void recv_done() {
         recv_chn_.push(&RecvDone);
     }
 
+    // datagrams received per recvmmsg
+    static const int kRecvBatch = 16;
+    static const size_t kDatagramSize = 2048;
+
+    // server side streams share the listen fd, shutdown_recv makes a blocked recv return 0
+    void shutdown_recv() {
+        recv_chn_.push(nullptr);
+    }
+
+    // set_nodelay and set_window tune the kcp engine, see ikcp_nodelay and ikcp_wndsize
+    void set_nodelay(bool nodelay, int interval_ms, int fast_resend, bool no_cwnd) {
+        ikcp_nodelay(kcp_.get(), nodelay, interval_ms, fast_resend, no_cwnd);
+    }
+
+    void set_window(int send_window, int recv_window) {
+        ikcp_wndsize(kcp_.get(), send_window, recv_window);
+    }
+
+    // set_gso turns UDP_SEGMENT sends on or off for the process,
+    // the first gso send the kernel refuses turns them off as well
+    static void set_gso(bool on);
+
+    static bool gso_enabled();
+
 private:
     struct KCPDeleter {
         void operator()(ikcpcb* b) { ikcp_release(b); }
@@ -51,6 +102,17 @@ private:
 
     static int kcp_output(const char *buf, int len, struct IKCPCB *kcp, void *user);
 
+    // update runs the kcp clock and sends the segments it produced in one batch
+    void update(IUINT32 current);
+
+    // flush_output sends the queued segments with one sendmmsg, runs of equal sized
+    // segments go out as one UDP_SEGMENT (gso) message where the kernel supports it
+    void flush_output();
+
+    // segments queued before a flush is forced, the kernel takes at most 64 per gso message
+    static const size_t kMaxOutput = 64;
+    static const size_t kMaxGSOBytes = 65000;
+
 private:
     std::unique_ptr<ikcpcb, KCPDeleter> kcp_;
     int sock_fd_;
@@ -58,7 +120,17 @@ private:
     SideType type_;
     Buffer recv_buf_;
     acl::fiber_tbox<bool> timer_chn_;
+    acl::wait_group timer_wg_;
     acl::fiber_tbox<bool> recv_chn_;
+
+    // kcp segments waiting for flush_output, back to back in out_buf_
+    Buffer out_buf_;
+    std::vector<uint32_t> out_lens_;
+    std::vector<struct mmsghdr> out_msgs_;
+    std::vector<struct iovec> out_iovs_;
+    std::vector<char> out_ctrl_;
+    // client streams own their socket and receive in batches
+    std::unique_ptr<DatagramBatch> in_batch_;
 };
 
 class UDPSocketClient : public ISocketClient {
@@ -85,10 +157,30 @@ public:
 
     void stop() override;
 
+    int shutdown(int drain_timeout_ms) override;
+
+    ISocketServer* set_io_engine(IOEngine engine) override {
+        io_engine_ = engine;
+        return this;
+    }
+
+    int get_listen_fd() override { return listen_fds_.empty() ? -1 : listen_fds_[0]; }
+
+    // set_gro lets the kernel coalesce the datagrams of a peer (UDP_GRO) into one receive,
+    // the receive slots grow to 64KB for it. Must be set before init
+    UDPSocketServer* set_gro(bool on) {
+        gro_ = on;
+        return this;
+    }
+
 protected:
-    void handler(const Handler& m_handler, const std::string& cli_addr, ISocketStream* sess) {
-        m_handler(sess);
+    // accept_loop registered sess in conns_
+    void handler(const std::string& cli_addr, ISocketStream* sess) {
+        handler_(sess);
+        conns_.remove(sess);
+        streams_mutex_.lock();
         streams_.erase(cli_addr);
+        streams_mutex_.unlock();
         delete sess;
     }
 
@@ -97,7 +189,14 @@ protected:
 private:
     std::vector<int> listen_fds_;
     Handler handler_;
+    IOEngine io_engine_{IOEngine::Epoll};
+    bool gro_{false};
     std::vector<std::unique_ptr<std::thread>> threads_;
+    // stopping_ turns new peers away, closing_ ends the receive loops once drained
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> closing_{false};
+    ConnectionTracker conns_;
+    acl::fiber_mutex streams_mutex_;
     std::unordered_map<std::string, UDPSocketStream*> streams_;
     std::unordered_map<EndPoint, UDPSocketStream*> ep_streams_;
 
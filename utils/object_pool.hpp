@@ -1,25 +1,45 @@
-
 #pragma once
 
 #include "iostream"
-#include "fiber/fiber_tbox.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
 
 const int DefaultSize = 10;
 const int MaxSize = 100;
 
+// ObjectPool caches up to max_size idle objects (rounded up to a power of two)
+// in a bounded lock-free MPMC ring (Vyukov), so Get/Release from any thread or
+// fiber never take a lock. Get falls back to new when the ring is empty,
+// Release deletes when it is full.
 template<class Type>
 class ObjectPool {
 public:
     ObjectPool(int size = DefaultSize, int max_size = MaxSize)
-    : pool_(), size_(size), max_size_(max_size) {
+    : size_(size), max_size_(max_size) {
+        capacity_ = 1;
+        while (capacity_ < (size_t)std::max(max_size, size)) {
+            capacity_ <<= 1;
+        }
+        mask_ = capacity_ - 1;
+        cells_.reset(new Cell[capacity_]);
+        for (size_t i = 0; i < capacity_; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
         for (int i = 0; i < size; i++) {
-            auto t = new Type;
-            pool_.push(t);
+            push(new Type);
+        }
+    }
+
+    ~ObjectPool() {
+        Type* t;
+        while ((t = pop()) != nullptr) {
+            delete t;
         }
     }
 
     Type* Get() {
-        auto t = pool_.pop(0);
+        auto t = pop();
         if (t == nullptr) {
             return new Type;
         }
@@ -27,15 +47,70 @@ public:
     }
 
     void Release(Type* t) {
-        if (pool_.size() > max_size_) {
+        if (!push(t)) {
             delete t;
-            return;
         }
-        pool_.push(t);
     }
 
 private:
-    acl::fiber_tbox<Type> pool_;
+    struct Cell {
+        std::atomic<size_t> seq;
+        Type* data;
+    };
+
+    bool push(Type* t) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // full
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = t;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    Type* pop() {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // empty
+                return nullptr;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        Type* t = cell->data;
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return t;
+    }
+
+private:
+    std::unique_ptr<Cell[]> cells_;
+    size_t capacity_;
+    size_t mask_;
+    // producers and consumers hammer different cache lines
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<size_t> dequeue_pos_{0};
     int size_;
     int max_size_;
 };